@@ -3,40 +3,47 @@
 
 #include "quash.h"
 #include "arrays.h"
+#include "stats.h"
+#include "memstats.h"
 
 
 static void grow_string_offsets(StringDynamicBuffer *array) {
     array->strings_reserved *= 2;
-    array->strings = realloc(array->strings, array->strings_reserved * sizeof *array->strings);
+    array->strings = mem_realloc(MEM_TOKENIZER, array->strings, array->strings_reserved * sizeof *array->strings);
+    array->flags = mem_realloc(MEM_TOKENIZER, array->flags, array->strings_reserved * sizeof *array->flags);
+    STAT_ADD(bytes_allocated, array->strings_reserved * (sizeof *array->strings + sizeof *array->flags));
 }
 
 static void grow_string_buffer(StringDynamicBuffer *array) {
     array->buffer_reserved *= 2;
-    array->buffer = realloc(array->buffer, array->buffer_reserved * sizeof *array->buffer);
+    array->buffer = mem_realloc(MEM_TOKENIZER, array->buffer, array->buffer_reserved * sizeof *array->buffer);
+    STAT_ADD(bytes_allocated, array->buffer_reserved * sizeof *array->buffer);
 }
 
 void create_string_array(StringDynamicBuffer *array) {
     array->strings_reserved = STRING_DYNARRAY_DEFAULT_SIZE;
     array->strings_used = 0;
-    array->strings = malloc(STRING_DYNARRAY_DEFAULT_SIZE * sizeof *array->strings);
+    array->strings = mem_malloc(MEM_TOKENIZER, STRING_DYNARRAY_DEFAULT_SIZE * sizeof *array->strings);
+    array->flags = mem_malloc(MEM_TOKENIZER, STRING_DYNARRAY_DEFAULT_SIZE * sizeof *array->flags);
 
     array->buffer_reserved = STRING_DYNARRAY_BUF_SIZE;
     array->buffer_used = 0;
-    array->buffer = malloc(STRING_DYNARRAY_BUF_SIZE * sizeof *array->buffer);
+    array->buffer = mem_malloc(MEM_TOKENIZER, STRING_DYNARRAY_BUF_SIZE * sizeof *array->buffer);
+    STAT_ADD(bytes_allocated, STRING_DYNARRAY_DEFAULT_SIZE * (sizeof *array->strings + sizeof *array->flags)
+                              + STRING_DYNARRAY_BUF_SIZE * sizeof *array->buffer);
 }
 
 void append_string(StringDynamicBuffer *array, char *string, size_t bytes) {
     if (!string) {
+        array->flags[array->strings_used] = 0;
         array->strings[array->strings_used++] = array->buffer_used;
         array->buffer[array->buffer_used + 1] = '\0';
         array->buffer_used += 1;
         return;
     }
 
-    size_t len = strlen(string);
-    if (bytes > 0 && bytes < len) {
-        len = bytes;
-    }
+    /* `string` may run on to the end of the line, don't measure past `bytes` */
+    size_t len = bytes > 0 ? strnlen(string, bytes) : strlen(string);
 
     if (array->strings_used + 1 == array->strings_reserved) {
         grow_string_offsets(array);
@@ -46,6 +53,7 @@ void append_string(StringDynamicBuffer *array, char *string, size_t bytes) {
         grow_string_buffer(array);
     }
 
+    array->flags[array->strings_used] = 0;
     array->strings[array->strings_used++] = array->buffer_used;
 
     strncpy(array->buffer + array->buffer_used, string, len + 1);
@@ -54,21 +62,24 @@ void append_string(StringDynamicBuffer *array, char *string, size_t bytes) {
 }
 
 void free_string_array(StringDynamicBuffer *array) {
-    free(array->strings);
-    free(array->buffer);
+    mem_free(MEM_TOKENIZER, array->strings);
+    mem_free(MEM_TOKENIZER, array->flags);
+    mem_free(MEM_TOKENIZER, array->buffer);
     memset(array, 0, sizeof *array);
 }
 
 
 static void grow_token_array(TokenDynamicArray *array) {
     array->slots *= 2;
-    array->tuples = realloc(array->tuples, array->slots * sizeof *array->tuples);
+    array->tuples = mem_realloc(MEM_TOKENIZER, array->tuples, array->slots * sizeof *array->tuples);
+    STAT_ADD(bytes_allocated, array->slots * sizeof *array->tuples);
 }
 
 void create_token_array(TokenDynamicArray *array) {
     array->slots = TOKEN_DYNARRAY_DEFAULT_SIZE;
     array->length = 0;
-    array->tuples = malloc(TOKEN_DYNARRAY_DEFAULT_SIZE * sizeof *array->tuples);
+    array->tuples = mem_malloc(MEM_TOKENIZER, TOKEN_DYNARRAY_DEFAULT_SIZE * sizeof *array->tuples);
+    STAT_ADD(bytes_allocated, TOKEN_DYNARRAY_DEFAULT_SIZE * sizeof *array->tuples);
 }
 
 void append_token(TokenDynamicArray *array, Token tuple) {
@@ -76,14 +87,21 @@ void append_token(TokenDynamicArray *array, Token tuple) {
         grow_token_array(array);
     }
 
+    /* the text was malloc'd by whichever expansion made the token, it is the array's now */
     array->tuples[array->length++] = tuple;
+    mem_adopt(MEM_TOKENIZER, tuple.text);
+
+    STAT_INC(tokens);
+    if (tuple.text) {
+        STAT_ADD(bytes_allocated, strlen(tuple.text) + 1);
+    }
 }
 
 void free_token_array(TokenDynamicArray *array) {
     for (size_t i = 0; i < array->length; i++) {
-        free(array->tuples[i].text);
+        mem_free(MEM_TOKENIZER, array->tuples[i].text);
     }
 
-    free(array->tuples);
+    mem_free(MEM_TOKENIZER, array->tuples);
     memset(array, 0, sizeof *array);
 }
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "quash.h"
+#include "arrays.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "jobs.h"
+#include "hash.h"
+#include "eval.h"
+
+/*
+ Microbenchmarks for the shell's hot paths, built and run with `make bench`.
+ Every benchmark is calibrated to run for at least BENCH_MIN_NS per
+ repetition and the median of BENCH_REPETITIONS repetitions is reported,
+ along with the heap allocations made per operation.
+*/
+
+#define BENCH_REPETITIONS 7
+#define BENCH_MIN_NS 50000000L
+
+/* an embedded context, like a libqsh user's */
+static QshContext context;
+
+/* ------------------------------- */
+/*       allocation counting       */
+/* ------------------------------- */
+
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+#ifdef __GLIBC__
+/* glibc supports replacing malloc, its own calls are routed through these too */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    allocated_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    allocated_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+#endif
+
+/* ------------------------------- */
+/*             harness             */
+/* ------------------------------- */
+
+typedef void (*BenchFunction)(void *arg, long iterations);
+
+typedef struct _BenchResult {
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+} BenchResult;
+
+static FILE *report;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_results(const void *a, const void *b) {
+    double lhs = ((const BenchResult*) a)->ns_per_op;
+    double rhs = ((const BenchResult*) b)->ns_per_op;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static BenchResult measure(BenchFunction fn, void *arg, long iterations) {
+    size_t start_allocations = allocations;
+    size_t start_bytes = allocated_bytes;
+    long start = now_ns();
+
+    fn(arg, iterations);
+
+    long elapsed = now_ns() - start;
+    BenchResult result = {
+        .ns_per_op = (double) elapsed / iterations,
+        .allocs_per_op = (double) (allocations - start_allocations) / iterations,
+        .bytes_per_op = (double) (allocated_bytes - start_bytes) / iterations,
+    };
+
+    return result;
+}
+
+static void bench(const char *name, BenchFunction fn, void *arg) {
+    BenchResult results[BENCH_REPETITIONS];
+    long iterations = 1;
+
+    /* grow the iteration count until one repetition takes long enough */
+    for (;;) {
+        long start = now_ns();
+        fn(arg, iterations);
+        if (now_ns() - start >= BENCH_MIN_NS / 10 || iterations >= (1L << 30)) {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    iterations *= 10;
+
+    for (int r = 0; r < BENCH_REPETITIONS; r++) {
+        results[r] = measure(fn, arg, iterations);
+    }
+
+    qsort(results, BENCH_REPETITIONS, sizeof *results, compare_results);
+    BenchResult median = results[BENCH_REPETITIONS / 2];
+
+    fprintf(report, "%-32s %12.1f %12.2f %12.1f %10ld\n", name,
+        median.ns_per_op, median.allocs_per_op, median.bytes_per_op, iterations);
+    fflush(report);
+}
+
+/* ------------------------------- */
+/*           benchmarks            */
+/* ------------------------------- */
+
+static const char *sample_line = "ls -la /tmp | grep foo > out.txt && echo done || cat < in.txt &";
+
+static void bench_tokenize(void *arg, long iterations) {
+    char *line = arg;
+
+    for (long i = 0; i < iterations; i++) {
+        TokenDynamicArray tokens;
+        create_token_array(&tokens);
+        tokenize(&tokens, line);
+        free_token_array(&tokens);
+    }
+}
+
+static void bench_parse(void *arg, long iterations) {
+    TokenDynamicArray *tokens = arg;
+
+    for (long i = 0; i < iterations; i++) {
+        AST ast;
+        parse_ast(&ast, tokens);
+        free_parse_tree(&ast);
+    }
+}
+
+static void bench_hash(void *arg, long iterations) {
+    JobHashTable *table = arg;
+    Job job;
+
+    /* one iteration is an insert, a get and a delete */
+    for (long i = 0; i < iterations; i++) {
+        pid_t key = (i & 255) + 1;
+        hash_table_insert(table, key, &job);
+        hash_table_get(table, key);
+        hash_table_delete(table, key);
+    }
+}
+
+static void bench_hash_loaded(void *arg, long iterations) {
+    JobHashTable *table = arg;
+    Job job;
+
+    /* the same with 256 other pids already spread over the buckets */
+    for (long i = 0; i < iterations; i++) {
+        pid_t key = (i & 255) + 1000;
+        hash_table_insert(table, key, &job);
+        hash_table_get(table, key);
+        hash_table_delete(table, key);
+    }
+}
+
+static void bench_jobs(void *arg, long iterations) {
+    char **argv = arg;
+
+    for (long i = 0; i < iterations; i++) {
+        job_t job = create_job(&context.jobs);
+        register_process(&context.jobs, 2, argv, job, 100000 + (i & 1023));
+        free_job(&context.jobs, job);
+    }
+}
+
+static void bench_eval_line(void *arg, long iterations) {
+    char *line = arg;
+
+    for (long i = 0; i < iterations; i++) {
+        eval_line(&context, line);
+    }
+}
+
+int main() {
+    /* benchmarked builtins print to stdout, keep the report on the real one */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    init_context(&context, 0);
+
+    fprintf(report, "%-32s %12s %12s %12s %10s\n", "benchmark", "ns/op", "allocs/op", "bytes/op", "iters");
+
+    char line[256];
+    strcpy(line, sample_line);
+    bench("tokenize", bench_tokenize, line);
+
+    TokenDynamicArray tokens;
+    create_token_array(&tokens);
+    tokenize(&tokens, line);
+    bench("parse_ast+free", bench_parse, &tokens);
+
+    JobHashTable table;
+    init_hash_table(&table);
+    bench("hash insert/get/delete", bench_hash, &table);
+    for (pid_t key = 1; key <= 256; key++) {
+        hash_table_insert(&table, key, NULL);
+    }
+    bench("hash insert/get/delete (256)", bench_hash_loaded, &table);
+    free_hash_table_buckets(&table);
+
+    char *job_argv[] = { "sleep", "10", NULL };
+    bench("job create/register/free", bench_jobs, job_argv);
+
+    static char builtin_line[] = "cd .";
+    static char command_line[] = "true";
+    static char pipeline2[] = "true | true";
+    static char pipeline4[] = "true | true | true | true";
+    static char pipeline8[] = "true | true | true | true | true | true | true | true";
+
+    bench("eval_line builtin", bench_eval_line, builtin_line);
+    bench("eval_line command", bench_eval_line, command_line);
+    bench("eval_line pipeline x2", bench_eval_line, pipeline2);
+    bench("eval_line pipeline x4", bench_eval_line, pipeline4);
+    bench("eval_line pipeline x8", bench_eval_line, pipeline8);
+
+    free_token_array(&tokens);
+    free_context(&context);
+    fclose(report);
+    return 0;
+}
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "quash.h"
+#include "fds.h"
+#include "complete.h"
+
+/*
+ Command name completion for both line editors. A background thread lists
+ the executables in every `$PATH` directory into a sorted index and, on
+ linux, watches the directories with inotify to rebuild it when something
+ is installed or removed. A Tab only binary searches the current index
+ under a lock that the indexer holds just long enough to swap in a new one,
+ so no directory is read or stat'd while the user is typing.
+*/
+
+/* a burst of changes, like a package install, is indexed once it settles */
+#define SETTLE_MS 100
+
+typedef struct _CommandIndex {
+    char **names;       /* sorted and unique */
+    size_t length;
+    size_t slots;
+} CommandIndex;
+
+static const char *builtin_names[] = {
+    "alias", "batch", "bg", "cd", "clear", "echo", "exec", "exit", "export", "fanout", "fg",
+    "function", "history", "jobs", "kill", "memo", "pwd", "qshstat", "quit", "sched", "set", "time",
+    "timeout", "unalias", "unfunction",
+};
+
+/* words after which the next word is a command again */
+static const char *prefix_words[] = { "batch", "exec", "memo", "sched", "time" };
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static CommandIndex *current = NULL;
+static char *indexed_path = NULL;       /* the `$PATH` the indexer is asked to index */
+static int wake_fds[2] = { -1, -1 };    /* a byte here makes the indexer start over */
+
+static void add_name(CommandIndex *index, const char *name) {
+    if (index->length == index->slots) {
+        index->slots = index->slots ? index->slots * 2 : 256;
+        index->names = realloc(index->names, index->slots * sizeof *index->names);
+    }
+
+    index->names[index->length++] = strdup(name);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void free_index(CommandIndex *index) {
+    if (index == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < index->length; i++) {
+        free(index->names[i]);
+    }
+    free(index->names);
+    free(index);
+}
+
+static CommandIndex* builtin_index() {
+    CommandIndex *index = calloc(1, sizeof *index);
+
+    for (size_t i = 0; i < sizeof builtin_names / sizeof *builtin_names; i++) {
+        add_name(index, builtin_names[i]);
+    }
+
+    return index;
+}
+
+static void scan_directory(CommandIndex *index, const char *path) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    struct stat st;
+
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        /* follows symlinks, most of /usr/bin is links to somewhere else */
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0
+            && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            add_name(index, entry->d_name);
+        }
+    }
+
+    closedir(dir);
+}
+
+/*
+ relative entries in `$PATH` resolve against whatever the cwd is when a
+ command runs, so they aren't indexed. each directory is watched before
+ it is read, so a change made during the scan still causes another
+*/
+static CommandIndex* scan_path(const char *path, int watch) {
+    CommandIndex *index = builtin_index();
+    char *dirs = strdup(path);
+    char *save = NULL;
+
+    for (char *dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        if (dir[0] != '/') {
+            continue;
+        }
+
+#ifdef __linux__
+        if (watch != -1) {
+            inotify_add_watch(watch, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        }
+#else
+        (void) watch;
+#endif
+        scan_directory(index, dir);
+    }
+    free(dirs);
+
+    qsort(index->names, index->length, sizeof *index->names, compare_names);
+
+    /* the same name in two directories, or a builtin that is also a program */
+    size_t unique = 0;
+    for (size_t i = 0; i < index->length; i++) {
+        if (unique > 0 && strcmp(index->names[unique - 1], index->names[i]) == 0) {
+            free(index->names[i]);
+        } else {
+            index->names[unique++] = index->names[i];
+        }
+    }
+    index->length = unique;
+
+    return index;
+}
+
+static void drain(int fd) {
+    char buffer[4096];
+    while (read(fd, buffer, sizeof buffer) > 0);
+}
+
+/* block until `$PATH` is changed or, once things are quiet, a directory in it */
+static void wait_for_change(int watch) {
+    struct pollfd fds[2] = {
+        { .fd = wake_fds[0], .events = POLLIN },
+        { .fd = watch, .events = POLLIN },
+    };
+    int count = watch != -1 ? 2 : 1;
+
+    while (poll(fds, count, -1) == -1);
+
+    if (fds[0].revents & POLLIN) {
+        drain(wake_fds[0]);
+        return;
+    }
+
+    do {
+        drain(watch);
+    } while (poll(&fds[1], 1, SETTLE_MS) > 0);
+}
+
+static void* indexer(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        int watch = -1;
+#ifdef __linux__
+        /* a fresh instance drops the watches on directories no longer in `$PATH` */
+        watch = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+#endif
+
+        pthread_mutex_lock(&index_lock);
+        char *path = strdup(indexed_path);
+        pthread_mutex_unlock(&index_lock);
+
+        CommandIndex *index = scan_path(path, watch);
+        free(path);
+
+        pthread_mutex_lock(&index_lock);
+        CommandIndex *old = current;
+        current = index;
+        pthread_mutex_unlock(&index_lock);
+        free_index(old);
+
+        wait_for_change(watch);
+        if (watch != -1) {
+            close(watch);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start indexing the commands in `$PATH` in the background. Until the first
+ * scan is done only builtins complete.
+ */
+void command_index_start() {
+    const char *path = getenv("PATH");
+    pthread_t thread;
+    sigset_t all, old;
+
+    if (current != NULL) {
+        return;
+    }
+
+    current = builtin_index();
+    indexed_path = strdup(path ? path : "");
+
+    if (cloexec_pipe(wake_fds) == -1) {
+        return;
+    }
+    fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+
+    /* SIGINT and SIGCHLD have to reach the thread running the prompt */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, indexer, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Find the commands and builtins that start with a prefix. If `$PATH` was
+ * changed since it was indexed, the indexer is told to start over and the
+ * old index answers in the meantime.
+ *
+ * @param prefix the start of the word being completed
+ * @param length the length of the prefix
+ * @return a NULL-terminated array of matches in order, free it with
+ *         `command_index_free_matches`
+ */
+char** command_index_complete(const char *prefix, size_t length) {
+    const char *path = getenv("PATH");
+    char **matches;
+
+    pthread_mutex_lock(&index_lock);
+
+    if (indexed_path && wake_fds[1] != -1 && strcmp(indexed_path, path ? path : "") != 0) {
+        free(indexed_path);
+        indexed_path = strdup(path ? path : "");
+        if (write(wake_fds[1], "", 1) == -1) {
+            /* already full, the indexer will read the new path anyway */
+        }
+    }
+
+    size_t low = 0, high = current ? current->length : 0;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strncmp(current->names[middle], prefix, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    size_t end = low;
+    while (current && end < current->length && strncmp(current->names[end], prefix, length) == 0) {
+        end++;
+    }
+
+    matches = malloc((end - low + 1) * sizeof *matches);
+    for (size_t i = low; i < end; i++) {
+        matches[i - low] = strdup(current->names[i]);
+    }
+    matches[end - low] = NULL;
+
+    pthread_mutex_unlock(&index_lock);
+    return matches;
+}
+
+void command_index_free_matches(char **matches) {
+    if (matches == NULL) {
+        return;
+    }
+
+    for (char **match = matches; *match; match++) {
+        free(*match);
+    }
+    free(matches);
+}
+
+/**
+ * Whether the word starting at `start` in `line` names a command: it is
+ * the first word, follows an operator or follows a prefix like `time`.
+ */
+int command_position(const char *line, size_t start) {
+    size_t end = start;
+    while (end > 0 && line[end - 1] == ' ') {
+        end--;
+    }
+
+    if (end == 0 || strchr("|&;", line[end - 1])) {
+        return 1;
+    }
+
+    size_t word = end;
+    while (word > 0 && line[word - 1] != ' ') {
+        word--;
+    }
+
+    for (size_t i = 0; i < sizeof prefix_words / sizeof *prefix_words; i++) {
+        if (end - word == strlen(prefix_words[i]) && strncmp(line + word, prefix_words[i], end - word) == 0) {
+            return command_position(line, word);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef __QUASH_COMPLETE_H__
+#define __QUASH_COMPLETE_H__
+
+#include <stddef.h>
+
+void command_index_start();
+char** command_index_complete(const char *prefix, size_t length);
+void command_index_free_matches(char **matches);
+int command_position(const char *line, size_t start);
+
+#endif /* __QUASH_COMPLETE_H__ */
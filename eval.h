@@ -0,0 +1,15 @@
+#ifndef __QUASH_EVAL_H__
+#define __QUASH_EVAL_H__
+
+#include "quash.h"
+
+void init_context(QshContext *ctx, int flags);
+void free_context(QshContext *ctx);
+void init_signal_handlers(QshContext *ctx);
+void restore_signal_handlers();
+void check_job_timeouts(QshContext *ctx);
+int eval_line(QshContext *ctx, char *line);
+void eval_parsed(QshContext *ctx, AST *ast, const char *line);
+void reset_evaluation(QshContext *ctx);
+
+#endif /* __QUASH_EVAL_H__ */
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE /* pipe2, tee, splice */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+
+#include "quash.h"
+#include "fds.h"
+
+/*
+ Every fd the shell opens for itself is close-on-exec from the start, and a
+ child closes everything above stderr before it execs, so a command only
+ ever inherits the stdin, stdout and stderr it was given. Otherwise each
+ child of a shell with many background pipelines carries every pipe end
+ the shell holds, which slows fork and keeps readers from seeing EOF.
+*/
+
+/* without a way to list them, fds are probed up to this many */
+#define FDS_PROBE_MAX 4096
+
+/* the most a fan-out moves per round, the default capacity of a pipe */
+#define FANOUT_CHUNK 65536
+
+/**
+ * `pipe` with both ends close-on-exec. The end a child needs is dup2'd onto
+ * stdin or stdout, which clears the flag on the copy.
+ *
+ * @return `0` on success, `-1` with errno set
+ */
+int cloexec_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static long highest_fd() {
+    long max = sysconf(_SC_OPEN_MAX);
+    return max > 0 && max < FDS_PROBE_MAX ? max : FDS_PROBE_MAX;
+}
+
+static void close_fds(unsigned int first, unsigned int last) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, first, last, 0) == 0) {
+        return;
+    }
+#endif
+
+    /* kernels before 5.9 */
+    for (long fd = first; fd <= last && fd < highest_fd(); fd++) {
+        close(fd);
+    }
+}
+
+/**
+ * In a forked child about to exec: close every fd above stderr, including
+ * any the shell itself inherited without close-on-exec.
+ *
+ * @param keep fds to leave open, like the pipes of process substitutions
+ * @param count the number of fds in `keep`
+ */
+void close_inherited_fds(const int *keep, size_t count) {
+    unsigned int first = STDERR_FILENO + 1;
+
+    /* close the gaps between the kept fds, lowest first */
+    for (;;) {
+        unsigned int next = ~0U;
+        for (size_t i = 0; i < count; i++) {
+            if ((unsigned int) keep[i] >= first && (unsigned int) keep[i] < next) {
+                next = keep[i];
+            }
+        }
+
+        if (next == ~0U) {
+            break;
+        }
+        if (next > first) {
+            close_fds(first, next - 1);
+        }
+        first = next + 1;
+    }
+
+    close_fds(first, ~0U);
+}
+
+static void print_fd(FILE *out, int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags == -1) {
+        return;
+    }
+
+    char target[PATH_MAX] = "?";
+#ifdef __linux__
+    char link[64];
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+
+    ssize_t length = readlink(link, target, sizeof target - 1);
+    target[length > 0 ? length : 1] = '\0';
+#endif
+
+    fprintf(out, "%d\t%s\t%s\n", fd, flags & FD_CLOEXEC ? "cloexec" : "-", target);
+}
+
+/**
+ * List the open fds of the process, whether each is close-on-exec and, on
+ * linux, what it refers to. For `qshstat -f`.
+ */
+void print_open_fds(FILE *out) {
+    fflush(out);
+
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir) {
+        struct dirent *entry;
+        int fds[FDS_PROBE_MAX];
+        int count = 0;
+
+        /* collected first, the listing has an fd of its own */
+        while ((entry = readdir(dir)) && count < FDS_PROBE_MAX) {
+            if (entry->d_name[0] != '.' && atoi(entry->d_name) != dirfd(dir)) {
+                fds[count++] = atoi(entry->d_name);
+            }
+        }
+        closedir(dir);
+
+        for (int i = 0; i < count; i++) {
+            print_fd(out, fds[i]);
+        }
+        return;
+    }
+#endif
+
+    for (long fd = 0; fd < highest_fd(); fd++) {
+        print_fd(out, fd);
+    }
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+
+        data += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+/* a consumer that went away stops being written to, the others carry on */
+static void drop_output(int *outs, size_t i) {
+    close(outs[i]);
+    outs[i] = -1;
+}
+
+static size_t open_outputs(int *outs, size_t count, size_t *first, size_t *last) {
+    size_t open = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (outs[i] != -1) {
+            *last = i;
+            if (open++ == 0) {
+                *first = i;
+            }
+        }
+    }
+
+    return open;
+}
+
+/*
+ each round `tee`s what is in the input pipe to every output but the last
+ without consuming it, then `splice`s it into the last output, which
+ consumes it. the data is only ever referenced by the pipes, never copied
+ through this process. when an output has no room for all of a round, the
+ round is read out and its remainder written the ordinary way, there is no
+ teeing from the middle of a pipe. returns 0 if the input isn't a pipe
+*/
+static int fan_out_spliced(int in, int *outs, size_t count) {
+#ifdef __linux__
+    size_t *sent = malloc(count * sizeof *sent);
+    char *buffer = NULL;
+    size_t first = 0, last = 0;
+    int spliced = 1;
+
+    while (open_outputs(outs, count, &first, &last) > 0) {
+        ssize_t n;
+
+        if (first == last) {
+            n = splice(in, NULL, outs[first], NULL, FANOUT_CHUNK, 0);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n == -1 && errno == EPIPE) {
+                drop_output(outs, first);
+                continue;
+            } else if (n == -1) {
+                spliced = 0;
+            }
+            if (n <= 0) {
+                break;
+            }
+            continue;
+        }
+
+        n = tee(in, outs[first], FANOUT_CHUNK, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EPIPE) {
+            drop_output(outs, first);
+            continue;
+        } else if (n == -1) {
+            spliced = 0;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        int partial = 0;
+        for (size_t i = first + 1; i < last; i++) {
+            ssize_t m;
+
+            if (outs[i] == -1) {
+                continue;
+            }
+
+            while ((m = tee(in, outs[i], n, 0)) == -1 && errno == EINTR);
+            if (m == -1) {
+                drop_output(outs, i);
+                continue;
+            }
+
+            sent[i] = m;
+            partial |= m < n;
+        }
+
+        size_t moved = 0;
+        while (!partial && moved < (size_t) n) {
+            ssize_t m = splice(in, NULL, outs[last], NULL, n - moved, 0);
+            if (m == -1 && errno == EINTR) {
+                continue;
+            } else if (m <= 0) {
+                drop_output(outs, last);
+                break;
+            }
+            moved += m;
+        }
+
+        if (moved == (size_t) n) {
+            continue;
+        }
+
+        /* what is left of the round has to be consumed by reading it */
+        buffer = buffer ? buffer : malloc(FANOUT_CHUNK);
+        size_t length = n - moved;
+        for (size_t got = 0; got < length;) {
+            ssize_t m = read(in, buffer + got, length - got);
+            if (m == -1 && errno == EINTR) {
+                continue;
+            } else if (m <= 0) {
+                length = got;
+                break;
+            }
+            got += m;
+        }
+
+        for (size_t i = first + 1; i < last; i++) {
+            if (outs[i] != -1 && sent[i] < (size_t) n && !write_all(outs[i], buffer + sent[i] - moved, n - sent[i])) {
+                drop_output(outs, i);
+            }
+        }
+        if (outs[last] != -1 && !write_all(outs[last], buffer, length)) {
+            drop_output(outs, last);
+        }
+    }
+
+    free(sent);
+    free(buffer);
+    return spliced;
+#else
+    (void) in;
+    (void) outs;
+    (void) count;
+    return 0;
+#endif
+}
+
+/**
+ * In a forked child: copy everything read from `in` to every one of `outs`,
+ * until `in` ends or no output is left. Between pipes the data is moved
+ * with `tee` and `splice` without copying it through the process, anything
+ * else is read and written. SIGPIPE should be ignored so a consumer that
+ * exits early only closes its own output.
+ *
+ * @param in the fd to read
+ * @param outs the fds to write, each is closed when it is done with
+ * @param count the number of outputs
+ */
+void fan_out(int in, int *outs, size_t count) {
+    char *buffer;
+    size_t first = 0, last = 0;
+
+    if (fan_out_spliced(in, outs, count)) {
+        return;
+    }
+
+    buffer = malloc(FANOUT_CHUNK);
+    for (;;) {
+        ssize_t n = read(in, buffer, FANOUT_CHUNK);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0 || open_outputs(outs, count, &first, &last) == 0) {
+            break;
+        }
+
+        for (size_t i = first; i <= last; i++) {
+            if (outs[i] != -1 && !write_all(outs[i], buffer, n)) {
+                drop_output(outs, i);
+            }
+        }
+    }
+    free(buffer);
+}
@@ -0,0 +1,11 @@
+#ifndef __QUASH_FDS_H__
+#define __QUASH_FDS_H__
+
+#include <stdio.h>
+
+int cloexec_pipe(int fds[2]);
+void close_inherited_fds(const int *keep, size_t count);
+void print_open_fds(FILE *out);
+void fan_out(int in, int *outs, size_t count);
+
+#endif /* __QUASH_FDS_H__ */
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+
+#include "quash.h"
+#include "arrays.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "functions.h"
+
+/*
+ Functions and aliases. `function name 'body'` and `alias name='body'`
+ tokenize and parse their body once, into an AST kept with the definition,
+ and every call evaluates that AST rather than the text, so a function
+ called in a loop never goes through the tokenizer again.
+
+ Words of a body that have variables or globs in them are kept as written
+ and expanded each time their command runs, which is also when the
+ arguments of a call are there to fill in `$1`, `$#` and `$@`. An alias
+ stands for one simple command, the words after it are appended to it.
+*/
+
+/* what `lookup_parameter` needs besides the name */
+typedef struct _Parameters {
+    QshContext *ctx;
+    char count[16];
+    char *joined;               /* `$@` as one word, made on first use */
+} Parameters;
+
+static size_t bucket_of(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    for (const char *c = name; *c; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+
+    return hash & (DEFINITION_BUCKETS - 1);
+}
+
+Definition* find_definition(DefinitionTable *table, const char *name) {
+    if (table->count == 0) {
+        return NULL;
+    }
+
+    for (Definition *d = table->buckets[bucket_of(name)]; d; d = d->next) {
+        if (strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+
+    return NULL;
+}
+
+void retain_definition(Definition *definition) {
+    definition->refs++;
+}
+
+/* a definition replaced while a call is still running it goes once that call returns */
+void release_definition(Definition *definition) {
+    if (--definition->refs > 0) {
+        return;
+    }
+
+    free_parse_tree(&definition->ast);
+    free_token_array(&definition->tokens);
+    free(definition->name);
+    free(definition->body);
+    free(definition);
+}
+
+static Definition* parse_definition(const char *name, const char *body) {
+    Definition *definition = calloc(1, sizeof *definition);
+    char *text = strdup(body);
+
+    definition->name = strdup(name);
+    definition->body = strdup(body);
+    definition->refs = 1;
+    definition->ast.root = NODE_NONE;
+
+    create_token_array(&definition->tokens);
+    if (!tokenize_deferred(&definition->tokens, text)) {
+        free(text);
+        release_definition(definition);
+        return NULL;
+    }
+
+    parse_ast(&definition->ast, &definition->tokens);
+    free(text);
+    return definition;
+}
+
+/* in place of any definition of the same name */
+static void insert_definition(DefinitionTable *table, Definition *definition) {
+    Definition **link = &table->buckets[bucket_of(definition->name)];
+
+    for (; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, definition->name) == 0) {
+            Definition *old = *link;
+            definition->next = old->next;
+            *link = definition;
+            release_definition(old);
+            return;
+        }
+    }
+
+    definition->next = NULL;
+    *link = definition;
+    table->count++;
+}
+
+static int remove_definition(DefinitionTable *table, const char *name) {
+    Definition **link = &table->buckets[bucket_of(name)];
+
+    for (; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            Definition *old = *link;
+            *link = old->next;
+            table->count--;
+            release_definition(old);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void free_definitions(DefinitionTable *table) {
+    for (size_t i = 0; i < DEFINITION_BUCKETS; i++) {
+        while (table->buckets[i]) {
+            Definition *definition = table->buckets[i];
+            table->buckets[i] = definition->next;
+            release_definition(definition);
+        }
+    }
+
+    table->count = 0;
+}
+
+static int compare_definitions(const void *a, const void *b) {
+    return strcmp((*(Definition * const *) a)->name, (*(Definition * const *) b)->name);
+}
+
+/* in order of name, `format` gets the name and the body */
+static void print_definitions(DefinitionTable *table, const char *format) {
+    Definition **sorted = malloc((table->count + 1) * sizeof *sorted);
+    size_t count = 0;
+
+    for (size_t i = 0; i < DEFINITION_BUCKETS; i++) {
+        for (Definition *d = table->buckets[i]; d; d = d->next) {
+            sorted[count++] = d;
+        }
+    }
+
+    qsort(sorted, count, sizeof *sorted, compare_definitions);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(stdout, format, sorted[i]->name, sorted[i]->body);
+    }
+
+    free(sorted);
+}
+
+static int valid_name(const char *name) {
+    return name[0] != '\0' && strpbrk(name, "=/$") == NULL;
+}
+
+/**
+ * `function` lists the functions, `function name` shows one and
+ * `function name 'body'` defines one.
+ *
+ * @return `0` on success, `1` otherwise
+ */
+int builtin_function(QshContext *ctx, int argc, char **argv) {
+    if (argc == 1) {
+        print_definitions(&ctx->functions, "function %s '%s'\n");
+        return 0;
+    }
+
+    if (argc == 2) {
+        Definition *function = find_definition(&ctx->functions, argv[1]);
+        if (function == NULL) {
+            fprintf(stderr, "function: %s: not found\n", argv[1]);
+            return 1;
+        }
+
+        fprintf(stdout, "function %s '%s'\n", function->name, function->body);
+        return 0;
+    }
+
+    if (argc != 3 || !valid_name(argv[1])) {
+        fprintf(stderr, "function: Usage function [name ['body']]\n");
+        return 1;
+    }
+
+    Definition *function = parse_definition(argv[1], argv[2]);
+    if (function == NULL) {
+        fprintf(stderr, "function: could not tokenize: %s\n", argv[2]);
+        return 1;
+    }
+
+    insert_definition(&ctx->functions, function);
+    return 0;
+}
+
+/**
+ * `alias` lists the aliases, `alias name` shows one, and `alias name='body'`
+ * or `alias name body` defines one. The body must be a single command.
+ *
+ * @return `0` on success, `1` otherwise
+ */
+int builtin_alias(QshContext *ctx, int argc, char **argv) {
+    if (argc == 1) {
+        print_definitions(&ctx->aliases, "alias %s='%s'\n");
+        return 0;
+    }
+
+    /* `name='ls -l'` is tokenized as `name=` and `ls -l` */
+    char *equals = strchr(argv[1], '=');
+    char *body = NULL;
+
+    if (equals && equals[1] == '\0' && argc == 3) {
+        body = argv[2];
+    } else if (equals && equals[1] != '\0' && argc == 2) {
+        body = equals + 1;
+    } else if (!equals && argc == 3) {
+        body = argv[2];
+    } else if (!equals && argc == 2) {
+        Definition *alias = find_definition(&ctx->aliases, argv[1]);
+        if (alias == NULL) {
+            fprintf(stderr, "alias: %s: not found\n", argv[1]);
+            return 1;
+        }
+
+        fprintf(stdout, "alias %s='%s'\n", alias->name, alias->body);
+        return 0;
+    }
+
+    if (body == NULL) {
+        fprintf(stderr, "alias: Usage alias [name[='command']]\n");
+        return 1;
+    }
+
+    char *name = equals ? strndup(argv[1], equals - argv[1]) : strdup(argv[1]);
+    Definition *alias = valid_name(name) ? parse_definition(name, body) : NULL;
+    free(name);
+
+    if (alias == NULL || alias->ast.root == NODE_NONE || alias->ast.nodes[alias->ast.root].token != T_WORD) {
+        fprintf(stderr, "alias: not a single command, define a function instead: %s\n", body);
+        if (alias) {
+            release_definition(alias);
+        }
+        return 1;
+    }
+
+    insert_definition(&ctx->aliases, alias);
+    return 0;
+}
+
+static int undefine(DefinitionTable *table, int argc, char **argv) {
+    int status = 0;
+
+    if (argc == 1) {
+        fprintf(stderr, "%s: Usage %s name [name ...]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!remove_definition(table, argv[i])) {
+            fprintf(stderr, "%s: %s: not found\n", argv[0], argv[i]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+int builtin_unalias(QshContext *ctx, int argc, char **argv) {
+    return undefine(&ctx->aliases, argc, argv);
+}
+
+int builtin_unfunction(QshContext *ctx, int argc, char **argv) {
+    return undefine(&ctx->functions, argc, argv);
+}
+
+
+/* ----------------------------- */
+/*     expansion at each call    */
+/* ----------------------------- */
+
+static const char* lookup_parameter(const char *name, void *data) {
+    Parameters *parameters = data;
+    QshContext *ctx = parameters->ctx;
+    int count = ctx->params ? ctx->param_count : 0;
+
+    if (name[0] >= '0' && name[0] <= '9') {
+        int n = atoi(name);
+        return n < count ? ctx->params[n] : NULL;
+    }
+
+    if (strcmp(name, "#") == 0) {
+        snprintf(parameters->count, sizeof parameters->count, "%d", count > 0 ? count - 1 : 0);
+        return parameters->count;
+    }
+
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0) {
+        if (parameters->joined == NULL) {
+            size_t length = 1;
+            for (int i = 1; i < count; i++) {
+                length += strlen(ctx->params[i]) + 1;
+            }
+
+            parameters->joined = calloc(length, 1);
+            for (int i = 1; i < count; i++) {
+                strcat(parameters->joined, ctx->params[i]);
+                if (i + 1 < count) {
+                    strcat(parameters->joined, " ");
+                }
+            }
+        }
+
+        return parameters->joined;
+    }
+
+    return getenv(name);
+}
+
+static void add_word(CommandWords *words, char *word, unsigned char flags, int allocated, int from_glob) {
+    if (words->length + 1 >= words->slots) {
+        words->slots *= 2;
+        words->expanded = realloc(words->expanded, words->slots * sizeof *words->expanded);
+        words->expanded_flags = realloc(words->expanded_flags, words->slots);
+    }
+
+    if (allocated) {
+        words->allocated = realloc(words->allocated, (words->allocated_count + 1) * sizeof *words->allocated);
+        words->allocated[words->allocated_count++] = word;
+    }
+
+    if (from_glob) {
+        if (words->glob_count == 0) {
+            words->glob_first = words->length;
+        }
+        words->glob_count = words->length + 1 - words->glob_first;
+    }
+
+    words->expanded_flags[words->length] = flags & (WORD_INPUT_SUBST | WORD_OUTPUT_SUBST);
+    words->expanded[words->length++] = word;
+}
+
+/* one word of a body as its command runs: none, itself, or what it globs to */
+static void expand_word(CommandWords *words, Parameters *parameters, char *word, unsigned char flags, int from_glob) {
+    if (!(flags & WORD_DEFERRED)) {
+        add_word(words, word, flags, 0, from_glob);
+        return;
+    }
+
+    /* `$@` alone passes the arguments on as separate words */
+    if (strcmp(word, "$@") == 0) {
+        QshContext *ctx = parameters->ctx;
+        for (int i = 1; ctx->params && i < ctx->param_count; i++) {
+            add_word(words, ctx->params[i], 0, 0, 0);
+        }
+        return;
+    }
+
+    char *text = expand_deferred(word, lookup_parameter, parameters);
+
+    if (flags & WORD_QUOTED) {
+        add_word(words, text ? text : strdup(""), 0, 1, 0);
+        return;
+    }
+
+    /* an unquoted word that expanded to nothing isn't a word at all */
+    if (text == NULL || text[0] == '\0') {
+        free(text);
+        return;
+    }
+
+    if (strpbrk(text, "*?[") == NULL) {
+        add_word(words, text, 0, 1, 0);
+        return;
+    }
+
+    glob_t globbuf;
+    memset(&globbuf, 0, sizeof globbuf);
+    glob(text, GLOB_NOSORT | GLOB_NOCHECK, NULL, &globbuf);
+
+    int matched = !(globbuf.gl_pathc == 1 && strcmp(globbuf.gl_pathv[0], text) == 0);
+    for (size_t i = 0; i < globbuf.gl_pathc; i++) {
+        add_word(words, strdup(globbuf.gl_pathv[i]), 0, 1, matched);
+    }
+
+    globfree(&globbuf);
+    free(text);
+}
+
+static int any_deferred(unsigned char *flags, int count) {
+    for (int i = 0; flags && i < count; i++) {
+        if (flags[i] & WORD_DEFERRED) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The argv a command runs with: an alias in front replaced by its words,
+ * and the deferred words of a function body expanded. A command with
+ * neither keeps pointing into the AST and allocates nothing.
+ *
+ * @param ctx the context, for its aliases and the arguments of the call
+ * @param ast the AST of the command
+ * @param command the command's T_WORD node
+ * @param words filled in, free it with `free_command_words` once the command ran
+ */
+void expand_command_words(QshContext *ctx, AST *ast, node_t command, CommandWords *words) {
+    ASTNode *node = &ast->nodes[command];
+    char **argv = &ast->words[node->argv];
+    unsigned char *flags = ast->word_flags ? &ast->word_flags[node->argv] : NULL;
+    int argc = node->argc;
+
+    memset(words, 0, sizeof *words);
+    words->argc = argc;
+    words->argv = argv;
+    words->flags = flags;
+    words->glob_first = node->glob_first;
+    words->glob_count = node->glob_count;
+
+    Definition *alias = argc > 0 ? find_definition(&ctx->aliases, argv[0]) : NULL;
+    if (alias == NULL && !any_deferred(flags, argc)) {
+        return;
+    }
+
+    Parameters parameters = { .ctx = ctx, .joined = NULL };
+    words->glob_count = 0;
+    words->slots = 16;
+    words->expanded = malloc(words->slots * sizeof *words->expanded);
+    words->expanded_flags = malloc(words->slots);
+    int skip = 0;
+
+    if (alias) {
+        AST *body = &alias->ast;
+        ASTNode *body_node = &body->nodes[body->root];
+
+        retain_definition(alias);
+        words->alias = alias;
+
+        for (uint32_t i = 0; i < body_node->argc; i++) {
+            uint32_t index = body_node->argv + i;
+            int from_glob = body_node->glob_count && i >= body_node->glob_first
+                && i < body_node->glob_first + body_node->glob_count;
+            expand_word(words, &parameters, body->words[index], body->word_flags ? body->word_flags[index] : 0, from_glob);
+        }
+        skip = 1;
+    }
+
+    for (int i = skip; i < argc; i++) {
+        int from_glob = node->glob_count && (uint32_t) i >= node->glob_first
+            && (uint32_t) i < node->glob_first + node->glob_count;
+        expand_word(words, &parameters, argv[i], flags ? flags[i] : 0, from_glob);
+    }
+
+    free(parameters.joined);
+
+    /* `add_word` keeps room for this */
+    words->expanded[words->length] = NULL;
+
+    words->argc = words->length;
+    words->argv = words->expanded;
+    words->flags = words->expanded_flags;
+}
+
+void free_command_words(CommandWords *words) {
+    for (size_t i = 0; i < words->allocated_count; i++) {
+        free(words->allocated[i]);
+    }
+
+    if (words->alias) {
+        release_definition(words->alias);
+    }
+
+    free(words->allocated);
+    free(words->expanded);
+    free(words->expanded_flags);
+    memset(words, 0, sizeof *words);
+}
+
+/**
+ * A redirect's file name in a function body, expanded for the running call.
+ *
+ * @return `word` itself, or the expansion malloc'd
+ */
+char* expand_redirect_word(QshContext *ctx, char *word, unsigned char flags) {
+    if (!(flags & WORD_DEFERRED)) {
+        return word;
+    }
+
+    Parameters parameters = { .ctx = ctx, .joined = NULL };
+    char *text = expand_deferred(word, lookup_parameter, &parameters);
+    free(parameters.joined);
+
+    return text ? text : strdup("");
+}
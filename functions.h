@@ -0,0 +1,37 @@
+#ifndef __QUASH_FUNCTIONS_H__
+#define __QUASH_FUNCTIONS_H__
+
+#include "quash.h"
+
+/* the argv of a command once aliases and deferred words are expanded */
+typedef struct _CommandWords {
+    int argc;
+    char **argv;                /* into the AST when nothing had to be expanded */
+    unsigned char *flags;       /* WordFlags of each word, NULL if none has any */
+    uint32_t glob_first;        /* the words from globs, for `batch` */
+    uint32_t glob_count;
+
+    char **expanded;            /* `argv` when the words were rewritten */
+    unsigned char *expanded_flags;
+    size_t length;
+    size_t slots;
+    char **allocated;           /* words made by the expansion */
+    size_t allocated_count;
+    Definition *alias;          /* held while its words are in use */
+} CommandWords;
+
+Definition* find_definition(DefinitionTable *table, const char *name);
+void retain_definition(Definition *definition);
+void release_definition(Definition *definition);
+void free_definitions(DefinitionTable *table);
+
+int builtin_function(QshContext *ctx, int argc, char **argv);
+int builtin_alias(QshContext *ctx, int argc, char **argv);
+int builtin_unalias(QshContext *ctx, int argc, char **argv);
+int builtin_unfunction(QshContext *ctx, int argc, char **argv);
+
+void expand_command_words(QshContext *ctx, AST *ast, node_t command, CommandWords *words);
+void free_command_words(CommandWords *words);
+char* expand_redirect_word(QshContext *ctx, char *word, unsigned char flags);
+
+#endif /* __QUASH_FUNCTIONS_H__ */
@@ -3,6 +3,8 @@
 
 #include "quash.h"
 #include "hash.h"
+#include "stats.h"
+#include "memstats.h"
 
 static void free_bucket_list(JobHashTableNode *bucket) {
     if (!bucket) {
@@ -13,7 +15,7 @@ static void free_bucket_list(JobHashTableNode *bucket) {
         free_bucket_list(bucket->next);
     }
 
-    free(bucket);
+    mem_free(MEM_HASH, bucket);
 }
 
 static void free_bucket(JobHashTableNode *bucket) {
@@ -40,6 +42,7 @@ void hash_table_insert(JobHashTable *table, pid_t key, Job *value) {
         JobHashTableNode *node = &table->buckets[bucket];
 
         for (;;) {
+            STAT_INC(hash_probes);
             if (node->next) {
                 node = node->next;
             } else {
@@ -47,7 +50,8 @@ void hash_table_insert(JobHashTable *table, pid_t key, Job *value) {
             }
         }
 
-        node->next = malloc(sizeof *node);
+        node->next = mem_malloc(MEM_HASH, sizeof *node);
+        STAT_ADD(bytes_allocated, sizeof *node);
         node->next->prev = node;
         node = node->next;
 
@@ -63,6 +67,7 @@ Job* hash_table_get(JobHashTable *table, pid_t key) {
     JobHashTableNode *node = &table->buckets[key & (TABLE_BUCKETS - 1)];
 
     for (;;) {
+        STAT_INC(hash_probes);
         if (node->key == key) {
             return node->value;
         }
@@ -81,6 +86,7 @@ int hash_table_delete(JobHashTable *table, pid_t key) {
     size_t bucket = key & (TABLE_BUCKETS - 1);
     JobHashTableNode *node = &table->buckets[bucket];
 
+    STAT_INC(hash_probes);
     if (table->buckets[bucket].key == key) {
         if (table->buckets[bucket].next) {
             JobHashTableNode *next_node = table->buckets[bucket].next;
@@ -92,7 +98,7 @@ int hash_table_delete(JobHashTable *table, pid_t key) {
                 table->buckets[bucket].next->prev = &table->buckets[bucket];
             }
 
-            free(next_node);
+            mem_free(MEM_HASH, next_node);
         } else {
             table->buckets[bucket].key = 0;
             table->buckets[bucket].value = NULL;
@@ -103,13 +109,14 @@ int hash_table_delete(JobHashTable *table, pid_t key) {
     }
 
     for (;;) {
+        STAT_INC(hash_probes);
         if (node->key == key) {
             node->prev->next = node->next;
             if (node->next) {
                 node->next->prev = node->prev;
             }
 
-            free(node);
+            mem_free(MEM_HASH, node);
             table->elements--;
             return 1;
         }
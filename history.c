@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "quash.h"
+#include "history.h"
+#include "memstats.h"
+
+/*
+ Trigram index over the command history. Every entry is split into its
+ (case-folded) three byte windows and each window keeps a sorted list of
+ the entries containing it. A search only visits the posting lists of the
+ query's trigrams instead of scanning every line of the history.
+*/
+
+typedef struct _Candidate {
+    uint32_t id;
+    uint32_t score;
+} Candidate;
+
+static char fold(char c) {
+    return tolower((unsigned char) c);
+}
+
+static uint32_t make_trigram(const char *s) {
+    /* the high bit keeps every key nonzero, zero marks an empty slot */
+    return 0x01000000u
+        | ((uint32_t) (unsigned char) fold(s[0]) << 16)
+        | ((uint32_t) (unsigned char) fold(s[1]) << 8)
+        | (uint32_t) (unsigned char) fold(s[2]);
+}
+
+static size_t trigram_slot(HistoryIndex *index, uint32_t key) {
+    return (key * 2654435761u) & (index->trigram_slots - 1);
+}
+
+static TrigramPostings* find_postings(HistoryIndex *index, uint32_t key) {
+    size_t slot = trigram_slot(index, key);
+
+    while (index->trigrams[slot] != 0) {
+        if (index->trigrams[slot] == key) {
+            return &index->postings[slot];
+        }
+
+        slot = (slot + 1) & (index->trigram_slots - 1);
+    }
+
+    return NULL;
+}
+
+static void grow_trigram_table(HistoryIndex *index) {
+    uint32_t *old_trigrams = index->trigrams;
+    TrigramPostings *old_postings = index->postings;
+    size_t old_slots = index->trigram_slots;
+
+    index->trigram_slots *= 2;
+    index->trigrams = mem_calloc(MEM_HISTORY, index->trigram_slots, sizeof *index->trigrams);
+    index->postings = mem_calloc(MEM_HISTORY, index->trigram_slots, sizeof *index->postings);
+
+    for (size_t n = 0; n < old_slots; n++) {
+        if (old_trigrams[n] == 0) {
+            continue;
+        }
+
+        size_t slot = trigram_slot(index, old_trigrams[n]);
+        while (index->trigrams[slot] != 0) {
+            slot = (slot + 1) & (index->trigram_slots - 1);
+        }
+
+        index->trigrams[slot] = old_trigrams[n];
+        index->postings[slot] = old_postings[n];
+    }
+
+    mem_free(MEM_HISTORY, old_trigrams);
+    mem_free(MEM_HISTORY, old_postings);
+}
+
+static TrigramPostings* insert_postings(HistoryIndex *index, uint32_t key) {
+    TrigramPostings *postings = find_postings(index, key);
+    if (postings) {
+        return postings;
+    }
+
+    /* keep the table at most half full so probe sequences stay short */
+    if ((index->trigram_count + 1) * 2 > index->trigram_slots) {
+        grow_trigram_table(index);
+    }
+
+    size_t slot = trigram_slot(index, key);
+    while (index->trigrams[slot] != 0) {
+        slot = (slot + 1) & (index->trigram_slots - 1);
+    }
+
+    index->trigrams[slot] = key;
+    index->trigram_count++;
+    return &index->postings[slot];
+}
+
+static void append_posting(TrigramPostings *postings, uint32_t id) {
+    /* ids are added in increasing order, so a repeat is always the last one */
+    if (postings->length > 0 && postings->ids[postings->length - 1] == id) {
+        return;
+    }
+
+    if (postings->length == postings->slots) {
+        postings->slots = postings->slots ? postings->slots * 2 : 4;
+        postings->ids = mem_realloc(MEM_HISTORY, postings->ids, postings->slots * sizeof *postings->ids);
+    }
+
+    postings->ids[postings->length++] = id;
+}
+
+/*
+ test whether `id` is in `postings`. ids are probed in decreasing order, so
+ `*end` bounds the entries that can still match and the search gallops back
+ from it instead of bisecting the whole list every time
+*/
+static int probe_posting(TrigramPostings *postings, uint32_t *end, uint32_t id) {
+    uint32_t hi = *end;
+    uint32_t step = 1;
+
+    while (step <= hi && postings->ids[hi - step] > id) {
+        hi -= step;
+        step *= 2;
+    }
+
+    uint32_t lo = step <= hi ? hi - step : 0;
+
+    /* ids[lo] <= id, or lo is 0; ids[hi..] > id */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (postings->ids[mid] > id) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    *end = hi;
+    return hi > 0 && postings->ids[hi - 1] == id;
+}
+
+/* case-insensitive substring test */
+static int contains_folded(const char *haystack, const char *needle) {
+    size_t needle_len = strlen(needle);
+
+    for (; *haystack; haystack++) {
+        size_t n = 0;
+        while (n < needle_len && haystack[n] && fold(haystack[n]) == needle[n]) {
+            n++;
+        }
+
+        if (n == needle_len) {
+            return 1;
+        }
+    }
+
+    return needle_len == 0;
+}
+
+static int better_candidate(Candidate a, Candidate b) {
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+
+    return a.id > b.id; /* newer entries win ties */
+}
+
+/* insert `c` into the ranked list `top`, dropping duplicate lines */
+static int rank_candidate(HistoryIndex *index, Candidate *top, int count, int max, Candidate c) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(index->entries[top[i].id], index->entries[c.id]) == 0) {
+            if (!better_candidate(c, top[i])) {
+                return count;
+            }
+
+            /* remove the worse duplicate and re-insert below */
+            memmove(&top[i], &top[i + 1], (count - i - 1) * sizeof *top);
+            count--;
+            break;
+        }
+    }
+
+    int pos = count;
+    while (pos > 0 && better_candidate(c, top[pos - 1])) {
+        pos--;
+    }
+
+    if (pos >= max) {
+        return count;
+    }
+
+    if (count == max) {
+        count--;
+    }
+
+    memmove(&top[pos + 1], &top[pos], (count - pos) * sizeof *top);
+    top[pos] = c;
+    return count + 1;
+}
+
+static int compare_postings_length(const void *a, const void *b) {
+    const TrigramPostings *lhs = *(TrigramPostings* const*) a;
+    const TrigramPostings *rhs = *(TrigramPostings* const*) b;
+    return (lhs->length > rhs->length) - (lhs->length < rhs->length);
+}
+
+void init_history_index(HistoryIndex *index) {
+    memset(index, 0, sizeof *index);
+
+    index->trigram_slots = HISTORY_TRIGRAM_SLOTS;
+    index->trigrams = mem_calloc(MEM_HISTORY, index->trigram_slots, sizeof *index->trigrams);
+    index->postings = mem_calloc(MEM_HISTORY, index->trigram_slots, sizeof *index->postings);
+}
+
+void free_history_index(HistoryIndex *index) {
+    for (size_t n = 0; n < index->length; n++) {
+        mem_free(MEM_HISTORY, index->entries[n]);
+    }
+
+    for (size_t n = 0; n < index->trigram_slots; n++) {
+        mem_free(MEM_HISTORY, index->postings[n].ids);
+    }
+
+    mem_free(MEM_HISTORY, index->entries);
+    mem_free(MEM_HISTORY, index->trigrams);
+    mem_free(MEM_HISTORY, index->postings);
+    memset(index, 0, sizeof *index);
+}
+
+void history_index_add(HistoryIndex *index, const char *line) {
+    if (index->length == index->slots) {
+        index->slots = index->slots ? index->slots * 2 : 64;
+        index->entries = mem_realloc(MEM_HISTORY, index->entries, index->slots * sizeof *index->entries);
+    }
+
+    uint32_t id = index->length++;
+    index->entries[id] = mem_strdup(MEM_HISTORY, line);
+
+    size_t len = strlen(line);
+    for (size_t i = 0; i + 2 < len; i++) {
+        append_posting(insert_postings(index, make_trigram(line + i)), id);
+    }
+}
+
+const char* history_index_entry(HistoryIndex *index, uint32_t id) {
+    return id < index->length ? index->entries[id] : NULL;
+}
+
+/**
+ * Search the history for lines resembling `query`. Lines are ranked by the
+ * number of the query's trigrams they contain, then by recency. Up to a
+ * third of the query's trigrams may be missing from a match, which
+ * tolerates small typos.
+ *
+ * @param index the history index to search
+ * @param query the text to look for, compared case-insensitively
+ * @param results array filled with the ids of the best matches, best first
+ * @param max the capacity of `results`
+ * @return the number of ids written to `results`
+ */
+int history_index_search(HistoryIndex *index, const char *query, uint32_t *results, int max) {
+    Candidate top[HISTORY_SEARCH_MAX];
+    int count = 0;
+
+    if (max > HISTORY_SEARCH_MAX) {
+        max = HISTORY_SEARCH_MAX;
+    }
+
+    if (index->length == 0) {
+        return 0;
+    }
+
+    size_t query_len = strlen(query);
+    char *folded = mem_malloc(MEM_HISTORY, query_len + 1);
+    for (size_t i = 0; i <= query_len; i++) {
+        folded[i] = fold(query[i]);
+    }
+
+    if (query_len < 3) {
+        /* too short to have trigrams, scan from the newest entry back */
+        for (size_t n = index->length; n > 0 && count < max; n--) {
+            if (contains_folded(index->entries[n - 1], folded)) {
+                Candidate c = { .id = n - 1, .score = 1 };
+                count = rank_candidate(index, top, count, max, c);
+            }
+        }
+
+        goto done;
+    }
+
+    /* distinct trigrams of the query, and the postings of those that exist */
+    size_t trigram_count = 0;
+    size_t missing = 0;
+    uint32_t *keys = mem_malloc(MEM_HISTORY, (query_len - 2) * sizeof *keys);
+    TrigramPostings **lists = mem_malloc(MEM_HISTORY, (query_len - 2) * sizeof *lists);
+    size_t list_count = 0;
+
+    for (size_t i = 0; i + 2 < query_len; i++) {
+        uint32_t key = make_trigram(folded + i);
+        size_t k;
+        for (k = 0; k < trigram_count && keys[k] != key; k++) { }
+        if (k < trigram_count) {
+            continue;
+        }
+
+        keys[trigram_count++] = key;
+        TrigramPostings *postings = find_postings(index, key);
+        if (postings && postings->length > 0) {
+            lists[list_count++] = postings;
+        } else {
+            missing++;
+        }
+    }
+
+    size_t allowed = (trigram_count + 1) / 3;
+    if (missing > allowed) {
+        mem_free(MEM_HISTORY, keys);
+        mem_free(MEM_HISTORY, lists);
+        goto done;
+    }
+
+    /*
+     a match may miss at most `allowed` trigrams, so it must appear in at
+     least one of the `allowed - missing + 1` shortest posting lists. those
+     seed the candidates, newest first, and every list is probed for the
+     score.
+    */
+    qsort(lists, list_count, sizeof *lists, compare_postings_length);
+    size_t seeds = allowed - missing + 1;
+    if (seeds > list_count) {
+        seeds = list_count;
+    }
+
+    uint32_t *cursors = mem_malloc(MEM_HISTORY, seeds * sizeof *cursors);
+    uint32_t *probes = mem_malloc(MEM_HISTORY, list_count * sizeof *probes);
+    for (size_t l = 0; l < seeds; l++) {
+        cursors[l] = lists[l]->length;
+    }
+    for (size_t l = 0; l < list_count; l++) {
+        probes[l] = lists[l]->length;
+    }
+
+    size_t needed = trigram_count - allowed;
+    for (;;) {
+        /* next newest id across the seed lists */
+        int found = 0;
+        uint32_t id = 0;
+        for (size_t l = 0; l < seeds; l++) {
+            if (cursors[l] > 0 && (!found || lists[l]->ids[cursors[l] - 1] > id)) {
+                id = lists[l]->ids[cursors[l] - 1];
+                found = 1;
+            }
+        }
+
+        if (!found) {
+            break;
+        }
+
+        for (size_t l = 0; l < seeds; l++) {
+            if (cursors[l] > 0 && lists[l]->ids[cursors[l] - 1] == id) {
+                cursors[l]--;
+            }
+        }
+
+        uint32_t score = 0;
+        for (size_t l = 0; l < list_count; l++) {
+            score += probe_posting(lists[l], &probes[l], id);
+        }
+
+        if (score >= needed) {
+            Candidate c = { .id = id, .score = score };
+            count = rank_candidate(index, top, count, max, c);
+
+            /*
+             an older line has to beat the worst kept score, so it can miss
+             fewer lists and must appear in one of fewer seed lists
+            */
+            if (count == max) {
+                size_t worst = top[max - 1].score;
+                if (worst >= list_count) {
+                    break;
+                }
+
+                if (list_count - worst < seeds) {
+                    seeds = list_count - worst;
+                }
+            }
+        }
+    }
+
+    mem_free(MEM_HISTORY, cursors);
+    mem_free(MEM_HISTORY, probes);
+    mem_free(MEM_HISTORY, keys);
+    mem_free(MEM_HISTORY, lists);
+
+done:
+    for (int i = 0; i < count; i++) {
+        results[i] = top[i].id;
+    }
+
+    mem_free(MEM_HISTORY, folded);
+    return count;
+}
@@ -0,0 +1,12 @@
+#ifndef __QUASH_HISTORY_H__
+#define __QUASH_HISTORY_H__
+
+#include "quash.h"
+
+void init_history_index(HistoryIndex *index);
+void free_history_index(HistoryIndex *index);
+void history_index_add(HistoryIndex *index, const char *line);
+const char* history_index_entry(HistoryIndex *index, uint32_t id);
+int history_index_search(HistoryIndex *index, const char *query, uint32_t *results, int max);
+
+#endif /* __QUASH_HISTORY_H__ */
@@ -4,13 +4,28 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
 
 #include "quash.h"
 #include "hash.h"
+#include "jobs.h"
 #include "tokenizer.h"
 #include "parser.h"
+#include "trace.h"
+#include "stats.h"
+#include "memstats.h"
 
 /*
 push_new_job(Job*) -> job_id_t
@@ -26,35 +41,33 @@ run_foreground(job_id_t) -> executes job and sets return status in $?
 run_background(job_id_t) -> runs async in background, don't set $?
 */
 
-struct {
-    Job jobs[JOBS_MAX];
-    job_t indices[JOBS_MAX];
-    JobHashTable pid_to_job;
-} job_stack;
-
-void init_job_stack() {
+void init_job_table(JobTable *jobs) {
     /* from now on we just ignore the first entry so job_ids map one-to-one with indices in the stack */
-    memset(&job_stack.jobs, 0, JOBS_MAX * sizeof *job_stack.jobs);
+    memset(&jobs->jobs, 0, JOBS_MAX * sizeof *jobs->jobs);
 
     for (size_t n = 0; n < JOBS_MAX; n++) {
-        job_stack.indices[n] = n;
-        job_stack.jobs[n].id = n;
+        jobs->indices[n] = n;
+        jobs->jobs[n].id = n;
     }
 
-    init_hash_table(&job_stack.pid_to_job);
+    init_hash_table(&jobs->pid_to_job);
 }
 
-void cleanup_jobs() {
-    free_hash_table_buckets(&job_stack.pid_to_job);
+void cleanup_jobs(JobTable *jobs) {
+    for (job_t job = 1; job < JOBS_MAX; job++) {
+        free_job(jobs, job);
+    }
+
+    free_hash_table_buckets(&jobs->pid_to_job);
 }
 
 /* return the lowest available index */
-static job_t next_job_index() {
+static job_t next_job_index(JobTable *jobs) {
     /* find first nonzero entry in `indices`, zero it out, and return it */
     for (size_t n = 1; n < JOBS_MAX; n++) {
-        if (job_stack.indices[n] != 0) {
-            int index = job_stack.indices[n];
-            job_stack.indices[n] = 0;
+        if (jobs->indices[n] != 0) {
+            int index = jobs->indices[n];
+            jobs->indices[n] = 0;
             return index;
         }
     }
@@ -62,14 +75,14 @@ static job_t next_job_index() {
     return -1; /* stack is full */
 }
 
-static void add_flags(job_t job, int flags) {
-    if (job_stack.indices[job] == 0) {
-        job_stack.jobs[job].flags |= flags;
+static void add_flags(JobTable *jobs, job_t job, int flags) {
+    if (jobs->indices[job] == 0) {
+        jobs->jobs[job].flags |= flags;
     }
 }
 
-void print_job(job_t job) {
-    Process *process = job_stack.jobs[job].processes;
+void print_job(JobTable *jobs, job_t job) {
+    Process *process = jobs->jobs[job].processes;
 
     printf("[%d]", job);
 
@@ -79,38 +92,28 @@ void print_job(job_t job) {
     // printf("\n");
 }
 
-static char* ast_to_cmd(ASTNode *ast) {
-    if (!(ast->token.token == T_WORD || redirect(ast->token))) {
-        return NULL;
-    }
-    /* TODO not implemented */
-    ASTNode *commands = get_commands(ast);
-    ASTNode *node = commands;
+/* the command line shown by `jobs`, each word followed by a space */
+static char* argv_to_cmd(int argc, char **argv) {
     size_t len = 0;
 
-    while (node && node->token.token == T_WORD) {
-        len += strlen(node->token.text) + 1;
-        node = node->left;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
     }
 
-    char *cmd = malloc(len + 1);
+    char *cmd = mem_malloc(MEM_JOBS, len + 1);
+    STAT_ADD(bytes_allocated, len + 1);
 
-    node = commands;
-    size_t end = 0;
-    while (node && node->token.token == T_WORD) {
-        strcpy(cmd + end, node->token.text);
-        end += strlen(node->token.text);
-        strcpy(cmd + end, " ");
-        end += 1;
-        node = node->left;
+    char *end = cmd;
+    for (int i = 0; i < argc; i++) {
+        end = stpcpy(end, argv[i]);
+        *end++ = ' ';
     }
 
-    cmd[len] = '\0';
-
+    *end = '\0';
     return cmd;
 }
 
-static int append_process(Job *job, ASTNode *ast, pid_t pid) {
+static int append_process(JobTable *jobs, Job *job, int argc, char **argv, pid_t pid) {
     Process *node = job->processes;
 
     if (node) {
@@ -122,74 +125,98 @@ static int append_process(Job *job, ASTNode *ast, pid_t pid) {
             }
         }
 
-        node->next = malloc(sizeof *node);
+        node->next = mem_malloc(MEM_JOBS, sizeof *node);
         node = node->next;
     } else {
-        job->processes = malloc(sizeof *job->processes);
+        job->processes = mem_malloc(MEM_JOBS, sizeof *job->processes);
         node = job->processes;
     }
 
+    STAT_ADD(bytes_allocated, sizeof *node);
     node->pid = pid;
-    node->cmd = ast_to_cmd(ast);
+    node->cmd = argv_to_cmd(argc, argv);
+    node->flags = 0;
     node->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &node->start);
+    memset(&node->usage, 0, sizeof node->usage);
     job->process_count++;
 
-    hash_table_insert(&job_stack.pid_to_job, pid, job);
+    hash_table_insert(&jobs->pid_to_job, pid, job);
     return 1;
 }
 
-job_t create_job() {
-    return next_job_index();
-}
-
-static void free_processes(Process *process) {
-    if (!process) {
-        return;
+job_t create_job(JobTable *jobs) {
+    job_t job = next_job_index(jobs);
+    if (job != -1) {
+        STAT_INC(jobs_started);
     }
 
-    hash_table_delete(&job_stack.pid_to_job, process->pid);
+    return job;
+}
+
+static void free_processes(JobTable *jobs, Process *process) {
+    while (process) {
+        Process *next = process->next;
 
-    free_processes(process->next);
-    free(process->cmd);
-    free(process);
+        hash_table_delete(&jobs->pid_to_job, process->pid);
+        mem_free(MEM_JOBS, process->cmd);
+        mem_free(MEM_JOBS, process);
+        process = next;
+    }
 }
 
-void free_job(job_t job) {
-    if (job_stack.indices[job] != 0) {
+void free_job(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] != 0) {
         return;
     }
 
-    free_processes(job_stack.jobs[job].processes);
-    job_stack.indices[job] = job;
-    job_stack.jobs[job].processes = NULL;
-    job_stack.jobs[job].process_count = 0;
-    job_stack.jobs[job].flags = 0;
+    JobTimeout *timeout = &jobs->jobs[job].timeout;
+    if (timeout->active && timeout->timer_fd != -1) {
+        close(timeout->timer_fd);
+    }
+    if (timeout->active && timeout->pid_fd != -1) {
+        close(timeout->pid_fd);
+    }
+    memset(timeout, 0, sizeof *timeout);
+
+    STAT_INC(jobs_finished);
+    free_processes(jobs, jobs->jobs[job].processes);
+    jobs->indices[job] = job;
+    jobs->jobs[job].processes = NULL;
+    jobs->jobs[job].process_count = 0;
+    jobs->jobs[job].flags = 0;
 }
 
-int register_process(ASTNode *ast, job_t job, pid_t pid) {
-    if (job_stack.indices[job] != 0) {
+int register_process(JobTable *jobs, int argc, char **argv, job_t job, pid_t pid) {
+    if (jobs->indices[job] != 0) {
         return 0;
     }
 
-    return append_process(&job_stack.jobs[job], ast, pid);
+    return append_process(jobs, &jobs->jobs[job], argc, argv, pid);
 }
 
-void print_jobs() {
+void print_jobs(JobTable *jobs) {
     for (int job = 1; job < JOBS_MAX; job++) {
-        if (job_stack.indices[job] == 0) {
-            print_job(job);
+        /* the job of the `jobs` builtin itself has no processes */
+        if (jobs->indices[job] == 0 && jobs->jobs[job].processes) {
+            print_job(jobs, job);
         }
     }
 }
 
-int signal_job(job_t job, int signal) {
-    if (job_stack.indices[job] != 0) {
+int signal_job(JobTable *jobs, job_t job, int signal) {
+    if (jobs->indices[job] != 0) {
         return -1;
     }
 
-    Process *process = job_stack.jobs[job].processes;
+    Process *process = jobs->jobs[job].processes;
 
     for (; process; process = process->next) {
+        /* a reaped pid may be some other process's by now */
+        if (process->flags & JOB_FINISHED) {
+            continue;
+        }
+
         if (kill(process->pid, signal) == -1) {
             perror("kill");
             return -1;
@@ -199,13 +226,216 @@ int signal_job(job_t job, int signal) {
     return 0;
 }
 
-int run_foreground(job_t job) {
-    if (job_stack.indices[job] != 0) {
+static struct timespec add_seconds(struct timespec time, double seconds) {
+    time.tv_sec += (time_t) seconds;
+    time.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+    if (time.tv_nsec >= 1000000000L) {
+        time.tv_sec++;
+        time.tv_nsec -= 1000000000L;
+    }
+
+    return time;
+}
+
+/**
+ * Give a job the deadline of a `timeout`, counted from now. The earliest
+ * deadline of a job's commands is the one kept.
+ *
+ * @param options a duration of 0 leaves the job without one
+ */
+void set_job_timeout(JobTable *jobs, job_t job, TimeoutOptions *options) {
+    if (jobs->indices[job] != 0 || options->duration <= 0) {
+        return;
+    }
+
+    JobTimeout *timeout = &jobs->jobs[job].timeout;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct timespec deadline = add_seconds(now, options->duration);
+
+    if (timeout->active && (deadline.tv_sec > timeout->deadline.tv_sec
+        || (deadline.tv_sec == timeout->deadline.tv_sec && deadline.tv_nsec >= timeout->deadline.tv_nsec))) {
+        return;
+    }
+
+    if (!timeout->active) {
+        timeout->active = 1;
+        timeout->timer_fd = -1;
+        timeout->pid_fd = -1;
+    }
+    timeout->deadline = deadline;
+    timeout->kill_after = options->kill_after;
+    timeout->signal = options->signal;
+}
+
+/**
+ * @return the last signal a job's deadline had sent to it, `0` if it
+ *         finished in time or has none
+ */
+int job_timeout_signal(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] != 0) {
+        return 0;
+    }
+
+    return jobs->jobs[job].timeout.sent;
+}
+
+/* the deadline passed: the job's signal the first time, SIGKILL once `kill_after` passed too */
+static void expire(JobTable *jobs, job_t job) {
+    JobTimeout *timeout = &jobs->jobs[job].timeout;
+    int signal = timeout->sent == 0 ? timeout->signal : SIGKILL;
+
+    signal_job(jobs, job, signal);
+    if (signal != SIGCONT) {
+        /* a stopped job would never see it */
+        signal_job(jobs, job, SIGCONT);
+    }
+
+    timeout->sent = signal;
+}
+
+/* when the next signal is due, or 0 if none is left to send */
+static int next_expiry(JobTimeout *timeout, struct timespec *when) {
+    if (timeout->sent == 0) {
+        *when = timeout->deadline;
+        return 1;
+    } else if (timeout->sent != SIGKILL && timeout->kill_after > 0) {
+        *when = add_seconds(timeout->deadline, timeout->kill_after);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int passed(struct timespec *when, struct timespec *now) {
+    return now->tv_sec > when->tv_sec || (now->tv_sec == when->tv_sec && now->tv_nsec >= when->tv_nsec);
+}
+
+/**
+ * Signal the jobs whose deadline passed while nothing was waiting for them,
+ * like one in the background. Nothing but the signals is changed, so it can
+ * run in a signal handler that the job table's changes are masked from.
+ *
+ * @param next if not NULL, set to when the next signal of any of them is due
+ * @return `1` if another signal is due later, else `0`
+ */
+int expire_job_timeouts(JobTable *jobs, struct timespec *next) {
+    struct timespec now, when, earliest;
+    int pending = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (job_t job = 1; job < JOBS_MAX; job++) {
+        JobTimeout *timeout = &jobs->jobs[job].timeout;
+
+        if (jobs->indices[job] != 0 || !timeout->active || timeout->awaited || !jobs->jobs[job].processes) {
+            continue;
+        }
+
+        while (next_expiry(timeout, &when) && passed(&when, &now)) {
+            expire(jobs, job);
+        }
+
+        if (next_expiry(timeout, &when) && (!pending || !passed(&earliest, &when))) {
+            earliest = when;
+            pending = 1;
+        }
+    }
+
+    if (pending && next) {
+        *next = earliest;
+    }
+
+    return pending;
+}
+
+/* without pidfds: check on the process every few milliseconds */
+static void poll_process(JobTable *jobs, job_t job, Process *process) {
+    JobTimeout *timeout = &jobs->jobs[job].timeout;
+    struct timespec when, now;
+
+    for (;;) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, process->pid, &info, WEXITED | WSTOPPED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0) {
+            return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (next_expiry(timeout, &when) && passed(&when, &now)) {
+            expire(jobs, job);
+        }
+
+        struct timespec pause = { 0, TIMEOUT_POLL_MS * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ block until `process` can be reaped without waiting, signalling its job
+ when the deadline passes. a pidfd of the process and a timerfd armed for
+ the next signal are waited on together, so the job is signalled the
+ moment it is due without anything waking up in between
+*/
+static void await_process(JobTable *jobs, job_t job, Process *process) {
+    JobTimeout *timeout = &jobs->jobs[job].timeout;
+    struct timespec when;
+
+    if (!timeout->active || !next_expiry(timeout, &when)) {
+        return;
+    }
+
+#ifdef __linux__
+    if (timeout->timer_fd == -1) {
+        timeout->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    }
+    if (timeout->pid_fd != -1) {
+        close(timeout->pid_fd);
+    }
+    timeout->pid_fd = syscall(SYS_pidfd_open, process->pid, 0);
+
+    if (timeout->timer_fd != -1 && timeout->pid_fd != -1) {
+        for (;;) {
+            if (!next_expiry(timeout, &when)) {
+                break;
+            }
+
+            struct itimerspec timer = { .it_interval = { 0, 0 }, .it_value = when };
+            timerfd_settime(timeout->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+            struct pollfd fds[2] = {
+                { .fd = timeout->pid_fd, .events = POLLIN },
+                { .fd = timeout->timer_fd, .events = POLLIN },
+            };
+            if (poll(fds, 2, -1) == -1) {
+                continue;
+            }
+            if (fds[0].revents) {
+                break;
+            }
+
+            uint64_t expirations;
+            if (read(timeout->timer_fd, &expirations, sizeof expirations) == sizeof expirations) {
+                expire(jobs, job);
+            }
+        }
+
+        close(timeout->pid_fd);
+        timeout->pid_fd = -1;
+        return;
+    }
+#endif
+
+    poll_process(jobs, job, process);
+}
+
+int run_foreground(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] != 0) {
         return -1;
     }
 
     volatile int return_value = 0;
-    Process *process = job_stack.jobs[job].processes;
+    Process *process = jobs->jobs[job].processes;
 
     for (; process; process = process->next) {
         int status;
@@ -215,11 +445,23 @@ int run_foreground(job_t job) {
             return -1;
         }
 
-        if (waitpid(process->pid, &status, 0) == -1) {
-            perror("waitpid");
+        if (process->flags & JOB_FINISHED) {
+            continue;
+        }
+
+        await_process(jobs, job, process);
+        if (wait4(process->pid, &status, 0, &process->usage) == -1) {
+            perror("wait4");
             return -1;
         }
 
+        process->flags |= JOB_FINISHED;
+        clock_gettime(CLOCK_MONOTONIC, &process->end);
+
+        if (trace_enabled) {
+            trace_child_end(process->pid);
+        }
+
         if (WIFEXITED(status)) {
             return_value = WEXITSTATUS(status);
         } else if (WIFSIGNALED(status)) {
@@ -233,14 +475,14 @@ int run_foreground(job_t job) {
     return return_value;
 }
 
-int run_background(job_t job) {
-    if (job_stack.indices[job] != 0) {
+int run_background(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] != 0) {
         return -1;
     }
 
     // printf("[%d] %d\n", job, pid);
-    add_flags(job, JOB_ASYNC);
-    Process *process = job_stack.jobs[job].processes;
+    add_flags(jobs, job, JOB_ASYNC);
+    Process *process = jobs->jobs[job].processes;
 
     for (; process; process = process->next) {
         if (kill(process->pid, SIGCONT) == -1) {
@@ -252,16 +494,274 @@ int run_background(job_t job) {
     return 0;
 }
 
-Job* get_job_from_pid(pid_t pid) {
-    return hash_table_get(&job_stack.pid_to_job, pid);
+/* the jobs `jobs` would list */
+size_t job_count(JobTable *jobs) {
+    size_t count = 0;
+
+    for (job_t job = 1; job < JOBS_MAX; job++) {
+        if (jobs->indices[job] == 0 && jobs->jobs[job].processes) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+size_t job_process_count(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] != 0) {
+        return 0;
+    }
+
+    return jobs->jobs[job].process_count;
+}
+
+/* add the usage of one reaped child to a running total */
+static void add_rusage(struct rusage *total, struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+
+    /* peak memory of the largest process, the rest are summed */
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/* the body of `wait_job`, while its deadline is left to `await_process` */
+static int wait_processes(JobTable *jobs, job_t job, struct rusage *usage) {
+    int last_status = 0;
+    Process *process = jobs->jobs[job].processes;
+
+    for (; process; process = process->next) {
+        int status;
+
+        if (process->flags & JOB_FINISHED) {
+            continue;
+        }
+
+        await_process(jobs, job, process);
+        while (wait4(process->pid, &status, WUNTRACED, &process->usage) == -1) {
+            if (errno != EINTR) {
+                perror("wait4");
+                return -1;
+            }
+        }
+
+        if (WIFSTOPPED(status)) {
+            return status;
+        }
+
+        process->flags |= JOB_FINISHED;
+        clock_gettime(CLOCK_MONOTONIC, &process->end);
+        if (trace_enabled) {
+            trace_child_end(process->pid);
+        }
+
+        if (usage) {
+            add_rusage(usage, &process->usage);
+        }
+
+        last_status = status;
+    }
+
+    return last_status;
+}
+
+/**
+ * Wait until every process of a job has exited, or one of them stops.
+ *
+ * @param job the job to wait for
+ * @param usage if not NULL, the resource usage of each reaped process is added to it
+ * @return the wait status of the last process, or of the process that stopped
+ */
+int wait_job(JobTable *jobs, job_t job, struct rusage *usage) {
+    if (jobs->indices[job] != 0) {
+        return -1;
+    }
+
+    jobs->jobs[job].timeout.awaited = 1;
+    int status = wait_processes(jobs, job, usage);
+    jobs->jobs[job].timeout.awaited = 0;
+
+    return status;
+}
+
+/**
+ * Leave a job's deadline to `expire_job_timeouts` again after a signal
+ * jumped out of `wait_job`, like a job suspended from the terminal.
+ */
+void stop_waiting_for_job(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] == 0) {
+        jobs->jobs[job].timeout.awaited = 0;
+    }
+}
+
+Job* get_job_from_pid(JobTable *jobs, pid_t pid) {
+    return hash_table_get(&jobs->pid_to_job, pid);
+}
+
+/**
+ * Record that a child reaped outside of `wait_job` has exited.
+ *
+ * @param pid the pid returned by wait4
+ * @param usage the resource usage returned by wait4
+ * @return the job the process belongs to, or NULL if it has none
+ */
+Job* finish_process(JobTable *jobs, pid_t pid, struct rusage *usage) {
+    Job *job = get_job_from_pid(jobs, pid);
+    if (!job) {
+        return NULL;
+    }
+
+    Process *process = job->processes;
+    for (; process; process = process->next) {
+        if (process->pid == pid) {
+            process->flags |= JOB_FINISHED;
+            process->usage = *usage;
+            clock_gettime(CLOCK_MONOTONIC, &process->end);
+            break;
+        }
+    }
+
+    return job;
+}
+
+/**
+ * Reap the processes of a table's jobs that have exited without blocking,
+ * for when there is no SIGCHLD handler doing it, after signalling those
+ * whose deadline passed. Jobs whose processes have all exited are freed.
+ *
+ * @return the number of jobs freed
+ */
+int reap_jobs(JobTable *jobs) {
+    sigset_t alarm_mask, old_mask;
+    int freed = 0;
+
+    /* the shell's alarm handler signals jobs from the table, it mustn't see one being freed */
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm_mask, &old_mask);
+
+    /* nothing else enforces the deadlines of the jobs that aren't waited for */
+    expire_job_timeouts(jobs, NULL);
+
+    for (job_t job = 1; job < JOBS_MAX; job++) {
+        if (jobs->indices[job] != 0 || !jobs->jobs[job].processes) {
+            continue;
+        }
+
+        Process *process = jobs->jobs[job].processes;
+        for (; process; process = process->next) {
+            int status;
+            struct rusage usage;
+
+            if (!(process->flags & JOB_FINISHED)
+                && wait4(process->pid, &status, WNOHANG, &usage) == process->pid) {
+                finish_process(jobs, process->pid, &usage);
+            }
+        }
+
+        if (all_completed(jobs, job)) {
+            free_job(jobs, job);
+            freed++;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return freed;
+}
+
+static double seconds_between(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static long maxrss_kib(struct rusage *usage) {
+#ifdef __APPLE__ /* ru_maxrss is in bytes on macOS, KiB on linux */
+    return usage->ru_maxrss / 1024;
+#else
+    return usage->ru_maxrss;
+#endif
+}
+
+static void print_usage(double elapsed, struct rusage *usage) {
+    printf("%8.2fs %8.2fs %8.2fs %8ld %8ld %8ld",
+        elapsed, timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+        maxrss_kib(usage), usage->ru_inblock, usage->ru_oublock);
+}
+
+/*
+ `jobs -l`: every process with its state and elapsed time, and once it has
+ been reaped its cpu time, peak RSS and blocks read and written. a job with
+ more than one process gets a total line, its elapsed time is the longest
+ of its processes and its RSS the largest
+*/
+static void print_job_long(JobTable *jobs, job_t job) {
+    struct timespec now;
+    struct rusage total;
+    double longest = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&total, 0, sizeof total);
+
+    Process *process = jobs->jobs[job].processes;
+    for (; process; process = process->next) {
+        int finished = process->flags & JOB_FINISHED;
+        double elapsed = seconds_between(&process->start, finished ? &process->end : &now);
+
+        if (elapsed > longest) {
+            longest = elapsed;
+        }
+
+        if (process == jobs->jobs[job].processes) {
+            printf("[%d]", job);
+        }
+
+        printf("\t%d\t%-7s ", process->pid, finished ? "done" : "running");
+
+        if (finished) {
+            add_rusage(&total, &process->usage);
+            print_usage(elapsed, &process->usage);
+        } else {
+            printf("%8.2fs %9s %9s %8s %8s %8s", elapsed, "-", "-", "-", "-", "-");
+        }
+
+        printf("  %s\n", process->cmd);
+    }
+
+    if (jobs->jobs[job].process_count > 1) {
+        printf("\t%-7s %-7s ", "total", "");
+        print_usage(longest, &total);
+        printf("\n");
+    }
+}
+
+void print_jobs_long(JobTable *jobs) {
+    printf("\t%-7s %-7s %9s %9s %9s %8s %8s %8s\n",
+        "pid", "state", "elapsed", "user", "sys", "rss KiB", "in blk", "out blk");
+
+    for (int job = 1; job < JOBS_MAX; job++) {
+        if (jobs->indices[job] == 0 && jobs->jobs[job].processes) {
+            print_job_long(jobs, job);
+        }
+    }
 }
 
-int all_completed(job_t job) {
-    if (job_stack.indices[job] != 0) {
+int all_completed(JobTable *jobs, job_t job) {
+    if (jobs->indices[job] != 0) {
         return 0;
     }
 
-    Process *process = job_stack.jobs[job].processes;
+    Process *process = jobs->jobs[job].processes;
     for (; process; process = process->next) {
         if ((process->flags & JOB_FINISHED) == 0) {
             return 0;
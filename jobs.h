@@ -1,19 +1,32 @@
 #ifndef __QUASH_JOBS_H__
 #define __QUASH_JOBS_H__
 
+#include <sys/resource.h>
+#include <time.h>
+
 #include "quash.h"
 
-void init_job_stack();
-void cleanup_jobs();
-job_t create_job();
-int register_process(ASTNode *ast, job_t job, pid_t pid);
-Job* get_job_from_pid(pid_t pid);
-void free_job(job_t job);
-void print_job(job_t job);
-void print_jobs();
-int signal_job(job_t job, int signal);
-int run_foreground(job_t job);
-int run_background(job_t job);
-int all_completed(job_t job);
+void init_job_table(JobTable *jobs);
+void cleanup_jobs(JobTable *jobs);
+job_t create_job(JobTable *jobs);
+int register_process(JobTable *jobs, int argc, char **argv, job_t job, pid_t pid);
+Job* get_job_from_pid(JobTable *jobs, pid_t pid);
+Job* finish_process(JobTable *jobs, pid_t pid, struct rusage *usage);
+int reap_jobs(JobTable *jobs);
+void free_job(JobTable *jobs, job_t job);
+void print_job(JobTable *jobs, job_t job);
+void print_jobs(JobTable *jobs);
+void print_jobs_long(JobTable *jobs);
+int signal_job(JobTable *jobs, job_t job, int signal);
+int run_foreground(JobTable *jobs, job_t job);
+int run_background(JobTable *jobs, job_t job);
+int all_completed(JobTable *jobs, job_t job);
+size_t job_count(JobTable *jobs);
+size_t job_process_count(JobTable *jobs, job_t job);
+int wait_job(JobTable *jobs, job_t job, struct rusage *usage);
+void stop_waiting_for_job(JobTable *jobs, job_t job);
+void set_job_timeout(JobTable *jobs, job_t job, TimeoutOptions *options);
+int job_timeout_signal(JobTable *jobs, job_t job);
+int expire_job_timeouts(JobTable *jobs, struct timespec *next);
 
 #endif /* __QUASH_JOBS_H__ */
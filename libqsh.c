@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "quash.h"
+#include "jobs.h"
+#include "eval.h"
+#include "qsh.h"
+#include "fds.h"
+
+/*
+ The public API of libqsh. An embedded context never installs signal
+ handlers or exits the process, background jobs it starts are reaped at
+ the start of the next evaluation instead of from SIGCHLD.
+*/
+
+/* what the child of a capture reports back besides its output */
+typedef struct _CaptureResult {
+    int eval_result;
+    int exited;
+    int status;
+} CaptureResult;
+
+QshContext* qsh_create() {
+    QshContext *ctx = malloc(sizeof *ctx);
+    if (ctx) {
+        init_context(ctx, 0);
+    }
+
+    return ctx;
+}
+
+void qsh_destroy(QshContext *ctx) {
+    if (!ctx) {
+        return;
+    }
+
+    reap_jobs(&ctx->jobs);
+    free_context(ctx);
+    free(ctx);
+}
+
+/* run `line` in the calling process */
+static int eval_in_context(QshContext *ctx, const char *line, int *status) {
+    if (ctx->exit_requested) {
+        return QSH_EXITED;
+    }
+
+    reap_jobs(&ctx->jobs);
+
+    /* the tokenizer works on a copy it may modify */
+    char *copy = strdup(line);
+    ctx->last_status = 0;
+    int result = eval_line(ctx, copy);
+    free(copy);
+
+    if (status) {
+        *status = ctx->last_status;
+    }
+
+    if (result == -1) {
+        return -1;
+    }
+
+    return ctx->exit_requested ? QSH_EXITED : 0;
+}
+
+int qsh_eval(QshContext *ctx, const char *line, int *status) {
+    return eval_in_context(ctx, line, status);
+}
+
+static void begin_capture(QshBuffer *buffer) {
+    if (buffer) {
+        buffer->length = 0;
+        buffer->truncated = 0;
+    }
+}
+
+/* append to `buffer`, keeping room for the NUL and dropping what won't fit */
+static void capture(QshBuffer *buffer, const char *data, size_t length) {
+    if (buffer->size == 0) {
+        buffer->truncated |= length > 0;
+        return;
+    }
+
+    size_t room = buffer->size - 1 - buffer->length;
+    if (length > room) {
+        buffer->truncated = 1;
+        length = room;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+static int capture_pipe(QshBuffer *buffer, int fds[2]) {
+    fds[0] = fds[1] = -1;
+    if (!buffer) {
+        return 0;
+    }
+
+    return cloexec_pipe(fds);
+}
+
+static void close_pipe(int fds[2]) {
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+int qsh_eval_capture(QshContext *ctx, const char *line, int *status, QshBuffer *out, QshBuffer *err) {
+    int out_pipe[2], err_pipe[2], result_pipe[2];
+    CaptureResult result = { .eval_result = -1, .exited = 0, .status = 0 };
+
+    if (!out && !err) {
+        return eval_in_context(ctx, line, status);
+    }
+
+    if (ctx->exit_requested) {
+        return QSH_EXITED;
+    }
+
+    begin_capture(out);
+    begin_capture(err);
+
+    if (capture_pipe(out, out_pipe) == -1 || capture_pipe(err, err_pipe) == -1 || cloexec_pipe(result_pipe) == -1) {
+        perror("pipe");
+        close_pipe(out_pipe);
+        close_pipe(err_pipe);
+        return -1;
+    }
+
+    /* anything the host left buffered must not be written twice */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close_pipe(out_pipe);
+        close_pipe(err_pipe);
+        close_pipe(result_pipe);
+        return -1;
+    } else if (pid == 0) {
+        close(result_pipe[0]);
+
+        if (out) {
+            dup2(out_pipe[1], STDOUT_FILENO);
+            close_pipe(out_pipe);
+        }
+        if (err) {
+            dup2(err_pipe[1], STDERR_FILENO);
+            close_pipe(err_pipe);
+        }
+
+        result.eval_result = eval_in_context(ctx, line, &result.status);
+        result.exited = ctx->exit_requested;
+        fflush(NULL);
+
+        write(result_pipe[1], &result, sizeof result);
+
+        /* not exit(), the host's atexit handlers belong to the host */
+        _exit(0);
+    }
+
+    close(result_pipe[1]);
+    if (out) {
+        close(out_pipe[1]);
+    }
+    if (err) {
+        close(err_pipe[1]);
+    }
+
+    struct pollfd fds[2];
+    QshBuffer *buffers[2];
+    int open_count = 0;
+
+    if (out) {
+        fds[open_count] = (struct pollfd) { .fd = out_pipe[0], .events = POLLIN };
+        buffers[open_count++] = out;
+    }
+    if (err) {
+        fds[open_count] = (struct pollfd) { .fd = err_pipe[0], .events = POLLIN };
+        buffers[open_count++] = err;
+    }
+
+    /* read both until they close so neither can fill up and block the child */
+    int remaining = open_count;
+    while (remaining > 0) {
+        if (poll(fds, open_count, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < open_count; i++) {
+            if (fds[i].fd == -1 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            char chunk[4096];
+            ssize_t n = read(fds[i].fd, chunk, sizeof chunk);
+
+            if (n > 0) {
+                capture(buffers[i], chunk, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                remaining--;
+            }
+        }
+    }
+
+    for (int i = 0; i < open_count; i++) {
+        if (fds[i].fd != -1) {
+            close(fds[i].fd);
+        }
+    }
+
+    ssize_t n;
+    while ((n = read(result_pipe[0], &result, sizeof result)) == -1 && errno == EINTR) { }
+    close(result_pipe[0]);
+
+    int child_status;
+    while (waitpid(pid, &child_status, 0) == -1 && errno == EINTR) { }
+
+    if (n != sizeof result) {
+        /* the child died before it could report */
+        result.eval_result = -1;
+        result.status = WIFSIGNALED(child_status) ? 128 + WTERMSIG(child_status) : -1;
+    }
+
+    if (status) {
+        *status = result.status;
+    }
+
+    if (result.exited) {
+        ctx->exit_requested = 1;
+    }
+
+    return result.eval_result;
+}
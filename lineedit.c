@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+
+#include "quash.h"
+#include "history.h"
+#include "lineedit.h"
+#include "complete.h"
+
+/*
+ A small line editor used instead of GNU readline when the shell is built
+ with `make minimal` or run with QSH_EDITOR=minimal. It puts the terminal in
+ raw mode and supports the usual emacs-style movement and kill keys, history
+ navigation over the shell's history index and Tab completion of command
+ names.
+*/
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define KEY_DELETE 0x100
+#define KEY_PROMPT 0x101        /* not a key, the prompt changed */
+
+/* a Tab that can't narrow the matches lists this many of them */
+#define COMPLETION_LIST_MAX 100
+
+static struct termios original_termios;
+static int raw_mode = 0;
+
+static int prompt_fd = -1;
+static const char* (*prompt_refresh)() = NULL;
+
+typedef struct _LineBuffer {
+    char *text;
+    size_t length;
+    size_t slots;
+    size_t cursor;
+} LineBuffer;
+
+static int enable_raw_mode() {
+    struct termios raw;
+
+    if (tcgetattr(STDIN_FILENO, &original_termios) == -1) {
+        return 0;
+    }
+
+    raw = original_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        return 0;
+    }
+
+    raw_mode = 1;
+    return 1;
+}
+
+void lineedit_cleanup() {
+    if (raw_mode) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
+        raw_mode = 0;
+    }
+}
+
+/**
+ * Redraw the prompt with whatever `refresh` returns when `fd` is readable
+ * while a line is being edited.
+ *
+ * @param fd the fd to watch, or `-1` for a prompt that never changes
+ * @param refresh returns the new prompt
+ */
+void lineedit_watch_prompt(int fd, const char* (*refresh)()) {
+    prompt_fd = fd;
+    prompt_refresh = refresh;
+}
+
+static void write_string(const char *s, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, s, len);
+        if (n <= 0) {
+            return;
+        }
+
+        s += n;
+        len -= n;
+    }
+}
+
+static void refresh_line(const char *prompt, LineBuffer *line) {
+    char move[32];
+
+    write_string("\r", 1);
+    write_string(prompt, strlen(prompt));
+    write_string(line->text, line->length);
+    write_string("\033[K", 3);
+
+    /* "\033[0C" would still move one column */
+    size_t column = strlen(prompt) + line->cursor;
+    int n = column ? snprintf(move, sizeof move, "\r\033[%zuC", column) : snprintf(move, sizeof move, "\r");
+    write_string(move, n);
+}
+
+static void reserve(LineBuffer *line, size_t length) {
+    if (length + 1 > line->slots) {
+        while (length + 1 > line->slots) {
+            line->slots *= 2;
+        }
+
+        line->text = realloc(line->text, line->slots);
+    }
+}
+
+static void insert_char(LineBuffer *line, char c) {
+    reserve(line, line->length + 1);
+    memmove(line->text + line->cursor + 1, line->text + line->cursor, line->length - line->cursor);
+    line->text[line->cursor++] = c;
+    line->length++;
+    line->text[line->length] = '\0';
+}
+
+static void delete_range(LineBuffer *line, size_t from, size_t to) {
+    memmove(line->text + from, line->text + to, line->length - to);
+    line->length -= to - from;
+    line->text[line->length] = '\0';
+
+    if (line->cursor > to) {
+        line->cursor -= to - from;
+    } else if (line->cursor > from) {
+        line->cursor = from;
+    }
+}
+
+static void replace_line(LineBuffer *line, const char *text) {
+    size_t len = strlen(text);
+    reserve(line, len);
+    memcpy(line->text, text, len + 1);
+    line->length = len;
+    line->cursor = len;
+}
+
+/*
+ complete the command name before the cursor as far as all the matches
+ agree, or list them when they already disagree at the cursor
+*/
+static void complete_command(LineBuffer *line) {
+    size_t start = line->cursor;
+    while (start > 0 && !strchr(" |&;<>", line->text[start - 1])) {
+        start--;
+    }
+
+    size_t typed = line->cursor - start;
+    if (!command_position(line->text, start) || memchr(line->text + start, '/', typed)) {
+        write_string("\a", 1);
+        return;
+    }
+
+    char **matches = command_index_complete(line->text + start, typed);
+    size_t count = 0, common = 0;
+
+    if (matches[0]) {
+        common = strlen(matches[0]);
+    }
+    for (count = 0; matches[count]; count++) {
+        size_t same = typed;
+        while (same < common && matches[count][same] == matches[0][same]) {
+            same++;
+        }
+        common = same;
+    }
+
+    if (count == 0) {
+        write_string("\a", 1);
+    } else if (common > typed || count == 1) {
+        for (size_t i = typed; i < common; i++) {
+            insert_char(line, matches[0][i]);
+        }
+        if (count == 1) {
+            insert_char(line, ' ');
+        }
+    } else {
+        write_string("\r\n", 2);
+        for (size_t i = 0; i < count && i < COMPLETION_LIST_MAX; i++) {
+            write_string(matches[i], strlen(matches[i]));
+            write_string("  ", 2);
+        }
+        if (count > COMPLETION_LIST_MAX) {
+            char more[64];
+            write_string(more, snprintf(more, sizeof more, "(%zu more)", count - COMPLETION_LIST_MAX));
+        }
+        write_string("\r\n", 2);
+    }
+
+    command_index_free_matches(matches);
+}
+
+/* read one key, folding the common escape sequences into control keys */
+static int read_key() {
+    char c;
+    char seq[3];
+
+    if (prompt_fd != -1) {
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = prompt_fd, .events = POLLIN },
+        };
+
+        if (poll(fds, 2, -1) > 0 && !(fds[0].revents & POLLIN) && (fds[1].revents & POLLIN)) {
+            return KEY_PROMPT;
+        }
+    }
+
+    if (read(STDIN_FILENO, &c, 1) != 1) {
+        return -1;
+    }
+
+    if (c != '\033') {
+        return (unsigned char) c;
+    }
+
+    if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) {
+        return '\033';
+    }
+
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+            return '\033';
+        }
+
+        if (seq[2] == '~') {
+            switch (seq[1]) {
+            case '1': case '7': return CTRL_KEY('A');
+            case '4': case '8': return CTRL_KEY('E');
+            case '3': return KEY_DELETE;
+            }
+        }
+
+        return '\033';
+    }
+
+    if (seq[0] == '[' || seq[0] == 'O') {
+        switch (seq[1]) {
+        case 'A': return CTRL_KEY('P');
+        case 'B': return CTRL_KEY('N');
+        case 'C': return CTRL_KEY('F');
+        case 'D': return CTRL_KEY('B');
+        case 'H': return CTRL_KEY('A');
+        case 'F': return CTRL_KEY('E');
+        }
+    }
+
+    return '\033';
+}
+
+/* plain line reader for when stdin is not a terminal */
+static char* read_plain_line(const char *prompt) {
+    char *text = NULL;
+    size_t slots = 0;
+    ssize_t len;
+
+    if (isatty(STDOUT_FILENO)) {
+        fputs(prompt, stdout);
+        fflush(stdout);
+    }
+
+    if ((len = getline(&text, &slots, stdin)) == -1) {
+        free(text);
+        return NULL;
+    }
+
+    if (len > 0 && text[len - 1] == '\n') {
+        text[len - 1] = '\0';
+    }
+
+    return text;
+}
+
+/**
+ * Read a line from the terminal with basic editing. Up and down (or ^P and
+ * ^N) walk `history`, ^R replaces the line with the best history match for
+ * its contents and Tab completes a command name.
+ *
+ * @param prompt the prompt to print before the line
+ * @param history the history to navigate, may be NULL
+ * @return a malloc'd line without its newline, or NULL at end of input
+ */
+char* lineedit_read(const char *prompt, HistoryIndex *history) {
+    if (!isatty(STDIN_FILENO) || !enable_raw_mode()) {
+        return read_plain_line(prompt);
+    }
+
+    LineBuffer line = { .text = malloc(64), .length = 0, .slots = 64, .cursor = 0 };
+    line.text[0] = '\0';
+
+    /* the line being edited is kept aside while browsing the history */
+    size_t history_pos = history ? history->length : 0;
+    char *saved = NULL;
+
+    refresh_line(prompt, &line);
+
+    for (;;) {
+        int key = read_key();
+
+        switch (key) {
+        case CTRL_KEY('D'):
+            if (line.length > 0) {
+                if (line.cursor < line.length) {
+                    delete_range(&line, line.cursor, line.cursor + 1);
+                }
+                break;
+            }
+            /* fall through */
+        case -1:
+            lineedit_cleanup();
+            write_string("\r\n", 2);
+            free(line.text);
+            free(saved);
+            return NULL;
+        case '\r':
+        case '\n':
+            lineedit_cleanup();
+            write_string("\r\n", 2);
+            free(saved);
+            return line.text;
+        case CTRL_KEY('C'):
+            line.length = line.cursor = 0;
+            line.text[0] = '\0';
+            write_string("^C\r\n", 4);
+            break;
+        case 127:
+        case CTRL_KEY('H'):
+            if (line.cursor > 0) {
+                delete_range(&line, line.cursor - 1, line.cursor);
+            }
+            break;
+        case KEY_DELETE:
+            if (line.cursor < line.length) {
+                delete_range(&line, line.cursor, line.cursor + 1);
+            }
+            break;
+        case CTRL_KEY('A'):
+            line.cursor = 0;
+            break;
+        case CTRL_KEY('E'):
+            line.cursor = line.length;
+            break;
+        case CTRL_KEY('B'):
+            if (line.cursor > 0) {
+                line.cursor--;
+            }
+            break;
+        case CTRL_KEY('F'):
+            if (line.cursor < line.length) {
+                line.cursor++;
+            }
+            break;
+        case CTRL_KEY('K'):
+            delete_range(&line, line.cursor, line.length);
+            break;
+        case CTRL_KEY('U'):
+            delete_range(&line, 0, line.cursor);
+            break;
+        case CTRL_KEY('W'): {
+            size_t start = line.cursor;
+            while (start > 0 && line.text[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && line.text[start - 1] != ' ') {
+                start--;
+            }
+            delete_range(&line, start, line.cursor);
+            break;
+        }
+        case '\t':
+            complete_command(&line);
+            break;
+        case KEY_PROMPT:
+            prompt = prompt_refresh();
+            break;
+        case CTRL_KEY('L'):
+            write_string("\033[H\033[2J", 7);
+            break;
+        case CTRL_KEY('P'):
+            if (history && history_pos > 0) {
+                if (history_pos == history->length) {
+                    free(saved);
+                    saved = strdup(line.text);
+                }
+
+                replace_line(&line, history_index_entry(history, --history_pos));
+            }
+            break;
+        case CTRL_KEY('N'):
+            if (history && history_pos < history->length) {
+                history_pos++;
+                replace_line(&line, history_pos == history->length
+                    ? (saved ? saved : "")
+                    : history_index_entry(history, history_pos));
+            }
+            break;
+        case CTRL_KEY('R'):
+            if (history) {
+                uint32_t result;
+                if (history_index_search(history, line.text, &result, 1) == 1) {
+                    replace_line(&line, history_index_entry(history, result));
+                }
+            }
+            break;
+        default:
+            if (key >= ' ' && key < 127) {
+                insert_char(&line, key);
+            }
+            break;
+        }
+
+        refresh_line(prompt, &line);
+    }
+}
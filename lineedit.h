@@ -0,0 +1,10 @@
+#ifndef __QUASH_LINEEDIT_H__
+#define __QUASH_LINEEDIT_H__
+
+#include "quash.h"
+
+char* lineedit_read(const char *prompt, HistoryIndex *history);
+void lineedit_cleanup();
+void lineedit_watch_prompt(int fd, const char* (*refresh)());
+
+#endif /* __QUASH_LINEEDIT_H__ */
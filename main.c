@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <getopt.h>
+#include <poll.h>
+
+#ifndef QSH_MINIMAL_EDITOR
+#include <readline/readline.h>
+#include <readline/history.h>
+#endif
+
+#include "quash.h"
+#include "history.h"
+#include "jobs.h"
+#include "lineedit.h"
+#include "trace.h"
+#include "eval.h"
+#include "server.h"
+#include "script.h"
+#include "complete.h"
+#include "prompt.h"
+#include "memstats.h"
+
+/*
+ The interactive shell: the prompt and its line editors, `-e` and
+ `--server`. Evaluation itself lives in quash.c and is built into libqsh.
+*/
+
+/* the context of the shell the user is typing into */
+static QshContext shell;
+
+/* set when the line editor is GNU readline rather than the built-in one */
+int use_readline = 0;
+
+#ifndef QSH_MINIMAL_EDITOR
+/**
+ * Readline command bound to ^R. Replaces the line with the best history
+ * match for its current contents; pressing ^R again while a match is shown
+ * steps through the next best matches.
+ */
+int history_search_command(int count, int key) {
+    static uint32_t results[HISTORY_SEARCH_MAX];
+    static int result_count = 0;
+    static int shown = -1;
+    (void) count;
+    (void) key;
+
+    if (shown >= 0 && shown < result_count
+        && strcmp(rl_line_buffer, history_index_entry(&shell.history, results[shown])) == 0) {
+        shown++;
+    } else {
+        result_count = history_index_search(&shell.history, rl_line_buffer, results, HISTORY_SEARCH_MAX);
+        shown = 0;
+    }
+
+    if (shown >= result_count) {
+        shown = -1;
+        rl_ding();
+        return 0;
+    }
+
+    rl_replace_line(history_index_entry(&shell.history, results[shown]), 0);
+    rl_point = rl_end;
+    return 0;
+}
+
+static char* command_name_generator(const char *text, int state) {
+    static char **matches = NULL;
+    static size_t next = 0;
+
+    if (state == 0) {
+        command_index_free_matches(matches);
+        matches = command_index_complete(text, strlen(text));
+        next = 0;
+    }
+
+    return matches[next] ? strdup(matches[next++]) : NULL;
+}
+
+/* command names from the index in command position, readline's filenames elsewhere */
+static char** complete_command_name(const char *text, int start, int end) {
+    (void) end;
+
+    if (!command_position(rl_line_buffer, start) || strchr(text, '/')) {
+        return NULL;
+    }
+
+    return rl_completion_matches(text, command_name_generator);
+}
+
+/* readline's getc, redrawing the prompt when a background segment arrives */
+static int read_key_or_prompt(FILE *stream) {
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = fileno(stream), .events = POLLIN },
+            { .fd = prompt_update_fd(), .events = POLLIN },
+        };
+
+        if (fds[1].fd == -1 || poll(fds, 2, -1) == -1 || (fds[0].revents & POLLIN) || !(fds[1].revents & POLLIN)) {
+            return rl_getc(stream);
+        }
+
+        /* readline redraws from the start of the row it thinks it is on */
+        rl_set_prompt(prompt_refresh());
+        fputs("\r\033[K", rl_outstream);
+        rl_forced_update_display();
+    }
+}
+#endif
+
+void newline() {
+    puts("");
+}
+
+static char* read_line(const char *prompt) {
+#ifndef QSH_MINIMAL_EDITOR
+    if (use_readline) {
+        return mem_adopt(MEM_READLINE, readline(prompt));
+    }
+#endif
+
+    return mem_adopt(MEM_READLINE, lineedit_read(prompt, &shell.history));
+}
+
+/* put the line editor back in a sane state after a signal jumped out of it */
+static void reset_line_editor() {
+#ifndef QSH_MINIMAL_EDITOR
+    if (use_readline) {
+        /* https://lists.gnu.org/archive/html/bug-readline/2016-04/msg00071.html */
+        rl_free_line_state();
+        rl_cleanup_after_signal();
+
+#ifdef __linux__
+        RL_UNSETSTATE(RL_STATE_ISEARCH|RL_STATE_NSEARCH|RL_STATE_VIMOTION|RL_STATE_NUMERICARG|RL_STATE_MULTIKEY);
+        rl_line_buffer[rl_point = rl_end = rl_mark = 0] = 0;
+#elif __apple__
+        rl_line_buffer[rl_point = rl_end = 0] = 0;
+#endif
+        rl_callback_handler_remove();
+        return;
+    }
+#endif
+
+    lineedit_cleanup();
+}
+
+int interactive_prompt(QshContext *ctx) {
+    const char *prompt;
+    char *line;
+
+    if (isatty(STDIN_FILENO)) {
+        command_index_start();
+    }
+
+#ifndef QSH_MINIMAL_EDITOR
+    /* readline is only worth initializing for a terminal that asked for it */
+    const char *editor = getenv("QSH_EDITOR");
+    use_readline = isatty(STDIN_FILENO) && !(editor && strcmp(editor, "minimal") == 0);
+
+#ifndef __APPLE__ /* libedit has no rl_replace_line */
+    if (use_readline) {
+        rl_bind_key('R' & 0x1f, history_search_command);
+    }
+#endif
+    rl_attempted_completion_function = complete_command_name;
+    rl_getc_function = read_key_or_prompt;
+#endif
+
+    for (;;) {
+        /* deadlines that passed while a signal was masked, and the alarm for the next one */
+        check_job_timeouts(ctx);
+
+        prompt = prompt_render(ctx);
+        lineedit_watch_prompt(prompt_update_fd(), prompt_refresh);
+        line = read_line(prompt);
+
+        if (sigsetjmp(ctx->prompt, 1)) {
+            /* before anything is printed to where a group redirected stdout */
+            reset_evaluation(ctx);
+            reset_line_editor();
+            printf("\n");
+            continue;
+        }
+
+        if (line == NULL) {
+            newline();
+            break;
+        } else if (line[0] == '\0') {
+            mem_free(MEM_READLINE, line);
+            continue;
+        }
+
+#ifndef QSH_MINIMAL_EDITOR
+        if (use_readline) {
+            add_history(line);
+            mem_account(MEM_READLINE, sizeof (HIST_ENTRY) + strlen(line) + 1);
+        }
+#endif
+        history_index_add(&ctx->history, line);
+        eval_line(ctx, line);
+        mem_free(MEM_READLINE, line);
+    }
+
+    return 0;
+}
+
+void print_help() {
+    printf("");
+}
+
+int main(int argc, char *argv[]) {
+    /* accounting has to start before the first allocation it would see freed */
+    for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats_enable();
+        }
+    }
+
+    init_context(&shell, CTX_INTERACTIVE);
+    init_signal_handlers(&shell);
+
+    /* tracing from startup, `set -o trace` turns it on later */
+    const char *trace_path = getenv("QSH_TRACE");
+    if (trace_path && trace_path[0] != '\0') {
+        trace_open(trace_path);
+    }
+    atexit(trace_close);
+
+    static struct option long_options[] = {
+        { "server", required_argument, NULL, 's' },
+        { "mem-stats", no_argument, NULL, 'm' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    int ret;
+    char *eval = NULL;
+    while ((opt = getopt_long(argc, argv, "he:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            print_help();
+            exit(0);
+        case 'e':
+            /* like a script, there is no prompt to jump back to */
+            restore_signal_handlers();
+            shell.flags &= ~CTX_INTERACTIVE;
+
+            /* the last command takes over this process rather than leave it waiting, unless it has to report */
+            if (!mem_stats_enabled) {
+                shell.flags |= CTX_TAIL_EXEC;
+            }
+            eval_line(&shell, optarg);
+
+            /* there is no SIGCHLD handler to pick up background jobs */
+            reap_jobs(&shell.jobs);
+            ret = shell.last_status;
+            free_context(&shell);
+            exit(ret);
+        case 's':
+            /* commands are evaluated in children that reap their own jobs */
+            restore_signal_handlers();
+            ret = run_server(&shell, optarg);
+            free_context(&shell);
+            exit(ret);
+        case 'm':
+            /* already enabled above */
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-e eval] [--server socket] [--mem-stats] [-h] [script]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        /* a script has no prompt to jump back to, and `exit` ends the script */
+        restore_signal_handlers();
+        shell.flags &= ~CTX_INTERACTIVE;
+        if (!mem_stats_enabled) {
+            shell.flags |= CTX_TAIL_EXEC;
+        }
+
+        ret = run_script(&shell, argv[optind]);
+        free_context(&shell);
+        exit(ret);
+    }
+
+    interactive_prompt(&shell);
+
+#ifndef QSH_MINIMAL_EDITOR
+    if (use_readline) {
+        clear_history();
+    }
+#endif
+    free_context(&shell);
+    return 0;
+}
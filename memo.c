@@ -0,0 +1,401 @@
+#define _GNU_SOURCE /* sendfile */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "quash.h"
+#include "memo.h"
+
+/*
+ `memo [-e NAME] [-f FILE] [-F FILE] cmd ...` runs a deterministic command
+ once and replays its stdout, stderr and exit status afterwards for as long
+ as nothing it depends on changed. The cache key hashes the argv, the
+ working directory, stdin, the variables named with -e, and the files
+ named with -f (by path, size, inode and mtime) or -F (by contents). A
+ stdin that is a file counts like -f plus its offset, one that is a pipe
+ or socket means the command is run uncached every time.
+
+ Each entry is one file named by the key under $QSH_MEMO_DIR, by default
+ $XDG_CACHE_HOME/qsh/memo or ~/.cache/qsh/memo: a line with the status and
+ the lengths of the two outputs, then stdout and stderr. A hit is the hash
+ and two `sendfile`s out of that file. A miss runs the command with its
+ outputs going to temporary files, builds the entry next to where it goes
+ and renames it into place, so readers only ever see whole entries.
+*/
+
+#define MEMO_MAGIC "qsh-memo 1"
+#define MEMO_HEADER_MAX 128
+#define COPY_CHUNK 65536
+
+typedef struct _MemoKey {
+    uint64_t a;
+    uint64_t b;
+} MemoKey;
+
+void init_memo_options(MemoOptions *memo) {
+    memset(memo, 0, sizeof *memo);
+}
+
+void free_memo_options(MemoOptions *memo) {
+    free(memo->inputs);
+    init_memo_options(memo);
+}
+
+static void add_input(MemoOptions *memo, char kind, char *value) {
+    if (memo->input_count == memo->input_slots) {
+        memo->input_slots = memo->input_slots ? memo->input_slots * 2 : 8;
+        memo->inputs = realloc(memo->inputs, memo->input_slots * sizeof *memo->inputs);
+    }
+
+    memo->inputs[memo->input_count++] = (MemoInput) { .kind = kind, .value = value };
+}
+
+/**
+ * Read the options of a `memo` prefix.
+ *
+ * @param argc the number of words, argv[0] being `memo`
+ * @param memo filled in with the options, which point into argv
+ * @return how many words the prefix took, or `-1` after reporting an error
+ */
+int parse_memo_prefix(int argc, char **argv, MemoOptions *memo) {
+    int shift = 1;
+
+    for (; shift < argc && argv[shift][0] == '-'; shift++) {
+        const char *option = argv[shift];
+
+        if (strcmp(option, "--") == 0) {
+            shift++;
+            break;
+        }
+
+        if (strlen(option) != 2 || !strchr("efF", option[1])) {
+            fprintf(stderr, "memo: Unknown option: %s\n", option);
+            return -1;
+        }
+        if (++shift == argc) {
+            fprintf(stderr, "memo: %s needs a value\n", option);
+            return -1;
+        }
+
+        add_input(memo, option[1], argv[shift]);
+    }
+
+    if (shift >= argc) {
+        fprintf(stderr, "memo: Usage memo [-e name] [-f file] [-F file] command [args ...]\n");
+        return -1;
+    }
+
+    memo->enabled = 1;
+    return shift;
+}
+
+/*
+ two 64 bit FNV-1a style lanes with different bases and multipliers, wide
+ enough that unrelated keys don't collide in a cache directory
+*/
+static void hash_bytes(MemoKey *key, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < length; i++) {
+        key->a = (key->a ^ bytes[i]) * 0x100000001b3ULL;
+        key->b = (key->b ^ bytes[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+/* length first, so ("ab", "c") and ("a", "bc") differ */
+static void hash_field(MemoKey *key, const void *data, size_t length) {
+    uint64_t n = length;
+    hash_bytes(key, &n, sizeof n);
+    hash_bytes(key, data, length);
+}
+
+static void hash_string(MemoKey *key, const char *string) {
+    hash_field(key, string ? string : "", string ? strlen(string) + 1 : 0);
+}
+
+static int hash_contents(MemoKey *key, const char *path) {
+    char buffer[COPY_CHUNK];
+    ssize_t n;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    while ((n = read(fd, buffer, sizeof buffer)) > 0) {
+        hash_bytes(key, buffer, n);
+    }
+
+    close(fd);
+    return n == 0;
+}
+
+static MemoKey memo_key(MemoOptions *memo, char **argv) {
+    MemoKey key = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+    char cwd[PATH_MAX];
+    struct stat st;
+
+    for (char **arg = argv; *arg; arg++) {
+        hash_string(&key, *arg);
+    }
+    hash_string(&key, getcwd(cwd, sizeof cwd));
+
+    /* what the command reads: a file by identity, size, mtime and where reading starts */
+    if (fstat(STDIN_FILENO, &st) == 0) {
+        uint64_t fields[] = {
+            st.st_mode & S_IFMT, st.st_rdev, 0, 0, 0, 0, 0,
+        };
+        if (S_ISREG(st.st_mode)) {
+            fields[2] = st.st_dev;
+            fields[3] = st.st_ino;
+            fields[4] = st.st_size;
+            fields[5] = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+            fields[6] = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        }
+        hash_field(&key, fields, sizeof fields);
+    }
+
+    for (size_t i = 0; i < memo->input_count; i++) {
+        MemoInput *input = &memo->inputs[i];
+
+        hash_bytes(&key, &input->kind, 1);
+        hash_string(&key, input->value);
+
+        switch (input->kind) {
+        case 'e':
+            hash_string(&key, getenv(input->value));
+            break;
+        case 'f':
+            if (stat(input->value, &st) == 0) {
+                uint64_t fields[] = {
+                    st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                };
+                hash_field(&key, fields, sizeof fields);
+            } else {
+                hash_field(&key, NULL, 0);
+            }
+            break;
+        case 'F':
+            if (!hash_contents(&key, input->value)) {
+                hash_field(&key, NULL, 0);
+            }
+            break;
+        }
+    }
+
+    return key;
+}
+
+/* creates the directories on the way, returns 0 if it can't be used */
+static int memo_dir(char *dir, size_t size) {
+    const char *override = getenv("QSH_MEMO_DIR");
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (override && override[0]) {
+        snprintf(dir, size, "%s", override);
+    } else if (cache && cache[0]) {
+        snprintf(dir, size, "%s/qsh/memo", cache);
+    } else if (home && home[0]) {
+        snprintf(dir, size, "%s/.cache/qsh/memo", home);
+    } else {
+        return 0;
+    }
+
+    for (char *slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) {
+            *slash = '\0';
+        }
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+            return 0;
+        }
+        if (!slash) {
+            return 1;
+        }
+        *slash = '/';
+    }
+}
+
+/* `length` bytes of `in` from `offset` to `out`, without a copy through here where possible */
+static int copy_range(int in, int out, off_t offset, size_t length) {
+#ifdef __linux__
+    while (length > 0) {
+        ssize_t n = sendfile(out, in, &offset, length);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        } else if (n <= 0) {
+            return 0;
+        }
+        length -= n;
+    }
+#endif
+
+    char buffer[COPY_CHUNK];
+    while (length > 0) {
+        ssize_t n = pread(in, buffer, length < sizeof buffer ? length : sizeof buffer, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 0;
+        }
+
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out, buffer + written, n - written);
+            if (w == -1 && errno == EINTR) {
+                continue;
+            } else if (w <= 0) {
+                return 0;
+            }
+            written += w;
+        }
+
+        offset += n;
+        length -= n;
+    }
+
+    return 1;
+}
+
+/* write out an entry, returns its exit status or -1 if it isn't one */
+static int replay(int fd) {
+    char header[MEMO_HEADER_MAX];
+    ssize_t n = pread(fd, header, sizeof header - 1, 0);
+    int status, header_length;
+    size_t out_length, err_length;
+
+    if (n <= 0) {
+        return -1;
+    }
+    header[n] = '\0';
+
+    if (sscanf(header, MEMO_MAGIC " %d %zu %zu\n%n", &status, &out_length, &err_length, &header_length) != 3) {
+        return -1;
+    }
+
+    copy_range(fd, STDOUT_FILENO, header_length, out_length);
+    copy_range(fd, STDERR_FILENO, header_length + out_length, err_length);
+    return status;
+}
+
+static int temporary_file(const char *dir, const char *name, char *path, size_t size) {
+    if ((size_t) snprintf(path, size, "%s/.%s.XXXXXX", dir, name) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return mkostemp(path, O_CLOEXEC);
+}
+
+/*
+ run the command with its outputs in unlinked temporary files, then store
+ them with the status under `entry_path`
+*/
+static int run_and_store(char **argv, const char *dir, const char *entry_path) {
+    char out_path[PATH_MAX], err_path[PATH_MAX], tmp_path[PATH_MAX];
+    int out = temporary_file(dir, "out", out_path, sizeof out_path);
+    int err = temporary_file(dir, "err", err_path, sizeof err_path);
+    int status;
+
+    if (out == -1 || err == -1) {
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        return 127;
+    }
+    unlink(out_path);
+    unlink(err_path);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out, STDOUT_FILENO);
+        dup2(err, STDERR_FILENO);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    } else if (pid == -1) {
+        perror("fork");
+        return 126;
+    }
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+    off_t out_length = lseek(out, 0, SEEK_END);
+    off_t err_length = lseek(err, 0, SEEK_END);
+    int result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    /* a command killed by a signal didn't finish, so it isn't remembered */
+    int entry = WIFEXITED(status) ? temporary_file(dir, "entry", tmp_path, sizeof tmp_path) : -1;
+    if (entry != -1) {
+        char header[MEMO_HEADER_MAX];
+        int header_length = snprintf(header, sizeof header, MEMO_MAGIC " %d %zu %zu\n",
+                                     result, (size_t) out_length, (size_t) err_length);
+
+        if (write(entry, header, header_length) == header_length
+            && copy_range(out, entry, 0, out_length) && copy_range(err, entry, 0, err_length)) {
+            rename(tmp_path, entry_path);
+        } else {
+            unlink(tmp_path);
+        }
+        close(entry);
+    }
+
+    copy_range(out, STDOUT_FILENO, 0, out_length);
+    copy_range(err, STDERR_FILENO, 0, err_length);
+    close(out);
+    close(err);
+
+    return result;
+}
+
+/**
+ * In a forked child: replay the cached outputs and status of the command if
+ * there is an entry for its key, otherwise run it and store them.
+ *
+ * @param memo the inputs of the key
+ * @param argv the command
+ * @return the exit status for the child
+ */
+int run_memoized(MemoOptions *memo, char **argv) {
+    char dir[PATH_MAX], entry_path[PATH_MAX + 40];
+    struct stat st;
+
+    /* a stream's contents can't be known without reading it, so it is never cached */
+    if (fstat(STDIN_FILENO, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        return 127;
+    }
+
+    if (!memo_dir(dir, sizeof dir)) {
+        fprintf(stderr, "memo: no cache directory, running %s uncached\n", argv[0]);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        return 127;
+    }
+
+    MemoKey key = memo_key(memo, argv);
+    snprintf(entry_path, sizeof entry_path, "%s/%016llx%016llx", dir,
+             (unsigned long long) key.a, (unsigned long long) key.b);
+
+    int fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        int status = replay(fd);
+        close(fd);
+        if (status != -1) {
+            return status;
+        }
+    }
+
+    return run_and_store(argv, dir, entry_path);
+}
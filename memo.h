@@ -0,0 +1,11 @@
+#ifndef __QUASH_MEMO_H__
+#define __QUASH_MEMO_H__
+
+#include "quash.h"
+
+void init_memo_options(MemoOptions *memo);
+void free_memo_options(MemoOptions *memo);
+int parse_memo_prefix(int argc, char **argv, MemoOptions *memo);
+int run_memoized(MemoOptions *memo, char **argv);
+
+#endif /* __QUASH_MEMO_H__ */
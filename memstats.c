@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define block_size(ptr) malloc_size(ptr)
+#else
+#include <malloc.h>
+#define block_size(ptr) malloc_usable_size(ptr)
+#endif
+
+#include "quash.h"
+#include "memstats.h"
+
+/*
+ Allocation accounting for `qsh --mem-stats`. The tokenizer, parser, job
+ table, pid hash table, history and line editor allocate through these
+ wrappers with a tag naming the subsystem, and each tag keeps the bytes it
+ holds now, the most it ever held, and how many blocks it allocated and
+ still has. `qshstat -m` prints them, and so does the shell when it exits.
+
+ Blocks are plain malloc blocks measured with malloc_usable_size, so there
+ is no header to get wrong: one freed with plain `free` is only missing
+ from the counts, and with accounting off a wrapper is one branch and the
+ libc call. Accounting is turned on before anything is allocated, since a
+ block allocated before that would be subtracted without ever being added.
+*/
+
+typedef struct _TagCounters {
+    uint64_t current;           /* bytes held */
+    uint64_t peak;
+    uint64_t allocations;       /* blocks ever allocated, a realloc isn't a new one */
+    uint64_t live;              /* blocks held */
+} TagCounters;
+
+static const char *tag_names[MEM_TAGS] = {
+    [MEM_TOKENIZER] = "tokenizer",
+    [MEM_PARSER] = "parser",
+    [MEM_JOBS] = "jobs",
+    [MEM_HASH] = "hash",
+    [MEM_HISTORY] = "history",
+    [MEM_READLINE] = "readline",
+};
+
+int mem_stats_enabled = 0;
+
+/* relaxed atomics, the script loader tokenizes and parses on several threads */
+static TagCounters counters[MEM_TAGS];
+
+/* forked children inherit the counters but must not report them when they exit */
+static pid_t mem_stats_owner = 0;
+
+static void add_bytes(TagCounters *counter, uint64_t size) {
+    uint64_t current = __atomic_add_fetch(&counter->current, size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&counter->peak, __ATOMIC_RELAXED);
+
+    while (current > peak
+           && !__atomic_compare_exchange_n(&counter->peak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void count_block(MemTag tag, void *ptr) {
+    if (mem_stats_enabled && ptr) {
+        add_bytes(&counters[tag], block_size(ptr));
+        __atomic_add_fetch(&counters[tag].allocations, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters[tag].live, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void uncount_block(MemTag tag, void *ptr) {
+    if (mem_stats_enabled && ptr) {
+        __atomic_sub_fetch(&counters[tag].current, block_size(ptr), __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&counters[tag].live, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void report_at_exit() {
+    if (getpid() == mem_stats_owner) {
+        print_mem_stats(stderr);
+    }
+}
+
+/**
+ * Start accounting tagged allocations, and print them when the process
+ * exits. Call it before anything is allocated.
+ */
+void mem_stats_enable() {
+    if (mem_stats_enabled) {
+        return;
+    }
+
+    mem_stats_enabled = 1;
+    mem_stats_owner = getpid();
+    atexit(report_at_exit);
+}
+
+void* mem_malloc(MemTag tag, size_t size) {
+    void *ptr = malloc(size);
+    count_block(tag, ptr);
+    return ptr;
+}
+
+void* mem_calloc(MemTag tag, size_t count, size_t size) {
+    void *ptr = calloc(count, size);
+    count_block(tag, ptr);
+    return ptr;
+}
+
+void* mem_realloc(MemTag tag, void *ptr, size_t size) {
+    if (!mem_stats_enabled) {
+        return realloc(ptr, size);
+    }
+    if (!ptr) {
+        return mem_malloc(tag, size);
+    }
+
+    size_t old_size = block_size(ptr);
+    void *moved = realloc(ptr, size);
+    if (moved) {
+        __atomic_sub_fetch(&counters[tag].current, old_size, __ATOMIC_RELAXED);
+        add_bytes(&counters[tag], block_size(moved));
+    }
+
+    return moved;
+}
+
+char* mem_strdup(MemTag tag, const char *string) {
+    char *copy = strdup(string);
+    count_block(tag, copy);
+    return copy;
+}
+
+/**
+ * Count a block that was malloc'd by code outside the wrappers, like a line
+ * from readline, from now on as the tag's.
+ *
+ * @return `ptr`
+ */
+void* mem_adopt(MemTag tag, void *ptr) {
+    count_block(tag, ptr);
+    return ptr;
+}
+
+/**
+ * Count memory a library allocated for the tag where the wrappers can't
+ * see it, like readline's copy of a history line. It is never taken back.
+ */
+void mem_account(MemTag tag, size_t size) {
+    if (mem_stats_enabled) {
+        add_bytes(&counters[tag], size);
+        __atomic_add_fetch(&counters[tag].allocations, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters[tag].live, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void mem_free(MemTag tag, void *ptr) {
+    uncount_block(tag, ptr);
+    free(ptr);
+}
+
+/**
+ * Print the bytes each subsystem holds, its peak, and the blocks it
+ * allocated and still holds, one line per subsystem and a total.
+ */
+void print_mem_stats(FILE *out) {
+    TagCounters total = { 0, 0, 0, 0 };     /* no peak, the tags' peaks needn't have been at once */
+
+    fprintf(out, "%-10s %12s %12s %12s %10s\n", "subsystem", "current", "peak", "allocations", "live");
+    for (int tag = 0; tag < MEM_TAGS; tag++) {
+        TagCounters counter;
+        counter.current = __atomic_load_n(&counters[tag].current, __ATOMIC_RELAXED);
+        counter.peak = __atomic_load_n(&counters[tag].peak, __ATOMIC_RELAXED);
+        counter.allocations = __atomic_load_n(&counters[tag].allocations, __ATOMIC_RELAXED);
+        counter.live = __atomic_load_n(&counters[tag].live, __ATOMIC_RELAXED);
+
+        fprintf(out, "%-10s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %10" PRIu64 "\n", tag_names[tag],
+                counter.current, counter.peak, counter.allocations, counter.live);
+
+        total.current += counter.current;
+        total.allocations += counter.allocations;
+        total.live += counter.live;
+    }
+
+    fprintf(out, "%-10s %12" PRIu64 " %12s %12" PRIu64 " %10" PRIu64 "\n", "total",
+            total.current, "-", total.allocations, total.live);
+}
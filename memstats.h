@@ -0,0 +1,20 @@
+#ifndef __QUASH_MEMSTATS_H__
+#define __QUASH_MEMSTATS_H__
+
+#include <stdio.h>
+
+#include "quash.h"
+
+extern int mem_stats_enabled;
+
+void mem_stats_enable();
+void* mem_malloc(MemTag tag, size_t size);
+void* mem_calloc(MemTag tag, size_t count, size_t size);
+void* mem_realloc(MemTag tag, void *ptr, size_t size);
+char* mem_strdup(MemTag tag, const char *string);
+void* mem_adopt(MemTag tag, void *ptr);
+void mem_account(MemTag tag, size_t size);
+void mem_free(MemTag tag, void *ptr);
+void print_mem_stats(FILE *out);
+
+#endif /* __QUASH_MEMSTATS_H__ */
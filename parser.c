@@ -8,36 +8,40 @@
 #include "quash.h"
 #include "tokenizer.h"
 #include "arrays.h"
+#include "stats.h"
+#include "memstats.h"
 
-struct {
+/* kept on the stack of `parse_ast` so separate parses never share state */
+typedef struct _ParserState {
     TokenDynamicArray *tokens;
     size_t token_index;
+    AST *ast;
 } ParserState;
 
-static void advance() {
-    ParserState.token_index++;
+static void advance(ParserState *state) {
+    state->token_index++;
 }
 
-static Token peek(size_t offset) {
-    if (ParserState.token_index + offset < ParserState.tokens->length) {
-        return ParserState.tokens->tuples[ParserState.token_index + offset];
+static Token peek(ParserState *state, size_t offset) {
+    if (state->token_index + offset < state->tokens->length) {
+        return state->tokens->tuples[state->token_index + offset];
     }
 
     return (Token) { .text = NULL, .token = T_NONE, .flags = 0 };
 }
 
-static int consume(TokenEnum t) {
-    if (ParserState.token_index < ParserState.tokens->length
-        && ParserState.tokens->tuples[ParserState.token_index].token == t) {
-        advance();
+static int consume(ParserState *state, TokenEnum t) {
+    if (state->token_index < state->tokens->length
+        && state->tokens->tuples[state->token_index].token == t) {
+        advance(state);
         return 1;
     }
 
     return 0;
 }
 
-static Token current_token() {
-    return peek(0);
+static Token current_token(ParserState *state) {
+    return peek(state, 0);
 }
 
 static int number(Token token) {
@@ -63,113 +67,335 @@ BindingPower get_binding_power(Token t) {
         [T_AMP]                 = { 0, 0 },
         [T_AMP_AMP]             = { 1, 2 },
         [T_PIPE_PIPE]           = { 1, 2 },
+        [T_TIME]                = { 3, 3 }, /* prefix, binds a whole pipeline */
+        [T_SEMI]                = { 0, 0 },
     };
 
-    if (t.token >= T_WORD && t.token <= T_PIPE_PIPE) {
+    if (t.token >= T_WORD && t.token <= T_SEMI) {
         return binding_power[t.token];
     }
 
     return (BindingPower) { 0, 0 };
 }
 
-static ASTNode* ast_node(Token token, ASTNode *left, ASTNode *right) {
-    ASTNode *node = malloc(sizeof *node);
+static node_t ast_node(ParserState *state, TokenEnum token, node_t left, node_t right) {
+    AST *ast = state->ast;
+
+    if (ast->length == ast->slots) {
+        ast->slots = ast->slots ? ast->slots * 2 : 16;
+        ast->nodes = mem_realloc(MEM_PARSER, ast->nodes, ast->slots * sizeof *ast->nodes);
+        STAT_ADD(bytes_allocated, ast->slots * sizeof *ast->nodes);
+    }
+
+    STAT_INC(ast_nodes);
+    ASTNode *node = &ast->nodes[ast->length];
+    node->token = token;
     node->left = left;
     node->right = right;
-    node->token = token;
-    return node;
+    return ast->length++;
 }
 
-static ASTNode* expression(int min_bp) {
-    ASTNode *lhs = NULL;
+static void append_word(AST *ast, char *word, unsigned char flags) {
+    if (ast->words_length == ast->words_slots) {
+        ast->words_slots = ast->words_slots ? ast->words_slots * 2 : 16;
+        ast->words = mem_realloc(MEM_PARSER, ast->words, ast->words_slots * sizeof *ast->words);
+        STAT_ADD(bytes_allocated, ast->words_slots * sizeof *ast->words);
 
-    for (;;) {
-        Token token = current_token();
+        if (ast->word_flags) {
+            ast->word_flags = mem_realloc(MEM_PARSER, ast->word_flags, ast->words_slots);
+            memset(ast->word_flags + ast->words_length, 0, ast->words_slots - ast->words_length);
+        }
+    }
 
-        if (token.token == T_EOS) {
-            break;
+    /* most lines have no flagged word and never allocate flags */
+    if (flags && !ast->word_flags) {
+        ast->word_flags = mem_calloc(MEM_PARSER, ast->words_slots, 1);
+    }
+    if (ast->word_flags) {
+        ast->word_flags[ast->words_length] = flags;
+    }
+
+    ast->words[ast->words_length++] = word;
+}
+
+/*
+ one node for a run of words, which are copied out as a ready argv. the
+ words of `extend`, if it isn't NODE_NONE, come first: they are copied
+ again, an argv has to be contiguous. `limit` caps the words taken from
+ the tokens, 0 takes all of them
+*/
+static node_t command_node(ParserState *state, node_t extend, uint32_t limit) {
+    AST *ast = state->ast;
+    uint32_t first = ast->words_length;
+    uint32_t glob_first = 0, glob_end = 0;
+    uint32_t i = 0;
+
+    if (extend != NODE_NONE) {
+        uint32_t argv = ast->nodes[extend].argv, argc = ast->nodes[extend].argc;
+
+        if (ast->nodes[extend].glob_count > 0) {
+            glob_first = ast->nodes[extend].glob_first;
+            glob_end = glob_first + ast->nodes[extend].glob_count;
         }
 
-        if (consume(T_WORD)) {
-            lhs = ast_node(token, expression(7), NULL);
-            continue;
+        for (; i < argc; i++) {
+            append_word(ast, ast->words[argv + i], ast->word_flags ? ast->word_flags[argv + i] : 0);
         }
+    }
 
-        BindingPower bp = get_binding_power(token);
+    for (uint32_t taken = 0; current_token(state).token == T_WORD && (limit == 0 || taken < limit); i++, taken++) {
+        Token token = current_token(state);
 
-        if (bp.left < min_bp) {
-            break;
+        /* `batch` splits the span of words that came from globs */
+        if (token.flags & TF_GLOB_MATCH) {
+            if (glob_end == 0) {
+                glob_first = i;
+            }
+            glob_end = i + 1;
         }
 
-        advance();
-        ASTNode *rhs = expression(bp.right);
-        lhs = ast_node(token, lhs, rhs);
+        unsigned char flags = token.flags & TF_INPUT_SUBST ? WORD_INPUT_SUBST
+            : token.flags & TF_OUTPUT_SUBST ? WORD_OUTPUT_SUBST : 0;
+        if (token.flags & TF_DEFERRED) {
+            flags |= token.flags & TF_DOUBLE_QUOTE_STRING ? WORD_DEFERRED | WORD_QUOTED : WORD_DEFERRED;
+        }
+
+        append_word(ast, token.text, flags);
+        advance(state);
     }
 
-    return lhs;
-}
+    uint32_t argc = ast->words_length - first;
+    append_word(ast, NULL, 0);
 
-ASTNode* parse_ast(TokenDynamicArray *tokens) {
-    ParserState.tokens = tokens;
-    ParserState.token_index = 0;
-    return expression(0);
+    node_t command = ast_node(state, T_WORD, NODE_NONE, NODE_NONE);
+    ast->nodes[command].argv = first;
+    ast->nodes[command].argc = argc;
+    ast->nodes[command].glob_first = glob_first;
+    ast->nodes[command].glob_count = glob_end - glob_first;
+    return command;
 }
 
-static void _print_parse_tree(ASTNode *tree, int depth) {
-    if (!tree) {
-        // printf("()");
-        return;
+/*
+ words after a redirect's target, like `two` in `echo one > f two`, are
+ arguments of the command under the redirects. the command's node is
+ replaced by one with all of its words, anything else before the words
+ (a group, say) is a syntax error
+*/
+static node_t extend_command(ParserState *state, node_t lhs) {
+    AST *ast = state->ast;
+    node_t parent = NODE_NONE;
+    node_t node = lhs;
+
+    while (redirect(ast->nodes[node].token) && ast->nodes[node].left != NODE_NONE) {
+        parent = node;
+        node = ast->nodes[node].left;
     }
 
-    for (int i = 0; i < depth; i++) {
-        printf(" - ");
+    if (parent == NODE_NONE || ast->nodes[node].token != T_WORD) {
+        command_node(state, NODE_NONE, 0);
+        return ast_node(state, T_ERROR, NODE_NONE, NODE_NONE);
     }
 
-    printf("[%d : %s]\n", tree->token.token, tree->token.text);
-    _print_parse_tree(tree->left,   depth + 1);
-    _print_parse_tree(tree->right,  depth + 1);
+    node_t command = command_node(state, node, 0);
+    ast->nodes[parent].left = command;
+    return lhs;
 }
 
-void print_parse_tree(ASTNode *tree) {
-    _print_parse_tree(tree, 0);
+/*
+ the parser keeps its own stack of pending operators instead of recursing,
+ so a generated line with millions of words or operators parses in heap
+ memory rather than running out of C stack
+*/
+typedef enum _FrameKind {
+    FRAME_LINE,         /* the whole expression */
+    FRAME_INFIX,        /* right operand of `op`, the left is the parent's lhs */
+    FRAME_PREFIX,       /* operand of a prefix keyword like `time` */
+    FRAME_GROUP,        /* inside `( )` or `{ }`, `op` is the opening token */
+} FrameKind;
+
+typedef struct _ParseFrame {
+    FrameKind kind;
+    int min_bp;
+    TokenEnum op;
+    node_t lhs;
+} ParseFrame;
+
+typedef struct _FrameStack {
+    ParseFrame *frames;
+    size_t length;
+    size_t slots;
+} FrameStack;
+
+static void push_frame(FrameStack *stack, FrameKind kind, int min_bp, TokenEnum op) {
+    if (stack->length == stack->slots) {
+        stack->slots *= 2;
+        stack->frames = mem_realloc(MEM_PARSER, stack->frames, stack->slots * sizeof *stack->frames);
+    }
+
+    stack->frames[stack->length++] = (ParseFrame) { .kind = kind, .min_bp = min_bp, .op = op, .lhs = NODE_NONE };
 }
 
-void free_parse_tree(ASTNode *tree) {
-    if (tree->left) {
-        free_parse_tree(tree->left);
-    }
+static node_t expression(ParserState *state, int min_bp) {
+    FrameStack stack = { .frames = mem_malloc(MEM_PARSER, 16 * sizeof *stack.frames), .length = 0, .slots = 16 };
+    push_frame(&stack, FRAME_LINE, min_bp, T_NONE);
+
+    for (;;) {
+        ParseFrame *frame = &stack.frames[stack.length - 1];
+        Token token = current_token(state);
+
+        /* a redirect's operand is just its target, the words after it end the redirect */
+        int target = frame->kind == FRAME_INFIX && redirect(frame->op);
+
+        if (token.token == T_WORD && frame->lhs == NODE_NONE) {
+            frame->lhs = command_node(state, NODE_NONE, target ? 1 : 0);
+            continue;
+        } else if (token.token == T_WORD && !target) {
+            frame->lhs = extend_command(state, frame->lhs);
+            continue;
+        }
+
+        if (consume(state, T_TIME)) {
+            push_frame(&stack, FRAME_PREFIX, get_binding_power(token).right, token.token);
+            continue;
+        }
+
+        if (consume(state, T_LPAREN) || consume(state, T_LBRACE)) {
+            push_frame(&stack, FRAME_GROUP, 0, token.token);
+            continue;
+        }
+
+        BindingPower bp = get_binding_power(token);
+        int closes = token.token == T_RPAREN || token.token == T_RBRACE;
+
+        if (token.token != T_EOS && token.token != T_NONE && token.token != T_WORD && !closes && bp.left >= frame->min_bp) {
+            advance(state);
+            push_frame(&stack, FRAME_INFIX, bp.right, token.token);
+            continue;
+        }
+
+        /* the frame's expression is complete, hand it to the one waiting on it */
+        node_t result = frame->lhs;
+        FrameKind kind = frame->kind;
+        TokenEnum op = frame->op;
+
+        if (--stack.length == 0) {
+            mem_free(MEM_PARSER, stack.frames);
+            return result;
+        }
 
-    if (tree->right) {
-        free_parse_tree(tree->right);
+        ParseFrame *parent = &stack.frames[stack.length - 1];
+        switch (kind) {
+        case FRAME_INFIX:
+            parent->lhs = ast_node(state, op, parent->lhs, result);
+            break;
+        case FRAME_PREFIX:
+            parent->lhs = ast_node(state, op, NODE_NONE, result);
+            break;
+        case FRAME_GROUP:
+            if (consume(state, op == T_LPAREN ? T_RPAREN : T_RBRACE)) {
+                parent->lhs = ast_node(state, op, result, NODE_NONE);
+            } else {
+                parent->lhs = ast_node(state, T_ERROR, NODE_NONE, NODE_NONE);
+            }
+            break;
+        default:
+            break;
+        }
     }
+}
 
-    free(tree);
+/**
+ * Parse a tokenized line into `ast`, which refers to the tokens' text.
+ *
+ * @param ast filled in, free it with `free_parse_tree` before the tokens
+ * @param tokens the tokens of the line
+ */
+void parse_ast(AST *ast, TokenDynamicArray *tokens) {
+    memset(ast, 0, sizeof *ast);
+
+    ParserState state = { .tokens = tokens, .token_index = 0, .ast = ast };
+    ast->root = expression(&state, 0);
+
+    /* a `)` or `}` that closes nothing */
+    TokenEnum rest = current_token(&state).token;
+    if (rest != T_EOS && rest != T_NONE) {
+        ast->root = ast_node(&state, T_ERROR, NODE_NONE, NODE_NONE);
+    }
 }
 
-ASTNode* get_commands(ASTNode *ast) {
-    if (!(ast->token.token == T_WORD || redirect(ast->token))) {
-        return 0;
+void print_parse_tree(AST *ast) {
+    typedef struct { node_t node; int depth; } PrintFrame;
+    size_t slots = 16, length = 0;
+    PrintFrame *stack = mem_malloc(MEM_PARSER, slots * sizeof *stack);
+
+    if (ast->root != NODE_NONE) {
+        stack[length++] = (PrintFrame) { ast->root, 0 };
     }
 
-    int argc = 0;
-    char **argv;
-    ASTNode *commands = ast;
-    ASTNode *redirects = NULL;
+    while (length > 0) {
+        PrintFrame frame = stack[--length];
+        ASTNode *node = &ast->nodes[frame.node];
 
-    /* walk the tree until `commands` is pointing at words */
-    if (redirect(ast->token)) {
-        redirects = ast;
-        commands = redirects;
-        while (commands && redirect(commands->token)) {
-            /* check if a redirect has no argument while we walk the AST */
-            if (!commands->right) {
-                fprintf(stderr, "quash: syntax error\n");
-                return NULL;
+        for (int i = 0; i < frame.depth; i++) {
+            printf(" - ");
+        }
+
+        if (node->token == T_WORD) {
+            printf("[%d :", node->token);
+            for (uint32_t i = 0; i < node->argc; i++) {
+                printf(" %s", ast->words[node->argv + i]);
             }
+            printf("]\n");
+            continue;
+        }
+
+        printf("[%d]\n", node->token);
+
+        if (length + 2 > slots) {
+            slots *= 2;
+            stack = mem_realloc(MEM_PARSER, stack, slots * sizeof *stack);
+        }
 
-            commands = commands->left;
+        /* the left is printed first, so it goes on top */
+        if (node->right != NODE_NONE) {
+            stack[length++] = (PrintFrame) { node->right, frame.depth + 1 };
+        }
+        if (node->left != NODE_NONE) {
+            stack[length++] = (PrintFrame) { node->left, frame.depth + 1 };
         }
     }
 
-    return commands;
+    mem_free(MEM_PARSER, stack);
+}
+
+void free_parse_tree(AST *ast) {
+    mem_free(MEM_PARSER, ast->nodes);
+    mem_free(MEM_PARSER, ast->words);
+    mem_free(MEM_PARSER, ast->word_flags);
+    memset(ast, 0, sizeof *ast);
+    ast->root = NODE_NONE;
+}
+
+/**
+ * Find the command under a chain of redirects.
+ *
+ * @return the T_WORD node, or `NODE_NONE` after reporting a syntax error
+ */
+node_t get_commands(AST *ast, node_t node) {
+    while (node != NODE_NONE && redirect(ast->nodes[node].token)) {
+        /* check if a redirect has no file while we walk the AST */
+        node_t file = ast->nodes[node].right;
+        if (file == NODE_NONE || ast->nodes[file].token != T_WORD) {
+            break;
+        }
+
+        node = ast->nodes[node].left;
+    }
+
+    if (node == NODE_NONE || ast->nodes[node].token != T_WORD) {
+        fprintf(stderr, "quash: syntax error\n");
+        return NODE_NONE;
+    }
+
+    return node;
 }
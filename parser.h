@@ -4,9 +4,9 @@
 #include "arrays.h"
 #include "quash.h"
 
-ASTNode* parse_ast(TokenDynamicArray *tokens);
-void print_parse_tree(ASTNode *tree);
-void free_parse_tree(ASTNode *tree);
-ASTNode* get_commands(ASTNode *ast);
+void parse_ast(AST *ast, TokenDynamicArray *tokens);
+void print_parse_tree(AST *ast);
+void free_parse_tree(AST *ast);
+node_t get_commands(AST *ast, node_t node);
 
 #endif /* __QUASH_PARSER_H__ */
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "quash.h"
+#include "jobs.h"
+#include "fds.h"
+#include "prompt.h"
+
+/*
+ The prompt is `$QSH_PROMPT` with these segments filled in:
+
+   %d  the working directory, with $HOME as ~
+   %s  the exit status of the last foreground job
+   %j  the number of jobs
+   %b  the git branch, or nothing outside a repository
+   %%  a %
+
+ Finding the branch means walking up to a `.git` and reading its HEAD,
+ which can take a while on a slow or network filesystem, so it happens on
+ a background thread. The prompt is drawn at once with the branch last
+ seen in that directory, and the line editors redraw it if the thread
+ comes back with something else. The thread keeps a small cache keyed by
+ directory that also remembers the HEAD file and its mtime, so HEAD is only
+ read again after a checkout or commit changed it.
+*/
+
+#define PROMPT_MAX 1024
+#define BRANCH_MAX 128
+#define BRANCH_CACHE_SIZE 32
+#define DEFAULT_PROMPT "$ "
+
+typedef struct _BranchEntry {
+    char *cwd;                  /* NULL for an unused entry */
+    char *head;                 /* the HEAD file, NULL outside a repository */
+    struct timespec mtime;      /* of `head` when `branch` was read from it */
+    char branch[BRANCH_MAX];
+} BranchEntry;
+
+static pthread_mutex_t branch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t branch_requested = PTHREAD_COND_INITIALIZER;
+static BranchEntry cache[BRANCH_CACHE_SIZE];
+static size_t next_evicted = 0;
+static char *requested_cwd = NULL;      /* handed from the prompt to the thread */
+
+static int branch_thread_started = 0;
+static int update_fds[2] = { -1, -1 };  /* a byte here means the prompt is out of date */
+
+static QshContext *rendered_ctx = NULL;
+static char rendered[PROMPT_MAX];
+
+/* call with `branch_lock` held */
+static BranchEntry* find_entry(const char *cwd) {
+    for (size_t i = 0; i < BRANCH_CACHE_SIZE; i++) {
+        if (cache[i].cwd && strcmp(cache[i].cwd, cwd) == 0) {
+            return &cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int read_small_file(const char *path, char *buffer, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+
+    buffer[length] = '\0';
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 1;
+}
+
+/*
+ the HEAD of the repository `cwd` is in, through a `.git` file like the ones
+ in worktrees and submodules. malloc'd, or NULL outside a repository
+*/
+static char* find_head(const char *cwd) {
+    char dir[PATH_MAX];
+    char path[PATH_MAX + 16];
+    char gitdir[PATH_MAX];
+    struct stat st;
+
+    snprintf(dir, sizeof dir, "%s", cwd);
+
+    for (;;) {
+        snprintf(path, sizeof path, "%s/.git", strcmp(dir, "/") == 0 ? "" : dir);
+
+        if (stat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                strcat(path, "/HEAD");
+                return strdup(path);
+            }
+
+            if (read_small_file(path, gitdir, sizeof gitdir) && strncmp(gitdir, "gitdir: ", 8) == 0) {
+                if (gitdir[8] == '/') {
+                    snprintf(path, sizeof path, "%s/HEAD", gitdir + 8);
+                } else {
+                    snprintf(path, sizeof path, "%s/%s/HEAD", dir, gitdir + 8);
+                }
+                return strdup(path);
+            }
+        }
+
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || strcmp(dir, "/") == 0) {
+            return NULL;
+        }
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+}
+
+/* the branch HEAD points at, or the start of the commit it holds */
+static void read_branch(const char *head, char *branch) {
+    char text[256];
+
+    branch[0] = '\0';
+    if (!read_small_file(head, text, sizeof text)) {
+        return;
+    }
+
+    if (strncmp(text, "ref: refs/heads/", 16) == 0) {
+        snprintf(branch, BRANCH_MAX, "%s", text + 16);
+    } else if (strncmp(text, "ref: ", 5) == 0) {
+        snprintf(branch, BRANCH_MAX, "%s", text + 5);
+    } else {
+        snprintf(branch, BRANCH_MAX, "%.7s", text);
+    }
+}
+
+static void update_branch(const char *cwd) {
+    char branch[BRANCH_MAX] = "";
+    char *head = NULL;
+    struct stat st;
+    int fresh = 0;
+
+    pthread_mutex_lock(&branch_lock);
+    BranchEntry *entry = find_entry(cwd);
+    if (entry && entry->head) {
+        head = strdup(entry->head);
+    }
+    pthread_mutex_unlock(&branch_lock);
+
+    /* an unchanged HEAD needs no reading, anything else is looked up again */
+    if (head && stat(head, &st) == 0) {
+        pthread_mutex_lock(&branch_lock);
+        entry = find_entry(cwd);
+        fresh = entry && entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec;
+        pthread_mutex_unlock(&branch_lock);
+    }
+
+    if (fresh) {
+        free(head);
+        return;
+    }
+
+    free(head);
+    head = find_head(cwd);
+    memset(&st, 0, sizeof st);
+    if (head) {
+        stat(head, &st);
+        read_branch(head, branch);
+    }
+
+    pthread_mutex_lock(&branch_lock);
+    entry = find_entry(cwd);
+    if (entry == NULL) {
+        entry = &cache[next_evicted];
+        next_evicted = (next_evicted + 1) % BRANCH_CACHE_SIZE;
+        free(entry->cwd);
+        entry->cwd = strdup(cwd);
+        entry->branch[0] = '\0';
+        free(entry->head);
+        entry->head = NULL;
+    }
+
+    int changed = strcmp(entry->branch, branch) != 0;
+    free(entry->head);
+    entry->head = head;
+    entry->mtime = st.st_mtim;
+    memcpy(entry->branch, branch, BRANCH_MAX);
+    pthread_mutex_unlock(&branch_lock);
+
+    if (changed && write(update_fds[1], "", 1) == -1) {
+        /* a redraw is already pending */
+    }
+}
+
+static void* branch_worker(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&branch_lock);
+        while (requested_cwd == NULL) {
+            pthread_cond_wait(&branch_requested, &branch_lock);
+        }
+        char *cwd = requested_cwd;
+        requested_cwd = NULL;
+        pthread_mutex_unlock(&branch_lock);
+
+        update_branch(cwd);
+        free(cwd);
+    }
+
+    return NULL;
+}
+
+static int start_branch_thread() {
+    pthread_t thread;
+    sigset_t all, old;
+    int started;
+
+    if (cloexec_pipe(update_fds) == -1) {
+        return 0;
+    }
+    fcntl(update_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(update_fds[1], F_SETFL, O_NONBLOCK);
+
+    /* SIGINT and SIGCHLD have to reach the thread running the prompt */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    started = pthread_create(&thread, NULL, branch_worker, NULL) == 0;
+    if (started) {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return started;
+}
+
+/* the branch last seen in `cwd`, and with `request` ask the thread to check it again */
+static void cached_branch(const char *cwd, char *branch, int request) {
+    if (!branch_thread_started) {
+        branch_thread_started = start_branch_thread() ? 1 : -1;
+    }
+
+    branch[0] = '\0';
+    if (branch_thread_started < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&branch_lock);
+    BranchEntry *entry = find_entry(cwd);
+    if (entry) {
+        memcpy(branch, entry->branch, BRANCH_MAX);
+    }
+
+    if (request) {
+        free(requested_cwd);
+        requested_cwd = strdup(cwd);
+        pthread_cond_signal(&branch_requested);
+    }
+    pthread_mutex_unlock(&branch_lock);
+}
+
+static size_t append(char *out, size_t length, const char *text) {
+    size_t n = strlen(text);
+    if (length + n >= PROMPT_MAX) {
+        n = PROMPT_MAX - 1 - length;
+    }
+
+    memcpy(out + length, text, n);
+    return length + n;
+}
+
+static const char* render(QshContext *ctx, int request) {
+    const char *format = getenv("QSH_PROMPT");
+    char cwd[PATH_MAX];
+    char segment[PATH_MAX];
+    size_t length = 0;
+
+    if (format == NULL || format[0] == '\0') {
+        return DEFAULT_PROMPT;
+    }
+
+    if (getcwd(cwd, sizeof cwd) == NULL) {
+        strcpy(cwd, "?");
+    }
+
+    for (const char *c = format; *c && length < PROMPT_MAX - 1; c++) {
+        if (*c != '%' || c[1] == '\0') {
+            rendered[length++] = *c;
+            continue;
+        }
+
+        switch (*++c) {
+        case 'd': {
+            const char *home = getenv("HOME");
+            size_t home_len = home ? strlen(home) : 0;
+
+            if (home_len > 1 && strncmp(cwd, home, home_len) == 0
+                && (cwd[home_len] == '/' || cwd[home_len] == '\0')) {
+                snprintf(segment, sizeof segment, "~%s", cwd + home_len);
+            } else {
+                snprintf(segment, sizeof segment, "%s", cwd);
+            }
+            break;
+        }
+        case 's':
+            snprintf(segment, sizeof segment, "%d", ctx->last_status < 0 ? 0 : ctx->last_status);
+            break;
+        case 'j':
+            snprintf(segment, sizeof segment, "%zu", job_count(&ctx->jobs));
+            break;
+        case 'b':
+            cached_branch(cwd, segment, request);
+            break;
+        default:
+            segment[0] = *c;
+            segment[1] = '\0';
+            break;
+        }
+
+        length = append(rendered, length, segment);
+    }
+
+    rendered[length] = '\0';
+    return rendered;
+}
+
+/**
+ * Render the prompt for the next line without waiting on anything slow.
+ * When a background segment turns out different than drawn,
+ * `prompt_update_fd` becomes readable.
+ *
+ * @param ctx the shell the prompt describes
+ * @return the prompt, valid until the next render
+ */
+const char* prompt_render(QshContext *ctx) {
+    rendered_ctx = ctx;
+    return render(ctx, 1);
+}
+
+/**
+ * Render the prompt again once `prompt_update_fd` is readable.
+ *
+ * @return the prompt, valid until the next render
+ */
+const char* prompt_refresh() {
+    char buffer[64];
+    while (update_fds[0] != -1 && read(update_fds[0], buffer, sizeof buffer) > 0);
+
+    /* segments are only requested again for a new line */
+    return render(rendered_ctx, 0);
+}
+
+/**
+ * @return an fd that is readable when the prompt should be redrawn, or `-1`
+ */
+int prompt_update_fd() {
+    return update_fds[0];
+}
@@ -0,0 +1,10 @@
+#ifndef __QUASH_PROMPT_H__
+#define __QUASH_PROMPT_H__
+
+#include "quash.h"
+
+const char* prompt_render(QshContext *ctx);
+const char* prompt_refresh();
+int prompt_update_fd();
+
+#endif /* __QUASH_PROMPT_H__ */
@@ -0,0 +1,62 @@
+#ifndef __QSH_H__
+#define __QSH_H__
+
+#include <stddef.h>
+
+/*
+ libqsh, the shell's tokenizer, parser and evaluator as a library. Build
+ with `make lib` and link with libqsh.a.
+
+ Every context has its own jobs, history and exit status, so contexts can
+ be used from different threads at the same time, one thread per context.
+ The working directory and the environment belong to the process, so `cd`
+ and `export` are seen by every context of the process.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _QshContext QshContext;
+
+/* a buffer owned by the caller that a command's output is captured into */
+typedef struct _QshBuffer {
+    char *data;         /* `size` bytes, NUL terminated after a capture */
+    size_t size;
+    size_t length;      /* bytes captured, not counting the NUL */
+    int truncated;      /* set when the output did not fit */
+} QshBuffer;
+
+/* returned by `qsh_eval` once the context has run `exit` */
+#define QSH_EXITED 1
+
+QshContext* qsh_create();
+void qsh_destroy(QshContext *ctx);
+
+/**
+ * Evaluate a command line in the calling process, like a line typed at the
+ * prompt. Commands inherit the process's stdin, stdout and stderr.
+ *
+ * @param ctx a context from `qsh_create`
+ * @param line the command line, not modified
+ * @param status set to the exit status of the last foreground job, may be NULL
+ * @return `0` once evaluated, `-1` on a syntax error, `QSH_EXITED` after `exit`
+ */
+int qsh_eval(QshContext *ctx, const char *line, int *status);
+
+/**
+ * Evaluate a command line with its stdout and stderr captured into `out`
+ * and `err`. The line is evaluated in a forked child, so `cd`, `export` and
+ * jobs it starts don't change `ctx` or the calling process.
+ *
+ * @param out buffer for stdout, or NULL to leave stdout alone
+ * @param err buffer for stderr, or NULL to leave stderr alone
+ * @return as for `qsh_eval`
+ */
+int qsh_eval_capture(QshContext *ctx, const char *line, int *status, QshBuffer *out, QshBuffer *err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __QSH_H__ */
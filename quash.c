@@ -5,14 +5,15 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <errno.h>
-
-#include <readline/readline.h>
-#include <readline/history.h>
 #include <glob.h>
 
 #include "quash.h"
@@ -20,14 +21,24 @@
 #include "tokenizer.h"
 #include "parser.h"
 #include "jobs.h"
+#include "history.h"
+#include "trace.h"
+#include "stats.h"
+#include "eval.h"
+#include "fds.h"
+#include "schedule.h"
+#include "memo.h"
+#include "functions.h"
+#include "timeout.h"
+
+extern char **environ;
 
 /* --------------------------------------- */
 /*             signal handlers             */
 /* --------------------------------------- */
 
-/* jump buffer to return to if a running job is suspended */
-jmp_buf from_suspended;
-jmp_buf env;
+/* the context whose jump buffers and jobs the handlers use */
+static QshContext *signal_context;
 
 struct sigaction old_sigint;
 struct sigaction old_sigtstp;
@@ -38,16 +49,24 @@ void sigchld_handler() {
     pid_t child_pid;
     int status;
     int should_jump = 0;
+    struct rusage usage;
 
-    while ((child_pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
+    STAT_INC(sigchld_wakeups);
+    while ((child_pid = wait4(-1, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
         // int job_id = find_job_index(child_pid);
 
         if (status == SIGKILL || status == SIGTERM || WIFEXITED(status)) {
-            Job *job = get_job_from_pid(child_pid);
-            if (job) {
+            if (trace_enabled) {
+                trace_child_end(child_pid);
+            }
+
+            /* a background pipeline is complete once its last process is */
+            JobTable *jobs = &signal_context->jobs;
+            Job *job = finish_process(jobs, child_pid, &usage);
+            if (job && all_completed(jobs, job->id)) {
                 printf("Completed:\n");
-                print_job(job->id);
-                free_job(job->id);
+                print_job(jobs, job->id);
+                free_job(jobs, job->id);
             }
             should_jump = 1;
         } else if (WIFSTOPPED(status)) {
@@ -56,20 +75,50 @@ void sigchld_handler() {
     }
 
     if (should_jump) {
-        siglongjmp(env, 1);
+        siglongjmp(signal_context->prompt, 1);
+    }
+}
+
+/**
+ * Signal the jobs nothing waits for whose deadline passed. The context the
+ * signal handlers were installed for also sets an alarm for the next
+ * deadline, so a background job is signalled on time even while the shell
+ * sits at the prompt or runs something else.
+ */
+void check_job_timeouts(QshContext *ctx) {
+    struct timespec next, now;
+    struct itimerval alarm = { { 0, 0 }, { 0, 0 } };
+
+    if (!expire_job_timeouts(&ctx->jobs, &next) || ctx != signal_context) {
+        return;
     }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long usec = (next.tv_sec - now.tv_sec) * 1000000LL + (next.tv_nsec - now.tv_nsec) / 1000;
+
+    /* a zero it_value would disarm it */
+    usec = usec > 0 ? usec : 1;
+    alarm.it_value.tv_sec = usec / 1000000;
+    alarm.it_value.tv_usec = usec % 1000000;
+    setitimer(ITIMER_REAL, &alarm, NULL);
+}
+
+void sigalrm_handler() {
+    int saved_errno = errno;
+    check_job_timeouts(signal_context);
+    errno = saved_errno;
 }
 
 void sigtstp_ignorer() {
-    siglongjmp(env, 1);
+    siglongjmp(signal_context->prompt, 1);
 }
 
 void sigtstp_handler() {
-    siglongjmp(from_suspended, 1);
+    siglongjmp(signal_context->suspended, 1);
 }
 
 void sigint_ignorer() {
-    siglongjmp(env, 1);
+    siglongjmp(signal_context->prompt, 1);
 }
 
 void set_tstp_longjump_handler() {
@@ -88,14 +137,31 @@ void restore_signal_handlers() {
     sigaction(SIGCHLD, &old_sigchld, NULL);
 }
 
-void init_signal_handlers() {
+/**
+ * Install the interactive shell's handlers for SIGCHLD, SIGINT and SIGTSTP,
+ * which jump back into `ctx`, and for SIGALRM, which signals its jobs when
+ * their deadline passes. `restore_signal_handlers` leaves the last one, a
+ * script's background jobs have deadlines too.
+ */
+void init_signal_handlers(QshContext *ctx) {
     struct sigaction sa;
+    signal_context = ctx;
     memset(&sa, 0, sizeof sa);
+
+    /* neither may run inside the other, one frees jobs and the other signals them */
     sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGCHLD);
+    sigaddset(&sa.sa_mask, SIGALRM);
+
+    sa.sa_handler = sigalrm_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
+
     sa.sa_handler = sigchld_handler;
     sa.sa_flags = SA_NOCLDSTOP;
     sigaction(SIGCHLD, &sa, &old_sigchld);
 
+    sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sa.sa_handler = sigint_ignorer;
     sigaction(SIGINT, &sa, &old_sigint);
@@ -120,34 +186,75 @@ void init_signal_handlers() {
 /*        shell functions        */
 /* ----------------------------- */
 
-char* builtin_pwd() {
-    static char pwd_buf[PATH_MAX];
-    getcwd(pwd_buf, sizeof pwd_buf);
-    return pwd_buf;
+void init_context(QshContext *ctx, int flags) {
+    memset(ctx, 0, sizeof *ctx);
+    init_job_table(&ctx->jobs);
+    init_history_index(&ctx->history);
+    ctx->flags = flags;
 }
 
-void print_history() {
-    #ifdef __APPLE__ /* apple uses a different readline library */
-    for (int i = 0; i < history_length; i++) {
-        fprintf(stdout, "%-6d %s\n", i, history_get(i)->line);
+void free_context(QshContext *ctx) {
+    /* no alarm may go off for a job table that is being freed */
+    if (ctx == signal_context) {
+        struct itimerval disarm = { { 0, 0 }, { 0, 0 } };
+        setitimer(ITIMER_REAL, &disarm, NULL);
     }
-    #else
-    HIST_ENTRY **entry = history_list();
-    for (int i = 0; entry[i] && i < history_length; i++) {
-        fprintf(stdout, "%-6d %s\n", i, entry[i]->line);
+
+    cleanup_jobs(&ctx->jobs);
+    free_history_index(&ctx->history);
+    free_definitions(&ctx->functions);
+    free_definitions(&ctx->aliases);
+}
+
+char* builtin_pwd(char *buf, size_t size) {
+    if (!getcwd(buf, size)) {
+        buf[0] = '\0';
     }
-    #endif
+
+    return buf;
 }
 
-int wait_job(pid_t pid) {
-    int status;
-    /* returns if job finishes or is suspended */
-    if (waitpid(pid, &status, WUNTRACED) == -1) {
-        if (errno != EINTR)
-            perror("waitpid");
+void print_history(QshContext *ctx) {
+    for (size_t i = 0; i < ctx->history.length; i++) {
+        fprintf(stdout, "%-6zu %s\n", i, history_index_entry(&ctx->history, i));
     }
+}
 
-    return status;
+int builtin_history(QshContext *ctx, int argc, char **argv) {
+    if (argc == 1) {
+        print_history(ctx);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-s") != 0 || argc < 3) {
+        fprintf(stderr, "history: Usage history [-s pattern]\n");
+        return 1;
+    }
+
+    /* the pattern is the rest of the line, so `history -s git push` works */
+    size_t len = 0;
+    for (int i = 2; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+
+    char *pattern = malloc(len);
+    pattern[0] = '\0';
+    for (int i = 2; i < argc; i++) {
+        strcat(pattern, argv[i]);
+        if (i + 1 < argc) {
+            strcat(pattern, " ");
+        }
+    }
+
+    uint32_t results[HISTORY_SEARCH_MAX];
+    int count = history_index_search(&ctx->history, pattern, results, HISTORY_SEARCH_MAX);
+
+    for (int i = 0; i < count; i++) {
+        fprintf(stdout, "%-6u %s\n", results[i], history_index_entry(&ctx->history, results[i]));
+    }
+
+    free(pattern);
+    return count > 0 ? 0 : 1;
 }
 
 int builtin_export(int argc, char **argv) {
@@ -183,14 +290,62 @@ int builtin_export(int argc, char **argv) {
     return -1;
 }
 
-int builtin_bg(int argc, char **argv) {
+int builtin_set(QshContext *ctx, int argc, char **argv) {
+    if (argc == 1 || (argc == 2 && strcmp(argv[1], "-o") == 0)) {
+        fprintf(stdout, "trace\t%s\n", trace_enabled ? "on" : "off");
+        fprintf(stdout, "batch\t%s\n", ctx->flags & CTX_BATCH ? "on" : "off");
+        fprintf(stdout, "spread\t%s\n", ctx->flags & CTX_SPREAD ? "on" : "off");
+        return 0;
+    }
+
+    if (argc != 3 || (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)) {
+        fprintf(stderr, "set: Usage set [-o|+o] option\n");
+        return -1;
+    }
+
+    int enable = argv[1][0] == '-';
+
+    if (strcmp(argv[2], "batch") == 0) {
+        ctx->flags = enable ? ctx->flags | CTX_BATCH : ctx->flags & ~CTX_BATCH;
+        return 0;
+    }
+
+    if (strcmp(argv[2], "spread") == 0) {
+        ctx->flags = enable ? ctx->flags | CTX_SPREAD : ctx->flags & ~CTX_SPREAD;
+        return 0;
+    }
+
+    if (strcmp(argv[2], "trace") == 0) {
+        if (!enable) {
+            trace_close();
+            return 0;
+        } else if (trace_enabled) {
+            return 0;
+        }
+
+        /* $QSH_TRACE names the trace file, otherwise one per shell in the cwd */
+        char default_path[64];
+        const char *path = getenv("QSH_TRACE");
+        if (!path) {
+            snprintf(default_path, sizeof default_path, "qsh-trace-%d.json", getpid());
+            path = default_path;
+        }
+
+        return trace_open(path) ? 0 : -1;
+    }
+
+    fprintf(stderr, "set: Unknown option: %s\n", argv[2]);
+    return -1;
+}
+
+int builtin_bg(QshContext *ctx, int argc, char **argv) {
     if (argc != 2) {
         fprintf(stderr, "bg: Usage bg %%[job id]\n");
         return -1;
     }
 
     if (argv[1][0] == '%') { /* can only bg jobs from the jobs list */
-        int rc = run_background(atoi(argv[1] + 1));
+        int rc = run_background(&ctx->jobs, atoi(argv[1] + 1));
         if (rc == -1) {
             fprintf(stderr, "bg: Job not found: %d\n", atoi(argv[1] + 1));
         }
@@ -201,14 +356,14 @@ int builtin_bg(int argc, char **argv) {
     return -1;
 }
 
-int builtin_fg(int argc, char **argv) {
+int builtin_fg(QshContext *ctx, int argc, char **argv) {
     if (argc != 2) {
         fprintf(stderr, "fg: Usage fg %%[job id]\n");
         return -1;
     }
 
     if (argv[1][0] == '%') { /* can only fg jobs from the jobs list */
-        int rc = run_foreground(atoi(argv[1] + 1));
+        int rc = run_foreground(&ctx->jobs, atoi(argv[1] + 1));
         if (rc == -1) {
             fprintf(stderr, "fg: Job not found: %d\n", atoi(argv[1] + 1));
         }
@@ -219,31 +374,39 @@ int builtin_fg(int argc, char **argv) {
     return -1;
 }
 
-int builtin_kill(int argc, char **argv) {
+int builtin_kill(QshContext *ctx, int argc, char **argv) {
     if (argc != 3) {
         fprintf(stderr, "kill: Usage kill [status] %%[job id] or kill [status] [pid]\n");
         return -1;
     }
 
     if (argv[2][0] == '%') { /* signal a job in the jobs list */
-        return signal_job(atoi(argv[2] + 1), atoi(argv[1]));
+        return signal_job(&ctx->jobs, atoi(argv[2] + 1), atoi(argv[1]));
     } else { /* signal an arbitrary process */
         return kill(atoi(argv[2]), atoi(argv[1]));
     }
 }
 
-int execute_builtin(int argc, char **argv, int *status) {
+int execute_builtin(QshContext *ctx, int argc, char **argv, int *status) {
+    char cwd[PATH_MAX];
+
     switch (argv[0][0]) {
+    case 'a': // alias
+        if (strcmp(argv[0], "alias") == 0) {
+            *status = builtin_alias(ctx, argc, argv);
+            return 1;
+        }
+        break;
     case 'b': // bg
         if (strcmp(argv[0], "bg") == 0) {
-            *status = builtin_bg(argc, argv);
+            *status = builtin_bg(ctx, argc, argv);
             return 1;
         }
         break;
     case 'c': // cd, clear
         if (strcmp(argv[0], "cd") == 0 && argc == 2) {
             chdir(argv[1]);
-            setenv("PWD", builtin_pwd(), 1);
+            setenv("PWD", builtin_pwd(cwd, sizeof cwd), 1);
             *status = 0;
             return 1;
         } if (strcmp(argv[0], "clear") == 0) {
@@ -258,12 +421,21 @@ int execute_builtin(int argc, char **argv, int *status) {
             return 1;
         } if (strcmp(argv[0], "exit") == 0) {
             *status = 0;
-            exit(0);
+            if (ctx->flags & CTX_INTERACTIVE) {
+                exit(0);
+            }
+
+            /* an embedded shell stops evaluating instead of exiting its host */
+            ctx->exit_requested = 1;
+            return 1;
         }
         break;
-    case 'f': // fg
+    case 'f': // fg, function
         if (strcmp(argv[0], "fg") == 0) {
-            *status = builtin_fg(argc, argv);
+            *status = builtin_fg(ctx, argc, argv);
+            return 1;
+        } if (strcmp(argv[0], "function") == 0) {
+            *status = builtin_function(ctx, argc, argv);
             return 1;
         }
         break;
@@ -275,27 +447,52 @@ int execute_builtin(int argc, char **argv, int *status) {
             //     }
             // }
 
-            print_jobs();
+            if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+                print_jobs_long(&ctx->jobs);
+            } else {
+                print_jobs(&ctx->jobs);
+            }
             *status = 0;
             return 1;
         }
         break;
     case 'k': // kill
         if (strcmp(argv[0], "kill") == 0 && argc == 3) {
-            *status = builtin_kill(argc, argv);
+            *status = builtin_kill(ctx, argc, argv);
             return 1;
         }
         break;
     case 'p': // pwd
         if (strcmp(argv[0], "pwd") == 0) {
-            fprintf(stdout, "%s\n", builtin_pwd());
+            fprintf(stdout, "%s\n", builtin_pwd(cwd, sizeof cwd));
             *status = 0;
             return 1;
         }
         break;
     case 'q':
         if (strcmp(argv[0], "quit") == 0) {
-            exit(0);
+            *status = 0;
+            if (ctx->flags & CTX_INTERACTIVE) {
+                exit(0);
+            }
+
+            ctx->exit_requested = 1;
+            return 1;
+        }
+        break;
+    case 's': // set
+        if (strcmp(argv[0], "set") == 0) {
+            *status = builtin_set(ctx, argc, argv);
+            return 1;
+        }
+        break;
+    case 'u': // unalias, unfunction
+        if (strcmp(argv[0], "unalias") == 0) {
+            *status = builtin_unalias(ctx, argc, argv);
+            return 1;
+        } if (strcmp(argv[0], "unfunction") == 0) {
+            *status = builtin_unfunction(ctx, argc, argv);
+            return 1;
         }
         break;
     default:
@@ -305,7 +502,9 @@ int execute_builtin(int argc, char **argv, int *status) {
     return 0;
 }
 
-int execute_forkable_builtin(int argc, char **argv, int *status) {
+int execute_forkable_builtin(QshContext *ctx, int argc, char **argv, int *status) {
+    char cwd[PATH_MAX];
+
     switch (argv[0][0]) {
     case 'e': // export, echo, exit
         if (strcmp(argv[0], "echo") == 0 && argc > 1) {
@@ -319,18 +518,23 @@ int execute_forkable_builtin(int argc, char **argv, int *status) {
         break;
     case 'h': // history
         if (strcmp(argv[0], "history") == 0) {
-            print_history();
-            *status = 0;
+            *status = builtin_history(ctx, argc, argv);
             return 1;
         }
         break;
     case 'p': // pwd
         if (strcmp(argv[0], "pwd") == 0) {
-            fprintf(stdout, "%s\n", builtin_pwd());
+            fprintf(stdout, "%s\n", builtin_pwd(cwd, sizeof cwd));
             *status = 0;
             return 1;
         }
         break;
+    case 'q': // qshstat
+        if (strcmp(argv[0], "qshstat") == 0) {
+            *status = builtin_qshstat(argc, argv);
+            return 1;
+        }
+        break;
     default:
         break;
     }
@@ -338,401 +542,1470 @@ int execute_forkable_builtin(int argc, char **argv, int *status) {
     return 0;
 }
 
-void run_redirects(ASTNode *redirects) {
-    int fd;
-    while (redirects && redirects->right) {
-        switch (redirects->token.token) {
+/* whether `execute_forkable_builtin` will handle this command in the child */
+static int is_forkable_builtin(int argc, char **argv) {
+    return (strcmp(argv[0], "echo") == 0 && argc > 1)
+        || strcmp(argv[0], "history") == 0
+        || strcmp(argv[0], "pwd") == 0
+        || strcmp(argv[0], "qshstat") == 0;
+}
+
+/* open `file` onto `target`, and onto `also` unless it is -1 */
+static int redirect_file(const char *file, int flags, int target, int also) {
+    int fd = open(file, flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return 0;
+    }
+
+    dup2(fd, target);
+    if (also != -1) {
+        dup2(fd, also);
+    }
+
+    /* the copies are what the command uses, the original would be inherited */
+    if (fd != target && fd != also) {
+        close(fd);
+    }
+
+    return 1;
+}
+
+/**
+ * Open the files of a chain of redirects onto stdin, stdout and stderr, in
+ * a child for a command or in the shell itself for a group.
+ *
+ * @param redirects the outermost redirect, the chain ends at the node it redirects
+ * @return `1` once all are open, `0` after reporting one that couldn't be
+ */
+int run_redirects(QshContext *ctx, AST *ast, node_t redirects) {
+    while (redirects != NODE_NONE && redirect(ast->nodes[redirects].token)) {
+        ASTNode *node = &ast->nodes[redirects];
+        if (node->right == NODE_NONE || ast->nodes[node->right].token != T_WORD) {
+            fprintf(stderr, "quash: syntax error\n");
+            return 0;
+        }
+
+        uint32_t word = ast->nodes[node->right].argv;
+        char *file = expand_redirect_word(ctx, ast->words[word], ast->word_flags ? ast->word_flags[word] : 0);
+        int opened;
+
+        switch (node->token) {
         case T_GREATER:
-            if ((fd = open(redirects->right->token.text, O_WRONLY | O_CREAT, 644)) != -1) {
-                fchmod(fd, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-                dup2(fd, STDOUT_FILENO);
-            } else {
-                perror("open");
-            }
+            opened = redirect_file(file, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO, -1);
             break;
         case T_LESS:
-            if ((fd = open(redirects->right->token.text, O_RDONLY, 644)) != -1) {
-                fchmod(fd, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-                dup2(fd, STDIN_FILENO);
-            } else {
-                perror("open");
-            }
+            opened = redirect_file(file, O_RDONLY, STDIN_FILENO, -1);
             break;
         case T_GREATER_GREATER:
-            if ((fd = open(redirects->right->token.text, O_WRONLY | O_APPEND | O_CREAT, 644)) != -1) {
-                fchmod(fd, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-                dup2(fd, STDOUT_FILENO);
-            } else {
-                perror("open");
-            }
+            opened = redirect_file(file, O_WRONLY | O_APPEND | O_CREAT, STDOUT_FILENO, -1);
             break;
         case T_LESS_GREATER:
-            if ((fd = open(redirects->right->token.text, O_RDWR, 644)) != -1) {
-                fchmod(fd, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-                dup2(fd, STDIN_FILENO);
-                dup2(fd, STDOUT_FILENO);
-            } else {
-                perror("open");
-            }
+            opened = redirect_file(file, O_RDWR, STDIN_FILENO, STDOUT_FILENO);
             break;
         case T_GREATER_AMP:
-            if ((fd = open(redirects->right->token.text, O_WRONLY | O_CREAT, 644)) != -1) {
-                fchmod(fd, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-                dup2(fd, STDERR_FILENO);
-            } else {
-                perror("open");
-            }
+            opened = redirect_file(file, O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO, -1);
             break;
         case T_GREATER_GREATER_AMP:
-            if ((fd = open(redirects->right->token.text, O_WRONLY | O_APPEND | O_CREAT, 644)) != -1) {
-                fchmod(fd, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-                dup2(fd, STDERR_FILENO);
-            } else {
-                perror("open");
-            }
+            opened = redirect_file(file, O_WRONLY | O_APPEND | O_CREAT, STDERR_FILENO, -1);
             break;
-        case T_WORD:
-            return;
         default:
             fprintf(stderr, "quash: error processing redirection list\n");
-            return;
+            opened = 0;
+            break;
+        }
+
+        if (file != ast->words[word]) {
+            free(file);
+        }
+        if (!opened) {
+            return 0;
         }
 
-        redirects = redirects->left;
+        redirects = node->left;
     }
+
+    return 1;
 }
 
-int run_command(ASTNode *ast, int argc, char **argv, job_t job, int pipe_in, int pipe_out, int async) {
-    volatile pid_t pid;
-    int status;
+/* `batch`, or `set -o batch`: how a command's argv may be split */
+typedef struct _Batch {
+    int parallel;       /* `batch -p`, run the parts at the same time */
+    int split_first;    /* argv[split_first] on are the words from globs */
+    int split_count;
+} Batch;
 
-    if (execute_builtin(argc, argv, &status)) {
-        return status;
+/*
+ the stages of a pipeline now run at the same time, so a child must not hold
+ on to the ends of the pipes meant for its neighbours or a writer never sees
+ its reader go away. the ends it needs are dup2'd onto stdin and stdout,
+ which clears close-on-exec for them.
+*/
+static int make_pipe(int fds[2]) {
+    if (cloexec_pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
     }
 
-    set_tstp_longjump_handler();
+    return 0;
+}
 
-    if (sigsetjmp(from_suspended, 1)) {
-        /* child was suspended */
-        printf("%d suspended\n", pid);
-        fflush(stdout);
-        ignore_tstp();
-        return 0;
-    }
+/* the pipes of a command's `<(cmd)` and `>(cmd)` words */
+typedef struct _Substitutions {
+    int *fds;           /* the command's ends, kept open across its exec */
+    char **paths;       /* the `/dev/fd/N` words passed in their place */
+    size_t count;
+    char **argv;        /* a copy of the command's argv with the paths in it */
+} Substitutions;
+
+/* what the prefixes of a command asked for, NULL for each one it didn't use */
+typedef struct _CommandOptions {
+    Batch *batch;               /* how to split an argv too long to exec */
+    SchedOptions *sched;        /* where and how the child is scheduled */
+    MemoOptions *memo;          /* the inputs of its cached output */
+    Definition *function;       /* the function the command calls */
+    Substitutions *subst;       /* the pipes of process substitutions in argv */
+    int replace;                /* `exec`, or the last command of `-e`: run in the shell's process */
+} CommandOptions;
 
-    if ((pid = fork()) == -1) {
-        perror("fork");
-    } else if (pid == 0) {
-        restore_signal_handlers();
+/*
+ A forked child leaves with `_exit`: the atexit handlers and static
+ destructors it inherited are the shell's or an embedding host's and
+ must only run once, in that process.
+*/
+static void exit_child(int status) {
+    fflush(NULL);
+    _exit(status);
+}
 
-        if (pipe_in != -1) {
-            dup2(pipe_in, STDIN_FILENO);
-            close(pipe_in);
-        }
-        if (pipe_out != -1) {
-            dup2(pipe_out, STDOUT_FILENO);
-            close(pipe_out);
-        }
+/* `exec_command` may be running in the shell's own process, which does exit normally */
+static void exit_command(CommandOptions *options, int status) {
+    if (options->replace) {
+        exit(status);
+    }
 
-        run_redirects(ast);
+    exit_child(status);
+}
 
-        int builtin_status;
-        if (execute_forkable_builtin(argc, argv, &builtin_status)) {
-            if (builtin_status == -1) {
-                perror(argv[0]);
-            }
+static size_t exec_size(char *arg) {
+    return strlen(arg) + 1 + sizeof arg;
+}
 
-            exit(builtin_status);
-        } else if (execvp(argv[0], argv) == -1) {
-            perror(argv[0]);
-        }
+static pid_t spawn_batch(char **args) {
+    pid_t pid = fork();
 
-        exit(-1);
-    } else {
-        if (job == 0) {
-            job = create_job();
-        }
+    if (pid == 0) {
+        execvp(args[0], args);
+        perror(args[0]);
+        exit_child(127);
+    } else if (pid == -1) {
+        perror("fork");
+    }
 
-        register_process(ast, job, pid);
+    return pid;
+}
 
-        if (!async) {
-            status = wait_job(pid);
+/* the exit status of a batch, with a signal counted like the shell's `$?` */
+static int batch_status(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
 
-            if (WIFEXITED(status)) {
-                status = WEXITSTATUS(status);
-            } else if (WIFSIGNALED(status)) {
-                status = WTERMSIG(status);
-                printf("%d - %s\n", status, strsignal(status));
-            } else {
-                status = -1;
-            }
+/*
+ wait for one run of a batch, the status of which goes into `result`. only
+ its own pid is waited for, the shell's jobs may be children of this
+ process too when the command replaced the shell
+*/
+static void wait_batch(pid_t pid, int *result) {
+    int status;
 
-            free_job(job);
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return;
         }
     }
 
-    ignore_tstp();
-    return status;
+    *result = batch_status(status) > *result ? batch_status(status) : *result;
 }
 
-int eval_command(ASTNode *ast, job_t job, int pipe_in, int pipe_out, int async) {
-    if (!(ast->token.token == T_WORD || redirect(ast->token))) {
-        fprintf(stderr, "quash: syntax error\n");
-        return 0;
+/*
+ in the child of a `batch` command: when argv and the environment are too
+ big for ARG_MAX, run the command several times like xargs. each run gets
+ the words before and after the globbed span and as much of the span as
+ fits. with -p the runs are waited for in the order they started. returns
+ -1 if the command fits as it is, else the highest exit status of the runs
+*/
+static int run_batches(int argc, char **argv, Batch *batch) {
+    /* xargs leaves the same headroom for whatever the kernel adds */
+    size_t limit = sysconf(_SC_ARG_MAX) - 2048;
+    size_t fixed = 0, split = 0;
+
+    for (char **env = environ; *env; env++) {
+        fixed += exec_size(*env);
     }
 
-    int argc = 0;
-    char **argv;
-    ASTNode *commands = get_commands(ast);
+    for (int i = 0; i < argc; i++) {
+        if (i >= batch->split_first && i < batch->split_first + batch->split_count) {
+            split += exec_size(argv[i]);
+        } else {
+            fixed += exec_size(argv[i]);
+        }
+    }
 
-    /* nothing to evaluate */
-    if (commands == NULL) {
-        fprintf(stderr, "quash: syntax error\n");
-        return 0;
+    if (batch->split_count == 0 || fixed + split <= limit) {
+        return -1;
     }
 
-    ASTNode *node = commands;
-    while (node && node->token.token == T_WORD) {
-        argc++;
-        node = node->left;
+    if (fixed + exec_size(argv[batch->split_first]) > limit) {
+        fprintf(stderr, "batch: %s: %s\n", argv[0], strerror(E2BIG));
+        return 126;
     }
 
-    argv = malloc((argc + 1) * sizeof *argv);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_running = batch->parallel && cpus > 1 ? cpus : 1;
+    int running = 0;
+    int oldest = 0;
+    int result = 0;
+
+    /* the runs in flight, oldest first from `oldest` around */
+    pid_t *pids = malloc(max_running * sizeof *pids);
+    char **args = malloc((argc + 1) * sizeof *args);
+    int prefix = batch->split_first;
+    int suffix = argc - batch->split_first - batch->split_count;
+    memcpy(args, argv, prefix * sizeof *args);
+
+    for (int next = batch->split_first; next < batch->split_first + batch->split_count;) {
+        int count = 0;
+        size_t size = fixed;
+
+        while (next + count < batch->split_first + batch->split_count
+               && (count == 0 || size + exec_size(argv[next + count]) <= limit)) {
+            size += exec_size(argv[next + count]);
+            args[prefix + count] = argv[next + count];
+            count++;
+        }
+
+        memcpy(args + prefix + count, argv + argc - suffix, suffix * sizeof *args);
+        args[prefix + count + suffix] = NULL;
+        next += count;
 
-    node = commands;
-    for (int i = 0; i < argc; i++) {
-        /* should be a linked list of words at this point */
-        if (node->right) {
-            fprintf(stderr, "quash: syntax error\n");
-            free(argv);
-            return 0;
+        if (running == max_running) {
+            wait_batch(pids[oldest], &result);
+            oldest = (oldest + 1) % max_running;
+            running--;
         }
 
-        argv[i] = node->token.text;
-        node = node->left;
+        pid_t pid = spawn_batch(args);
+        if (pid == -1) {
+            result = result > 126 ? result : 126;
+            break;
+        }
+        pids[(oldest + running) % max_running] = pid;
+        running++;
     }
 
-    argv[argc] = NULL;
-
-    int status = run_command(ast, argc, argv, job, pipe_in, pipe_out, async);
+    for (; running > 0; running--) {
+        wait_batch(pids[oldest], &result);
+        oldest = (oldest + 1) % max_running;
+    }
 
-    free(argv);
-    return status == 0;
+    free(pids);
+    free(args);
+    return result;
 }
 
-int eval_pipeline(ASTNode *ast, int *pipe_out, job_t job, int async) {
-    int status;
-    if (ast->token.token != T_PIPE || !ast->left || !ast->right) {
-        fprintf(stderr, "quash: syntax error\n");
-        return 0;
-    }
+static int call_function(QshContext *ctx, Definition *function, int argc, char **argv);
 
-    if (ast->left->token.token == T_WORD) {
-        /* base case */
-        int fds[2];
-        pipe(fds);
-        eval_command(ast->left, job, -1, fds[1], async);
-        close(fds[1]);
-
-        if (pipe_out) {
-            int fds2[2];
-            pipe(fds2);
-
-            status = eval_command(ast->right, job, fds[0], fds2[1], async);
-            close(fds2[1]);
-            close(fds[0]);
-            *pipe_out = fds2[0];
-        } else {
-            status = eval_command(ast->right, job, fds[0], -1, async);
-            close(fds[0]);
-        }
+/*
+ the child's side of `run_command`, or the shell's own when the command
+ replaces it. never returns
+*/
+static void exec_command(QshContext *ctx, AST *ast, node_t node, int argc, char **argv, CommandOptions *options,
+                         int pipe_in, int pipe_out, double fork_start) {
+    Substitutions *subst = options->subst;
+    sigset_t sigchld_mask;
 
-        return status;
+    if (ctx->flags & CTX_INTERACTIVE) {
+        restore_signal_handlers();
     }
 
-    int pipe_in;
-    eval_pipeline(ast->left, &pipe_in, job, async);
+    /* blocked by `eval_job` while it starts the job, the command shouldn't inherit that */
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigaddset(&sigchld_mask, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &sigchld_mask, NULL);
 
-    if (pipe_out) {
-        int fds[2];
-        pipe(fds);
-        status = eval_command(ast->right, job, pipe_in, fds[1], async);
-        close(fds[1]);
-        close(pipe_in);
-        *pipe_out = fds[0];
-    } else {
-        status = eval_command(ast->right, job, pipe_in, -1, async);
-        close(pipe_in);
+    if (options->sched && !apply_sched_options(options->sched)) {
+        exit_command(options, 126);
     }
 
-    return status;
-}
-
-/**
- * Evaluate an abstract syntax tree. Returns `1` if evaluation is successful, else `0`.
- * 
- * @param ast a pointer to an abstract syntax tree returned from the parser
- * @param async a flag whether or not to run the command asynchronously
- * @return `1` on success, `0` on error.
- */
-int eval(ASTNode *ast, int async) {
-    if (ast == NULL) {
-        /* doing nothing is always a success! */
-        return 1;
+    if (pipe_in != -1) {
+        dup2(pipe_in, STDIN_FILENO);
+        close(pipe_in);
+    }
+    if (pipe_out != -1) {
+        dup2(pipe_out, STDOUT_FILENO);
+        close(pipe_out);
     }
 
-    if (ast->token.token == T_AMP) {
-        /* run async and don't set any exit status */
-        eval(ast->left, 1);
-        
-        /* might as well support having commands to the right of an `& */
-        return eval(ast->right, async);
+    if (!run_redirects(ctx, ast, node)) {
+        exit_command(options, 1);
     }
 
-    if (ast->token.token == T_AMP_AMP) {
-        if (eval(ast->left, async)) {
-            return eval(ast->right, async);
-        }
+    if (trace_enabled) {
+        trace_spawn(fork_start, argv[0]);
+    }
 
-        return 0;
+    /* a function in a pipeline or with redirects runs in this child like a subshell */
+    if (options->function) {
+        ctx->flags &= ~CTX_INTERACTIVE;
+        exit_command(options, call_function(ctx, options->function, argc, argv));
     }
 
-    if (ast->token.token == T_PIPE_PIPE) {
-        if (!eval(ast->left, async)) {
-            return eval(ast->right, async);
+    int builtin_status;
+    if (execute_forkable_builtin(ctx, argc, argv, &builtin_status)) {
+        if (builtin_status == -1) {
+            perror(argv[0]);
         }
 
-        return 1;
+        exit_command(options, builtin_status);
     }
 
-    if (ast->token.token == T_PIPE) {
-        /* create a job for the pipeline */
-        job_t job = create_job();
-        int status = eval_pipeline(ast, NULL, job, async);
+    /* only stdin, stdout, stderr and the substitutions' pipes are the command's */
+    for (size_t i = 0; subst && i < subst->count; i++) {
+        fcntl(subst->fds[i], F_SETFD, 0);
+    }
+    close_inherited_fds(subst ? subst->fds : NULL, subst ? subst->count : 0);
 
-        if (async) {
-            printf("Background job started:\n");
-            print_job(job);
-        }
-        return status;
+    /* a cache hit replays the output and never execs at all */
+    if (options->memo) {
+        exit_command(options, run_memoized(options->memo, argv));
     }
 
-    if (ast->token.token == T_WORD || redirect(ast->token)) {
-        /* create a job for a single command */
-        // job_t job = create_job();
-        
-        if (async) {
-            job_t job = create_job();
-            int status = eval_command(ast, job, -1, -1, 1);
-            printf("Background job started:\n");
-            print_job(job);
-            return status;
-        }
+    int batch_result;
+    if (options->batch && (batch_result = run_batches(argc, argv, options->batch)) != -1) {
+        exit_command(options, batch_result);
+    } else if (execvp(argv[0], argv) == -1) {
+        int error = errno;
+        perror(argv[0]);
 
-        return eval_command(ast, 0, -1, -1, async);
+        /* what sh exits with for a command it couldn't find, or couldn't run */
+        exit_command(options, error == ENOENT ? 127 : 126);
     }
 
-    return 0;
+    exit_command(options, -1);
 }
 
-/* ----------------------------- */
-/*         main function         */
-/* ----------------------------- */
+/**
+ * Run a builtin in the shell process, or fork a child for the command and
+ * register it in `job`. Forked children are not waited for. A command with
+ * `options->replace` takes over the shell's process instead of forking.
+ *
+ * @param options what the command's prefixes asked for
+ * @return the status of an in-process builtin, `0` once a child is forked
+ */
+int run_command(QshContext *ctx, AST *ast, node_t node, int argc, char **argv, CommandOptions *options,
+                job_t job, int pipe_in, int pipe_out) {
+    pid_t pid;
+    int status = 0;
+
+    /* a function named like a builtin takes its place */
+    TRACE_START(builtin_start);
+    if (!options->function && execute_builtin(ctx, argc, argv, &status)) {
+        STAT_INC(builtins);
+        TRACE_END(builtin_start, "builtin", argv[0]);
+        return status;
+    }
 
-void newline() {
-    puts("");
-}
+    /* the child would flush whatever a builtin left buffered a second time */
+    fflush(stdout);
 
-int eval_line(char *line) {
-    if (!line) {
-        return 0;
+    /* nothing is left to count or trace what a command that replaces the shell does */
+    TRACE_START(fork_start);
+    if (options->replace) {
+        /* an interval timer outlives exec, and SIGALRM would kill the command */
+        struct itimerval disarm = { { 0, 0 }, { 0, 0 } };
+        setitimer(ITIMER_REAL, &disarm, NULL);
+
+        trace_close();
+        exec_command(ctx, ast, node, argc, argv, options, pipe_in, pipe_out, fork_start);
     }
 
-    TokenDynamicArray tokens;
-    create_token_array(&tokens);
+    /* counted before the fork so `qshstat` sees its own */
+    int forkable = options->function || is_forkable_builtin(argc, argv);
+    STAT_INC(forks);
+    if (forkable) {
+        STAT_INC(forked_builtins);
+    } else {
+        STAT_INC(execs);
+    }
 
-    if (!tokenize(&tokens, line)) {
-        free(line);
-        free_token_array(&tokens);
+    if ((pid = fork()) == -1) {
+        perror("fork");
         return -1;
+    } else if (pid == 0) {
+        exec_command(ctx, ast, node, argc, argv, options, pipe_in, pipe_out, fork_start);
     }
 
-    ASTNode *ast = parse_ast(&tokens);
-    eval(ast, 0);
+    TRACE_END(fork_start, "fork", argv[0]);
+    if (trace_enabled) {
+        trace_child_begin(pid, fork_start, argv[0]);
+    }
 
-    free_parse_tree(ast);
-    free_token_array(&tokens);
+    register_process(&ctx->jobs, argc, argv, job, pid);
+    ctx->last_pid = pid;
+    return status;
+}
+
+/* the options of a `batch` prefix, returns how many words it took or -1 */
+static int parse_batch_prefix(int argc, char **argv, Batch *batch) {
+    /* options end at the first word from a glob, it could be a `-p` file */
+    int options_end = batch->split_count > 0 ? batch->split_first : argc;
+    int shift = 1;
+
+    for (; shift < options_end && argv[shift][0] == '-'; shift++) {
+        if (strcmp(argv[shift], "-p") == 0) {
+            batch->parallel = 1;
+        } else if (strcmp(argv[shift], "--") == 0) {
+            shift++;
+            break;
+        } else {
+            fprintf(stderr, "batch: Unknown option: %s\n", argv[shift]);
+            return -1;
+        }
+    }
+
+    if (shift == argc) {
+        fprintf(stderr, "batch: Usage batch [-p] command [args ...]\n");
+        return -1;
+    }
+
+    return shift;
+}
+
+static int eval_fanout(QshContext *ctx, AST *ast, node_t node, int argc, char **argv, job_t job, int pipe_in, int pipe_out);
+static int eval_subcommand(QshContext *ctx, char *line, job_t job, int pipe_in, int pipe_out);
+
+/*
+ `<(cmd)` and `>(cmd)` words: each cmd is started in the job with a pipe,
+ and the command gets `/dev/fd/N` for the other end in its place
+*/
+static int start_substitutions(QshContext *ctx, unsigned char *word_flags, int argc, char ***argv, job_t job,
+                               Substitutions *subst) {
+    size_t count = 0;
+
+    for (int i = 0; i < argc; i++) {
+        count += (word_flags[i] & (WORD_INPUT_SUBST | WORD_OUTPUT_SUBST)) != 0;
+    }
+    if (count == 0) {
+        return 1;
+    }
+
+    subst->fds = malloc(count * sizeof *subst->fds);
+    subst->paths = malloc(count * sizeof *subst->paths);
+    subst->argv = malloc((argc + 1) * sizeof *subst->argv);
+    memcpy(subst->argv, *argv, (argc + 1) * sizeof *subst->argv);
+
+    for (int i = 0; i < argc; i++) {
+        unsigned char flags = word_flags[i] & (WORD_INPUT_SUBST | WORD_OUTPUT_SUBST);
+        int fds[2];
+
+        if (flags == 0) {
+            continue;
+        }
+        if (make_pipe(fds) == -1) {
+            return 0;
+        }
+
+        /* `<(cmd)` writes the pipe the command reads, `>(cmd)` reads the one it writes */
+        int input = flags & WORD_INPUT_SUBST;
+        eval_subcommand(ctx, (*argv)[i], job, input ? -1 : fds[0], input ? fds[1] : -1);
+        close(input ? fds[1] : fds[0]);
+
+        char *path = malloc(32);
+        snprintf(path, 32, "/dev/fd/%d", input ? fds[0] : fds[1]);
+
+        subst->fds[subst->count] = input ? fds[0] : fds[1];
+        subst->paths[subst->count++] = path;
+        subst->argv[i] = path;
+    }
+
+    *argv = subst->argv;
+    return 1;
+}
+
+/* once the command is started, its ends of the pipes are only the child's */
+static void end_substitutions(Substitutions *subst) {
+    for (size_t i = 0; i < subst->count; i++) {
+        close(subst->fds[i]);
+        free(subst->paths[i]);
+    }
+
+    free(subst->fds);
+    free(subst->paths);
+    free(subst->argv);
+}
+
+int eval(QshContext *ctx, AST *ast, node_t node, int async);
+
+/* the node a chain of redirects applies to */
+static node_t under_redirects(AST *ast, node_t node) {
+    while (node != NODE_NONE && redirect(ast->nodes[node].token)) {
+        node = ast->nodes[node].left;
+    }
+
+    return node;
+}
 
+static int is_group(AST *ast, node_t node) {
+    return node != NODE_NONE && (ast->nodes[node].token == T_LPAREN || ast->nodes[node].token == T_LBRACE);
+}
+
+/*
+ run `body` in a forked child of `job`, for a group that is a stage of a
+ pipeline or in the background, or a subshell that changes the shell's
+ state. `redirects` is the chain around the group, or NODE_NONE
+*/
+static int eval_group_child(QshContext *ctx, AST *ast, node_t redirects, node_t body, TokenEnum kind, job_t job,
+                            int pipe_in, int pipe_out) {
+    char *name[] = { kind == T_LBRACE ? "{" : "(", "...", kind == T_LBRACE ? "}" : ")", NULL };
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (ctx->flags & CTX_INTERACTIVE) {
+            restore_signal_handlers();
+        }
+        /* `exit` in here ends the child, not the shell */
+        ctx->flags &= ~CTX_INTERACTIVE;
+
+        if (pipe_in != -1) {
+            dup2(pipe_in, STDIN_FILENO);
+            close(pipe_in);
+        }
+        if (pipe_out != -1) {
+            dup2(pipe_out, STDOUT_FILENO);
+            close(pipe_out);
+        }
+        if (!run_redirects(ctx, ast, redirects)) {
+            exit_child(1);
+        }
+
+        ctx->last_status = 0;
+        eval(ctx, ast, body, 0);
+        exit_child(ctx->last_status);
+    } else if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    STAT_INC(forks);
+    register_process(&ctx->jobs, 3, name, job, pid);
+    ctx->last_pid = pid;
     return 0;
 }
 
-int interactive_prompt() {
-    const char *prompt = "$ ";
-    char *line;
+/* whether `execvp` would find a program called `name` */
+static int find_program(const char *name) {
+    const char *path = getenv("PATH");
+    char candidate[PATH_MAX];
+
+    if (strchr(name, '/')) {
+        return access(name, X_OK) == 0;
+    }
+
+    for (const char *dir = path ? path : "/bin:/usr/bin"; ; dir++) {
+        size_t length = strcspn(dir, ":");
+        if ((size_t) snprintf(candidate, sizeof candidate, "%.*s%s%s", (int) length, dir,
+                              length ? "/" : "", name) < sizeof candidate
+            && access(candidate, X_OK) == 0) {
+            return 1;
+        }
+
+        dir += length;
+        if (*dir == '\0') {
+            return 0;
+        }
+    }
+}
+
+/*
+ `cpu` is where `set -o spread` put this stage of a pipeline, or -1. a
+ `sched -c` on the command itself overrides it. `foreground` is set for a
+ command that is a whole foreground job, the only kind `exec` or being the
+ last command of the input lets run in the shell's own process
+*/
+int eval_command(QshContext *ctx, AST *ast, node_t node, job_t job, int cpu, int foreground, int pipe_in, int pipe_out) {
+    node_t group = under_redirects(ast, node);
+    if (is_group(ast, group)) {
+        return eval_group_child(ctx, ast, node, ast->nodes[group].left, ast->nodes[group].token, job, pipe_in, pipe_out);
+    }
+
+    node_t command = get_commands(ast, node);
+
+    /* nothing to evaluate */
+    if (command == NODE_NONE) {
+        return -1;
+    }
+
+    /* the parser laid the words out as an argv already, unless an alias or a function's arguments go in */
+    CommandWords words;
+    expand_command_words(ctx, ast, command, &words);
+    int argc = words.argc;
+    char **argv = words.argv;
+    unsigned char *word_flags = words.flags;
+
+    /* a function body's `$1` when there isn't one */
+    if (argc == 0) {
+        free_command_words(&words);
+        return 0;
+    }
+
+    /* `exec` alone keeps its redirects on the shell, outside the foreground it does nothing */
+    if (strcmp(argv[0], "exec") == 0 && argc == 1) {
+        int status = !foreground || run_redirects(ctx, ast, node) ? 0 : 1;
+        free_command_words(&words);
+        return status;
+    }
+
+    if (strcmp(argv[0], "fanout") == 0) {
+        int status = eval_fanout(ctx, ast, node, argc, argv, job, pipe_in, pipe_out);
+        free_command_words(&words);
+        return status;
+    }
+
+    Batch batch = {
+        .parallel = 0,
+        .split_first = words.glob_first,
+        .split_count = words.glob_count,
+    };
+    int batching = ctx->flags & CTX_BATCH;
 
+    SchedOptions sched;
+    int scheduling = 0;
+    init_sched_options(&sched);
+
+    MemoOptions memo;
+    init_memo_options(&memo);
+
+    TimeoutOptions timeout;
+    init_timeout_options(&timeout);
+
+    /* a background job's deadline needs the shell around to enforce it, like the command's own */
+    int replace = foreground && ast == ctx->tail_ast && node == ctx->tail && !expire_job_timeouts(&ctx->jobs, NULL);
+    int exec_word = 0;
+
+    /* prefixes in any order, like `sched -n 10 batch -p cmd *` */
     for (;;) {
-        line = readline(prompt);
-
-        if (sigsetjmp(env, 1)) {
-            /* https://lists.gnu.org/archive/html/bug-readline/2016-04/msg00071.html */
-            rl_free_line_state();
-            rl_cleanup_after_signal();
-
-#ifdef __linux__
-            RL_UNSETSTATE(RL_STATE_ISEARCH|RL_STATE_NSEARCH|RL_STATE_VIMOTION|RL_STATE_NUMERICARG|RL_STATE_MULTIKEY);
-            rl_line_buffer[rl_point = rl_end = rl_mark = 0] = 0;
-#elif __apple__
-            rl_line_buffer[rl_point = rl_end = 0] = 0;
-#endif
-            rl_callback_handler_remove();
-            printf("\n");
-            continue;
+        int shift;
+
+        if (strcmp(argv[0], "batch") == 0) {
+            shift = parse_batch_prefix(argc, argv, &batch);
+            batching = 1;
+        } else if (strcmp(argv[0], "sched") == 0) {
+            shift = parse_sched_prefix(argc, argv, &sched);
+            scheduling = 1;
+        } else if (strcmp(argv[0], "memo") == 0) {
+            shift = parse_memo_prefix(argc, argv, &memo);
+        } else if (strcmp(argv[0], "timeout") == 0) {
+            shift = parse_timeout_prefix(argc, argv, &timeout);
+        } else if (strcmp(argv[0], "exec") == 0 && argc > 1) {
+            /* in a pipeline or the background the stage is forked anyway */
+            shift = 1;
+            exec_word = foreground;
+        } else {
+            break;
+        }
+
+        if (shift == -1) {
+            free_memo_options(&memo);
+            free_command_words(&words);
+            return -1;
+        }
+
+        argc -= shift;
+        argv += shift;
+        word_flags += word_flags ? shift : 0;
+        batch.split_first -= batch.split_count > 0 ? shift : 0;
+    }
+
+    if (cpu != -1 && !sched.has_cpus) {
+        sched.cpus[cpu / 64] |= (uint64_t) 1 << (cpu % 64);
+        sched.has_cpus = 1;
+        scheduling = 1;
+    }
+
+    Substitutions subst = { .fds = NULL, .paths = NULL, .count = 0, .argv = NULL };
+    int status = -1;
+
+    Definition *function = find_definition(&ctx->functions, argv[0]);
+
+    if (exec_word && !function && !is_forkable_builtin(argc, argv) && !find_program(argv[0])) {
+        /* the shell outlives an `exec` of nothing */
+        fprintf(stderr, "exec: %s: not found\n", argv[0]);
+        status = 127;
+    } else if (!word_flags || start_substitutions(ctx, word_flags, argc, &argv, job, &subst)) {
+        CommandOptions options = {
+            .batch = batching ? &batch : NULL,
+            .sched = scheduling ? &sched : NULL,
+            .memo = memo.enabled ? &memo : NULL,
+            .function = function,
+            .subst = subst.count ? &subst : NULL,
+            /* a deadline needs the shell around to enforce it */
+            .replace = (replace || exec_word) && timeout.duration == 0,
+        };
+        set_job_timeout(&ctx->jobs, job, &timeout);
+        status = run_command(ctx, ast, node, argc, argv, &options, job, pipe_in, pipe_out);
+    }
+
+    end_substitutions(&subst);
+    free_memo_options(&memo);
+    free_command_words(&words);
+    return status;
+}
+
+/*
+ start every stage of a pipeline in `job`. the stages run concurrently,
+ returns the status of the last stage if it was an in-process builtin, and
+ if `last_in_shell` isn't NULL sets it to whether it was one.
+ `a | b | c` parses as ((a | b) | c), so the stages are the right operands
+ down the left spine plus the command at the bottom of it. `pipe_in` and
+ `pipe_out` are for the ends of the pipeline, -1 for the shell's own
+*/
+int eval_pipeline(QshContext *ctx, AST *ast, node_t pipeline, job_t job, int pipe_in, int pipe_out, int *last_in_shell) {
+    size_t count = 1;
+    node_t node;
+
+    for (node = pipeline; node != NODE_NONE && ast->nodes[node].token == T_PIPE; node = ast->nodes[node].left) {
+        if (ast->nodes[node].left == NODE_NONE || ast->nodes[node].right == NODE_NONE) {
+            fprintf(stderr, "quash: syntax error\n");
+            return -1;
+        }
+
+        count++;
+    }
+
+    if (count == 1) {
+        fprintf(stderr, "quash: syntax error\n");
+        return -1;
+    }
+
+    node_t *stages = malloc(count * sizeof *stages);
+    size_t n = count;
+    for (node = pipeline; ast->nodes[node].token == T_PIPE; node = ast->nodes[node].left) {
+        stages[--n] = ast->nodes[node].right;
+    }
+    stages[0] = node;
+
+    int status = 0;
+    int stage_in = pipe_in;
+
+    for (size_t i = 0; i < count; i++) {
+        int fds[2] = { -1, -1 };
+
+        if (i + 1 < count) {
+            make_pipe(fds);
         }
 
-        if (line == NULL) {
-            newline();
+        int cpu = ctx->flags & CTX_SPREAD ? spread_cpu(i) : -1;
+        size_t processes = job_process_count(&ctx->jobs, job);
+        status = eval_command(ctx, ast, stages[i], job, cpu, 0, stage_in, i + 1 < count ? fds[1] : pipe_out);
+
+        if (last_in_shell && i + 1 == count) {
+            *last_in_shell = job_process_count(&ctx->jobs, job) == processes;
+        }
+
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        /* the caller's ends are the caller's to close */
+        if (stage_in != -1 && stage_in != pipe_in) {
+            close(stage_in);
+        }
+
+        stage_in = fds[0];
+    }
+
+    free(stages);
+    return status;
+}
+
+/*
+ a command line inside another one, the consumer of a fan-out or a process
+ substitution, run with its processes in `job`
+*/
+static int eval_subcommand(QshContext *ctx, char *line, job_t job, int pipe_in, int pipe_out) {
+    TokenDynamicArray tokens;
+    AST ast;
+    int status = -1;
+
+    create_token_array(&tokens);
+    if (!tokenize(&tokens, line)) {
+        fprintf(stderr, "quash: could not tokenize: %s\n", line);
+        free_token_array(&tokens);
+        return -1;
+    }
+
+    parse_ast(&ast, &tokens);
+
+    /* part of the enclosing job, so a list runs in a child like a subshell */
+    TokenEnum token = ast.root == NODE_NONE ? T_NONE : ast.nodes[ast.root].token;
+    if (token == T_PIPE) {
+        status = eval_pipeline(ctx, &ast, ast.root, job, pipe_in, pipe_out, NULL);
+    } else if (token == T_WORD || redirect(token) || is_group(&ast, ast.root)) {
+        status = eval_command(ctx, &ast, ast.root, job, -1, 0, pipe_in, pipe_out);
+    } else if (token == T_SEMI || token == T_AMP || token == T_AMP_AMP || token == T_PIPE_PIPE) {
+        status = eval_group_child(ctx, &ast, NODE_NONE, ast.root, T_LPAREN, job, pipe_in, pipe_out);
+    } else {
+        fprintf(stderr, "quash: not a command or pipeline: %s\n", line);
+    }
+
+    /* the children have their own copies of the words */
+    free_parse_tree(&ast);
+    free_token_array(&tokens);
+    return status;
+}
+
+/*
+ `producer | fanout 'consumer' 'consumer' ...` gives every consumer, a
+ command or pipeline in quotes, its own pipe and a copy of the stream
+ coming in, from the pipe or a `<` on the fanout stage. the consumers write
+ wherever the fanout stage would, and they and the child splitting the
+ stream are all processes of the one job
+*/
+static int eval_fanout(QshContext *ctx, AST *ast, node_t node, int argc, char **argv, job_t job, int pipe_in, int pipe_out) {
+    int consumers = argc - 1;
+
+    if (consumers < 1) {
+        fprintf(stderr, "fanout: Usage fanout 'command' ['command' ...]\n");
+        return -1;
+    }
+
+    int *outs = malloc(consumers * sizeof *outs);
+    int started = 0;
+
+    for (; started < consumers; started++) {
+        int fds[2];
+
+        if (make_pipe(fds) == -1) {
             break;
-        } else if (line[0] == '\0') {
+        }
+
+        eval_subcommand(ctx, argv[started + 1], job, fds[0], pipe_out);
+        close(fds[0]);
+        outs[started] = fds[1];
+    }
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (ctx->flags & CTX_INTERACTIVE) {
+            restore_signal_handlers();
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        /* the next stage has to see EOF once the consumers are done */
+        if (pipe_out != -1) {
+            close(pipe_out);
+        }
+        if (pipe_in != -1) {
+            dup2(pipe_in, STDIN_FILENO);
+            close(pipe_in);
+        }
+        if (!run_redirects(ctx, ast, node)) {
+            exit_child(1);
+        }
+
+        fan_out(STDIN_FILENO, outs, started);
+        exit_child(0);
+    } else if (pid == -1) {
+        perror("fork");
+    } else {
+        STAT_INC(forks);
+        register_process(&ctx->jobs, argc, argv, job, pid);
+        ctx->last_pid = pid;
+    }
+
+    for (int i = 0; i < started; i++) {
+        close(outs[i]);
+    }
+    free(outs);
+
+    return pid == -1 ? -1 : 0;
+}
+
+/**
+ * Start a single command or a pipeline as a new job. A foreground job is
+ * waited for until all of its processes exit or it is suspended.
+ *
+ * @return `1` if the job succeeded, else `0`
+ */
+int eval_job(QshContext *ctx, AST *ast, node_t node, int async) {
+    sigset_t alarm_mask;
+    sigset_t sigchld_mask;
+    sigset_t old_mask;
+    int status;
+    int interactive = ctx->flags & CTX_INTERACTIVE;
+
+    /* the alarm handler signals jobs from the table, it mustn't see a job half made or freed */
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm_mask, &old_mask);
+
+    job_t job = create_job(&ctx->jobs);
+    if (job == -1) {
+        fprintf(stderr, "quash: too many jobs\n");
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return 0;
+    }
+
+    if (async) {
+        status = ast->nodes[node].token == T_PIPE ? eval_pipeline(ctx, ast, node, job, -1, -1, NULL) : eval_command(ctx, ast, node, job, -1, 0, -1, -1);
+
+        if (job_process_count(&ctx->jobs, job) > 0) {
+            printf("Background job started:\n");
+            print_job(&ctx->jobs, job);
+        } else {
+            free_job(&ctx->jobs, job);
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        check_job_timeouts(ctx);
+        return status == 0;
+    }
+
+    /* only the interactive shell has a terminal to suspend jobs from */
+    if (interactive) {
+        set_tstp_longjump_handler();
+
+        if (sigsetjmp(ctx->suspended, 1)) {
+            /* job was suspended, it stays in the jobs list */
+            stop_waiting_for_job(&ctx->jobs, job);
+            pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+            printf("%d suspended\n", ctx->last_pid);
+            fflush(stdout);
+            ignore_tstp();
+            return 0;
+        }
+    }
+
+    /* keep the SIGCHLD handler from reaping the job's processes before we do */
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &sigchld_mask, NULL);
+
+    int last_in_shell = 0;
+    status = ast->nodes[node].token == T_PIPE ? eval_pipeline(ctx, ast, node, job, -1, -1, &last_in_shell) : eval_command(ctx, ast, node, job, -1, 1, -1, -1);
+
+    if (job_process_count(&ctx->jobs, job) > 0) {
+        int shell_status = status;
+
+        /* background deadlines still pass while this job is waited for */
+        TRACE_START(wait_start);
+        pthread_sigmask(SIG_UNBLOCK, &alarm_mask, NULL);
+        status = wait_job(&ctx->jobs, job, ctx->timing ? &ctx->timed_usage : NULL);
+        pthread_sigmask(SIG_BLOCK, &alarm_mask, NULL);
+        TRACE_END(wait_start, "wait", NULL);
+
+        if (WIFSTOPPED(status)) {
+            printf("%d suspended\n", ctx->last_pid);
+            fflush(stdout);
+            status = 0;
+        } else {
+            int timed_out = job_timeout_signal(&ctx->jobs, job);
+
+            if (timed_out) {
+                /* like timeout(1): 124, or 128 + 9 if it had to be killed */
+                status = timed_out == SIGKILL ? 128 + SIGKILL : 124;
+            } else if (last_in_shell) {
+                /* `false | pwd` is pwd's status, the stages before it only had to finish */
+                status = shell_status;
+            } else if (WIFEXITED(status)) {
+                status = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                status = WTERMSIG(status);
+                printf("%d - %s\n", status, strsignal(status));
+            } else {
+                status = -1;
+            }
+
+            free_job(&ctx->jobs, job);
+        }
+    } else {
+        free_job(&ctx->jobs, job);
+    }
+
+    ctx->last_status = status;
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (interactive) {
+        ignore_tstp();
+    }
+
+    return status == 0;
+}
+
+static void print_time(const char *label, long sec, long usec) {
+    fprintf(stderr, "%s\t%ldm%ld.%03lds\n", label, sec / 60, sec % 60, usec / 1000);
+}
+
+/*
+ `time pipeline`: wall clock time plus the resource usage of every process
+ in the pipeline, collected with wait4 as each one is reaped, and of the
+ shell itself for in-process builtins
+*/
+int eval_timed(QshContext *ctx, AST *ast, node_t node, int async) {
+    struct rusage self_start, self_end;
+    struct timespec start, end;
+
+    if (async || ctx->timing) {
+        /* background jobs and nested `time`s are run untimed */
+        return eval(ctx, ast, node, async);
+    }
+
+    struct rusage *timed_usage = &ctx->timed_usage;
+    memset(timed_usage, 0, sizeof *timed_usage);
+    ctx->timing = 1;
+    getrusage(RUSAGE_SELF, &self_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int result = eval(ctx, ast, node, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self_end);
+    ctx->timing = 0;
+
+    struct timeval user = timed_usage->ru_utime;
+    struct timeval sys = timed_usage->ru_stime;
+    struct timeval self;
+    timersub(&self_end.ru_utime, &self_start.ru_utime, &self);
+    timeradd(&user, &self, &user);
+    timersub(&self_end.ru_stime, &self_start.ru_stime, &self);
+    timeradd(&sys, &self, &sys);
+
+    long real_nsec = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+
+#ifdef __APPLE__ /* ru_maxrss is in bytes on macOS, KiB on linux */
+    long maxrss = timed_usage->ru_maxrss / 1024;
+#else
+    long maxrss = timed_usage->ru_maxrss;
+#endif
+
+    fprintf(stderr, "\n");
+    print_time("real", real_nsec / 1000000000L, (real_nsec % 1000000000L) / 1000);
+    print_time("user", user.tv_sec, user.tv_usec);
+    print_time("sys", sys.tv_sec, sys.tv_usec);
+    fprintf(stderr, "maxrss\t%ld KiB\n", maxrss);
+    fprintf(stderr, "faults\t%ld minor, %ld major\n",
+        timed_usage->ru_minflt + self_end.ru_minflt - self_start.ru_minflt,
+        timed_usage->ru_majflt + self_end.ru_majflt - self_start.ru_majflt);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n",
+        timed_usage->ru_nvcsw + self_end.ru_nvcsw - self_start.ru_nvcsw,
+        timed_usage->ru_nivcsw + self_end.ru_nivcsw - self_start.ru_nivcsw);
+
+    return result;
+}
+
+/*
+ run a function's body with `argv` as its positional parameters, in this
+ process. returns the status of the last job it ran
+*/
+static int call_function(QshContext *ctx, Definition *function, int argc, char **argv) {
+    if (ctx->call_depth == CALL_DEPTH_MAX) {
+        fprintf(stderr, "%s: function calls nested too deep\n", argv[0]);
+        return 1;
+    }
+
+    char **params = ctx->params;
+    int param_count = ctx->param_count;
+
+    /* the body may redefine the function it is running */
+    retain_definition(function);
+    ctx->params = argv;
+    ctx->param_count = argc;
+    ctx->call_depth++;
+    ctx->last_status = 0;
+    STAT_INC(function_calls);
+
+    eval(ctx, &function->ast, function->ast.root, 0);
+
+    ctx->call_depth--;
+    ctx->params = params;
+    ctx->param_count = param_count;
+    release_definition(function);
+
+    return ctx->last_status;
+}
+
+/*
+ a plain command calling a function in the foreground runs it right here,
+ with no job, so it can `cd` and `export` for the shell. returns 0 if the
+ command doesn't call one
+*/
+static int eval_function_call(QshContext *ctx, AST *ast, node_t node, int *status) {
+    if (ctx->functions.count == 0) {
+        return 0;
+    }
+
+    CommandWords words;
+    expand_command_words(ctx, ast, node, &words);
+
+    Definition *function = words.argc > 0 ? find_definition(&ctx->functions, words.argv[0]) : NULL;
+    if (function) {
+        *status = call_function(ctx, function, words.argc, words.argv);
+        ctx->last_status = *status;
+    }
+
+    free_command_words(&words);
+    return function != NULL;
+}
+
+/* builtins that change the shell itself, which a subshell must not do to its parent */
+static const char *shell_mutators[] = {
+    "alias", "cd", "exec", "exit", "export", "function", "quit", "set", "unalias", "unfunction",
+};
+
+static int mutates_word(QshContext *ctx, const char *word) {
+    for (size_t i = 0; i < sizeof shell_mutators / sizeof *shell_mutators; i++) {
+        if (strcmp(word, shell_mutators[i]) == 0) {
+            return 1;
+        }
+    }
+
+    /* an assignment like `X=1`, or a function that could do any of it */
+    const char *equals = strchr(word, '=');
+    return (equals && equals != word && !memchr(word, '/', equals - word))
+        || find_definition(&ctx->functions, word) != NULL;
+}
+
+/*
+ whether a subshell's body runs something that changes the shell's state,
+ in which case it has to be forked. words only known once the body runs,
+ and aliases for any of it, count
+*/
+static int mutates_shell(QshContext *ctx, AST *ast, node_t body) {
+    size_t slots = 16, length = 0;
+    node_t *stack = malloc(slots * sizeof *stack);
+    int mutates = 0;
+
+    if (body != NODE_NONE) {
+        stack[length++] = body;
+    }
+
+    while (length > 0 && !mutates) {
+        ASTNode *node = &ast->nodes[stack[--length]];
+
+        if (node->token == T_WORD) {
+            uint32_t first = node->argv;
+            char *word = ast->words[first];
+            Definition *alias = find_definition(&ctx->aliases, word);
+
+            if (alias) {
+                word = alias->ast.words[alias->ast.nodes[alias->ast.root].argv];
+            }
+            mutates = (ast->word_flags && (ast->word_flags[first] & WORD_DEFERRED)) || mutates_word(ctx, word);
             continue;
         }
 
-        add_history(line);
-        eval_line(line);
-        free(line);
+        if (length + 2 > slots) {
+            slots *= 2;
+            stack = realloc(stack, slots * sizeof *stack);
+        }
+
+        /* a redirect's right is its file */
+        if (node->left != NODE_NONE) {
+            stack[length++] = node->left;
+        }
+        if (node->right != NODE_NONE && !redirect(node->token)) {
+            stack[length++] = node->right;
+        }
+    }
+
+    free(stack);
+    return mutates;
+}
+
+/* put back the fds a group's redirects replaced */
+static void restore_shell_fds(QshContext *ctx, int saved[3]) {
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved[fd] == -1) {
+            close(fd);
+        } else {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+
+    ctx->redirect_depth--;
+}
+
+/*
+ a `{ }` group, or a `( )` subshell that leaves the shell's state alone,
+ runs in the shell itself. redirects around it are opened once, onto the
+ shell's own stdin, stdout and stderr for as long as the body runs, and
+ every command in it inherits them
+*/
+static int eval_group(QshContext *ctx, AST *ast, node_t node, node_t group) {
+    int saved[3];
+    int redirected = node != group;
+
+    if (redirected) {
+        fflush(stdout);
+        fflush(stderr);
+
+        for (int fd = 0; fd < 3; fd++) {
+            saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        }
+        if (ctx->redirect_depth++ == 0) {
+            memcpy(ctx->shell_fds, saved, sizeof saved);
+        }
+
+        if (!run_redirects(ctx, ast, node)) {
+            restore_shell_fds(ctx, saved);
+            ctx->last_status = 1;
+            return 0;
+        }
+    }
+
+    int result = eval(ctx, ast, ast->nodes[group].left, 0);
+
+    if (redirected) {
+        restore_shell_fds(ctx, saved);
+    }
+
+    return result;
+}
+
+/* a job, or a `time` around one, at the bottom of a list of `&&`, `||`, `;` and `&` */
+static int eval_list_item(QshContext *ctx, AST *ast, node_t node, int async) {
+    if (node == NODE_NONE) {
+        /* doing nothing is always a success! */
+        return 1;
+    }
+
+    if (ctx->exit_requested) {
+        return 0;
+    }
+
+    TokenEnum token = ast->nodes[node].token;
+
+    if (token == T_TIME) {
+        /* a `time` inside another, or in the background, is not timed */
+        while (node != NODE_NONE && ast->nodes[node].token == T_TIME && (async || ctx->timing)) {
+            node = ast->nodes[node].right;
+        }
+
+        if (node != NODE_NONE && ast->nodes[node].token == T_TIME) {
+            return eval_timed(ctx, ast, ast->nodes[node].right, async);
+        }
+
+        return eval(ctx, ast, node, async);
+    }
+
+    if (token == T_ERROR) {
+        fprintf(stderr, "quash: syntax error\n");
+        return 0;
+    }
+
+    node_t group = under_redirects(ast, node);
+    if (!async && is_group(ast, group)
+        && (ast->nodes[group].token == T_LBRACE || !mutates_shell(ctx, ast, ast->nodes[group].left))) {
+        return eval_group(ctx, ast, node, group);
+    }
+
+    int status;
+    if (token == T_WORD && !async && eval_function_call(ctx, ast, node, &status)) {
+        return status == 0;
+    }
+
+    if (token == T_PIPE || token == T_WORD || redirect(token) || is_group(ast, node)) {
+        return eval_job(ctx, ast, node, async);
     }
 
     return 0;
 }
 
-void print_help() {
-    printf("");
+static int list_operator(AST *ast, node_t node) {
+    return node != NODE_NONE && (ast->nodes[node].token == T_AMP
+        || ast->nodes[node].token == T_AMP_AMP
+        || ast->nodes[node].token == T_PIPE_PIPE
+        || ast->nodes[node].token == T_SEMI);
 }
 
-int main(int argc, char *argv[]) {
-    init_job_stack();
-    init_signal_handlers();
+/* an operator whose left side is being evaluated */
+typedef struct _EvalFrame {
+    node_t node;
+    int async;
+} EvalFrame;
 
-    int opt;
-    int ret;
-    char *eval = NULL;
-    while ((opt = getopt(argc, argv, "he:")) != -1) {
-        switch (opt) {
-        case 'h':
-            print_help();
-            exit(0);
-        case 'e':
-            ret = eval_line(optarg);
-            cleanup_jobs();
-            exit(ret);
-        default:
-            fprintf(stderr, "Usage: %s [-e eval] [-h]\n", argv[0]);
-            exit(EXIT_FAILURE);
+/**
+ * Evaluate an abstract syntax tree. Returns `1` if evaluation is successful, else `0`.
+ * 
+ * @param ctx the context to evaluate in
+ * @param ast a syntax tree filled in by the parser
+ * @param node the node of `ast` to evaluate
+ * @param async a flag whether or not to run the command asynchronously
+ * @return `1` on success, `0` on error.
+ */
+int eval(QshContext *ctx, AST *ast, node_t node, int async) {
+    /*
+     `&&` and `||` chains lean left and `&` chains lean right, so rather than
+     recursing per operator the operators down the left are kept on a stack
+     and a right side is evaluated in place of the operator it belongs to
+    */
+    size_t slots = 16, length = 0;
+    EvalFrame *stack = NULL;
+    int result;
+
+    for (;;) {
+        while (list_operator(ast, node) && !ctx->exit_requested) {
+            if (!stack) {
+                stack = malloc(slots * sizeof *stack);
+            } else if (length == slots) {
+                slots *= 2;
+                stack = realloc(stack, slots * sizeof *stack);
+            }
+
+            stack[length++] = (EvalFrame) { node, async };
+
+            /* the left of an `&` runs async and doesn't set any exit status */
+            async = ast->nodes[node].token == T_AMP ? 1 : async;
+            node = ast->nodes[node].left;
+        }
+
+        result = list_operator(ast, node) ? 0 : eval_list_item(ctx, ast, node, async);
+
+        /* unwind to the first operator that still has its right side to run */
+        int run_right = 0;
+        while (length > 0 && !run_right) {
+            EvalFrame frame = stack[--length];
+
+            switch (ast->nodes[frame.node].token) {
+            case T_AMP:
+                /* might as well support having commands to the right of an `& */
+                run_right = 1;
+                break;
+            case T_SEMI:
+                run_right = 1;
+                break;
+            case T_AMP_AMP:
+                run_right = result;
+                break;
+            case T_PIPE_PIPE:
+                run_right = !result;
+                break;
+            default:
+                break;
+            }
+
+            node = ast->nodes[frame.node].right;
+            async = frame.async;
+        }
+
+        if (!run_right) {
+            free(stack);
+            return result;
+        }
+    }
+}
+
+/*
+ the command nothing can run after: the right of the last `;`, `&&`, `||`
+ or `&`, also inside a group. NODE_NONE if that is a pipeline, a `time` or
+ in the background
+*/
+static node_t tail_command(AST *ast, node_t node) {
+    for (;;) {
+        if (node == NODE_NONE) {
+            return NODE_NONE;
+        }
+
+        ASTNode *n = &ast->nodes[node];
+        node_t group = under_redirects(ast, node);
+
+        if (n->token == T_SEMI && n->right == NODE_NONE) {
+            node = n->left;
+        } else if (list_operator(ast, node)) {
+            node = n->right;
+        } else if (is_group(ast, group)) {
+            node = ast->nodes[group].left;
+        } else if (n->token == T_WORD || redirect(n->token)) {
+            return node;
+        } else {
+            return NODE_NONE;
         }
     }
+}
 
-    interactive_prompt();
+/**
+ * Forget the state of an evaluation a signal jumped out of: a `time`, the
+ * function calls and the redirects of groups it was in the middle of.
+ */
+void reset_evaluation(QshContext *ctx) {
+    ctx->timing = 0;
+    ctx->params = NULL;
+    ctx->param_count = 0;
+    ctx->call_depth = 0;
+
+    if (ctx->redirect_depth > 0) {
+        ctx->redirect_depth = 1;
+        restore_shell_fds(ctx, ctx->shell_fds);
+    }
+}
+
+/**
+ * Evaluate the syntax tree of a line that was tokenized and parsed ahead of
+ * time, the second half of `eval_line`.
+ *
+ * @param ctx the context to evaluate in
+ * @param ast the parsed line, its root is NODE_NONE for an empty one
+ * @param line the text of the line, for tracing
+ */
+void eval_parsed(QshContext *ctx, AST *ast, const char *line) {
+    STAT_INC(lines);
+    reset_evaluation(ctx);
+
+    ctx->tail_ast = ast;
+    ctx->tail = ctx->flags & CTX_TAIL_EXEC ? tail_command(ast, ast->root) : NODE_NONE;
+
+    TRACE_START(eval_start);
+    eval(ctx, ast, ast->root, 0);
+    TRACE_END(eval_start, "eval", line);
+}
+
+/**
+ * Tokenize, parse and evaluate one command line.
+ *
+ * @param ctx the context to evaluate in
+ * @param line the line, left untouched
+ * @return `0` once evaluated, `-1` if the line could not be tokenized
+ */
+int eval_line(QshContext *ctx, char *line) {
+    if (!line) {
+        return 0;
+    }
+
+    TokenDynamicArray tokens;
+    create_token_array(&tokens);
+
+    if (!tokenize(&tokens, line)) {
+        free_token_array(&tokens);
+        return -1;
+    }
+
+    AST ast;
+    TRACE_START(parse_start);
+    parse_ast(&ast, &tokens);
+    TRACE_END(parse_start, "parse_ast", NULL);
+
+    eval_parsed(ctx, &ast, line);
+
+    free_parse_tree(&ast);
+    free_token_array(&tokens);
 
-    cleanup_jobs();
-    clear_history();
     return 0;
 }
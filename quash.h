@@ -2,7 +2,11 @@
 #define __QUASH_SHELL_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <setjmp.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 1024
@@ -10,9 +14,27 @@
 
 #define JOBS_MAX 256
 
+/* must be power of 2 */
+#define HISTORY_TRIGRAM_SLOTS 4096
+
+/* number of ranked matches kept by a history search */
+#define HISTORY_SEARCH_MAX 32
+
 /* must be power of 2 */
 #define TABLE_BUCKETS 8
 
+/* must be power of 2 */
+#define DEFINITION_BUCKETS 64
+
+/* deepest nesting of function calls, one more fails instead of running out of stack */
+#define CALL_DEPTH_MAX 1000
+
+/* highest cpu number + 1 that `sched -c` and pipeline spreading can name */
+#define SCHED_CPUS_MAX 1024
+
+/* how often a `timeout` checks on a command where there are no pidfds */
+#define TIMEOUT_POLL_MS 10
+
 typedef enum TokenEnum {
     T_NONE,                 /* default empty token */
     T_EOS,                  /* end of token stream */
@@ -28,6 +50,12 @@ typedef enum TokenEnum {
     T_AMP,                  /*   & - used for signaling to run the job asynchronously */
     T_AMP_AMP,              /*  && - (AND) evaluate the rhs when lhs returns 0 */
     T_PIPE_PIPE,            /*  || - (OR)  evaluate the rhs when lhs returns nonzero */
+    T_TIME,                 /* time - report the resources used by the following pipeline */
+    T_SEMI,                 /*   ; - evaluate the lhs, then the rhs */
+    T_LPAREN,               /*   ( - start a subshell, as a node the subshell around `left` */
+    T_RPAREN,               /*   ) - end a subshell */
+    T_LBRACE,               /*   { - start a group, as a node the group around `left` */
+    T_RBRACE,               /*   } - end a group */
 } TokenEnum;
 
 typedef enum {
@@ -37,6 +65,10 @@ typedef enum {
     TF_BACKTICK_QUOTE_STRING = 0x08,  /* token is a backtick-quoted string */
     TF_VARIABLE_NAME         = 0x10,  /* token is suitable for use as a variable name */
     TF_OPERATOR              = 0x20,  /* token is an operator */
+    TF_GLOB_MATCH            = 0x40,  /* token is a path a glob pattern expanded to */
+    TF_INPUT_SUBST           = 0x80,  /* token is the command of a `<(cmd)` */
+    TF_OUTPUT_SUBST          = 0x100, /* token is the command of a `>(cmd)` */
+    TF_DEFERRED              = 0x200, /* token is kept as written, expanded when its command runs */
 } TokenFlags;
 
 typedef struct Token {
@@ -54,6 +86,7 @@ typedef struct TokenDynamicArray {
 
 typedef struct StringDynamicBuffer{
     int *strings;
+    unsigned char *flags;   /* TokenFlags for the token made from each string */
     char *buffer;
     size_t strings_used;
     size_t strings_reserved;
@@ -62,12 +95,47 @@ typedef struct StringDynamicBuffer{
 } StringDynamicBuffer;
 
 
+/* nodes refer to each other by their index in `AST.nodes` */
+typedef uint32_t node_t;
+
+#define NODE_NONE UINT32_MAX
+
 typedef struct _ASTNode {
-    struct _ASTNode *left;
-    struct _ASTNode *right;
-    Token token;
+    TokenEnum token;
+    union {
+        struct {            /* operators */
+            node_t left;
+            node_t right;
+        };
+        struct {            /* T_WORD, a command's words in `AST.words` */
+            uint32_t argv;
+            uint32_t argc;
+            uint32_t glob_first;    /* the words from the first to the last glob match */
+            uint32_t glob_count;
+        };
+    };
 } ASTNode;
 
+/* a word run as a process substitution, or expanded, instead of passed as it is */
+enum WordFlags {
+    WORD_INPUT_SUBST  = 0x01,   /* `<(cmd)`, a path to read what cmd writes */
+    WORD_OUTPUT_SUBST = 0x02,   /* `>(cmd)`, a path to write what cmd reads */
+    WORD_DEFERRED     = 0x04,   /* variables and globs in a function body, expanded at each call */
+    WORD_QUOTED       = 0x08,   /* a deferred word in double quotes, never globbed or dropped */
+};
+
+/* a parsed line, every node and every word of it in two arrays */
+typedef struct _AST {
+    ASTNode *nodes;
+    uint32_t length;
+    uint32_t slots;
+    char **words;           /* the argv of each command, NULL terminated */
+    unsigned char *word_flags;  /* WordFlags of each word, NULL while no word has any */
+    uint32_t words_length;
+    uint32_t words_slots;
+    node_t root;            /* NODE_NONE for an empty line */
+} AST;
+
 
 typedef enum {
     RI_READ_FILE,         /* cmd  < file */
@@ -120,13 +188,40 @@ typedef struct _Process {
     char *cmd;
     pid_t pid;
     int flags;
+    struct timespec start;      /* CLOCK_MONOTONIC time of the fork */
+    struct timespec end;        /* time the process was reaped */
+    struct rusage usage;        /* resource usage, filled in once reaped */
 } Process;
 
+/* what a `timeout` prefix asked for */
+typedef struct _TimeoutOptions {
+    double duration;            /* seconds from the start of the command, 0 for no deadline */
+    double kill_after;          /* seconds after the deadline to send SIGKILL, 0 for never */
+    int signal;                 /* sent at the deadline */
+} TimeoutOptions;
+
+/*
+ the deadline of a job with a `timeout`, enforced while the shell waits
+ for the job. the fds are kept here so a wait jumped out of by a signal
+ doesn't leak them
+*/
+typedef struct _JobTimeout {
+    int active;
+    struct timespec deadline;   /* CLOCK_MONOTONIC */
+    double kill_after;
+    int signal;
+    int sent;                   /* the last signal sent to the job, 0 before the deadline */
+    int timer_fd;               /* armed for the next signal, -1 until the job is waited for */
+    int pid_fd;                 /* of the process being waited for, or -1 */
+    volatile int awaited;       /* `wait_job` enforces it, the alarm leaves the job alone */
+} JobTimeout;
+
 typedef struct _Job {
     Process *processes;
     size_t process_count;
     int flags;
     int id;
+    JobTimeout timeout;
 } Job;
 
 typedef struct _Node {
@@ -141,4 +236,144 @@ typedef struct _JobHashTable {
     size_t elements;
 } JobHashTable;
 
+/*
+ the jobs of one shell context, job ids index `jobs` directly. `indices[n]`
+ is 0 while job n is in use
+*/
+typedef struct _JobTable {
+    Job jobs[JOBS_MAX];
+    job_t indices[JOBS_MAX];
+    JobHashTable pid_to_job;
+} JobTable;
+
+/*
+ sorted list of history entry ids containing a trigram
+*/
+typedef struct _TrigramPostings {
+    uint32_t *ids;
+    uint32_t length;
+    uint32_t slots;
+} TrigramPostings;
+
+/*
+ copy of the history with an open-addressed trigram -> postings table,
+ maintained incrementally as lines are added
+*/
+typedef struct _HistoryIndex {
+    char **entries;
+    size_t length;
+    size_t slots;
+
+    uint32_t *trigrams;         /* 0 marks an empty slot */
+    TrigramPostings *postings;
+    size_t trigram_slots;
+    size_t trigram_count;
+} HistoryIndex;
+
+/*
+ always-on counters of the work the shell does, printed by `qshstat`
+*/
+typedef struct _ShellStats {
+    uint64_t lines;             /* command lines evaluated */
+    uint64_t forks;
+    uint64_t execs;             /* forked children that exec a program */
+    uint64_t builtins;          /* builtins run in the shell process */
+    uint64_t forked_builtins;   /* builtins run in a forked child */
+    uint64_t hash_probes;       /* nodes visited in the pid -> job table */
+    uint64_t tokens;
+    uint64_t ast_nodes;
+    uint64_t bytes_allocated;   /* by token, AST, job and hash table storage */
+    uint64_t jobs_started;
+    uint64_t jobs_finished;
+    uint64_t sigchld_wakeups;
+    uint64_t function_calls;    /* run from their parsed body, never tokenized again */
+} ShellStats;
+
+/* the subsystems `--mem-stats` attributes allocations to */
+typedef enum MemTag {
+    MEM_TOKENIZER,          /* token arrays and the text of tokens */
+    MEM_PARSER,             /* syntax trees and the parser's stack */
+    MEM_JOBS,               /* processes and their command lines */
+    MEM_HASH,               /* chained nodes of the pid -> job table */
+    MEM_HISTORY,            /* history entries and their trigram index */
+    MEM_READLINE,           /* lines read by the line editor and readline's copies of them */
+    MEM_TAGS,
+} MemTag;
+
+/*
+ the scheduling a `sched` prefix or `set -o spread` asks for, applied in
+ the child before exec
+*/
+typedef struct _SchedOptions {
+    uint64_t cpus[SCHED_CPUS_MAX / 64]; /* bitmap, used if `has_cpus` */
+    int has_cpus;
+    int has_nice;
+    int nice;
+    int ioprio;                         /* class and level as packed for ioprio_set, -1 to leave it */
+} SchedOptions;
+
+/* something a `memo` key depends on besides the argv and cwd */
+typedef struct _MemoInput {
+    char kind;          /* 'e' a variable, 'f' a file's mtime and size, 'F' a file's contents */
+    char *value;
+} MemoInput;
+
+typedef struct _MemoOptions {
+    int enabled;
+    MemoInput *inputs;
+    size_t input_count;
+    size_t input_slots;
+} MemoOptions;
+
+/*
+ a function or an alias, its body tokenized and parsed once when it is
+ defined and evaluated from that AST by every call
+*/
+typedef struct _Definition {
+    struct _Definition *next;   /* in the same bucket */
+    char *name;
+    char *body;                 /* as written, for listing */
+    TokenDynamicArray tokens;   /* the words of `ast` point into these */
+    AST ast;
+    int refs;                   /* the table's, plus one per call still running it */
+} Definition;
+
+typedef struct _DefinitionTable {
+    Definition *buckets[DEFINITION_BUCKETS];
+    size_t count;
+} DefinitionTable;
+
+enum ContextFlags {
+    CTX_INTERACTIVE = 0x01,     /* owns the terminal, the signal handlers and the process */
+    CTX_BATCH       = 0x02,     /* `set -o batch`, split argvs too long to exec */
+    CTX_SPREAD      = 0x04,     /* `set -o spread`, put pipeline stages on separate cores */
+    CTX_TAIL_EXEC   = 0x08,     /* nothing runs after this shell's input, its last command may replace it */
+};
+
+/*
+ everything one shell needs to evaluate command lines. the interactive
+ shell has one, every embedder of libqsh creates its own
+*/
+typedef struct _QshContext {
+    JobTable jobs;
+    HistoryIndex history;
+    int flags;
+    int last_status;            /* exit status of the last foreground job */
+    int exit_requested;         /* `exit` ran in a context that may not exit the process */
+    volatile pid_t last_pid;    /* most recently forked child, reported if its job is suspended */
+    int timing;                 /* inside a `time` keyword */
+    struct rusage timed_usage;  /* of the children reaped while timing */
+    DefinitionTable functions;
+    DefinitionTable aliases;
+    char **params;              /* the argv of the function being called, `$0` on */
+    int param_count;
+    int call_depth;
+    int shell_fds[3];           /* stdin, stdout and stderr of the shell while a group redirects them */
+    int redirect_depth;         /* groups with redirects being evaluated */
+    AST *tail_ast;              /* with `CTX_TAIL_EXEC`, the tree being evaluated */
+    node_t tail;                /* and its command that runs last, which execs without a fork */
+    sigjmp_buf prompt;          /* back to the prompt after ^C or a background job exits */
+    sigjmp_buf suspended;       /* out of a foreground wait when the job is stopped */
+} QshContext;
+
 #endif /* __QUASH_SHELL_H__ */
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE /* sched_setaffinity */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "quash.h"
+#include "schedule.h"
+
+/*
+ `sched [-c cpus] [-n nice] [-i class[:level]] cmd` runs a command on a set
+ of cpus, at a nice value and in an I/O scheduling class, so CPU-bound
+ pipelines can be kept off the cores of latency sensitive services. The
+ settings are applied in the forked child before exec, the shell itself
+ is never moved.
+
+ `set -o spread` places the stages of every pipeline on different
+ physical cores of the same L3 cache: stages that stream data to each
+ other then don't compete for a core but still share the cache the data
+ passes through.
+*/
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static const char *ioprio_classes[] = { "none", "realtime", "best-effort", "idle" };
+
+void init_sched_options(SchedOptions *sched) {
+    memset(sched, 0, sizeof *sched);
+    sched->ioprio = -1;
+}
+
+static void add_cpu(SchedOptions *sched, int cpu) {
+    sched->cpus[cpu / 64] |= (uint64_t) 1 << (cpu % 64);
+    sched->has_cpus = 1;
+}
+
+/* a list like `0-3,8,10-11` */
+static int parse_cpu_list(const char *list, SchedOptions *sched) {
+    const char *c = list;
+
+    while (*c) {
+        char *end;
+        long first = strtol(c, &end, 10), last = first;
+
+        if (end == c) {
+            return 0;
+        }
+        if (*end == '-') {
+            c = end + 1;
+            last = strtol(c, &end, 10);
+            if (end == c) {
+                return 0;
+            }
+        }
+        if (first < 0 || last < first || last >= SCHED_CPUS_MAX || (*end != ',' && *end != '\0')) {
+            return 0;
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            add_cpu(sched, cpu);
+        }
+        c = *end == ',' ? end + 1 : end;
+    }
+
+    return sched->has_cpus;
+}
+
+/* `best-effort:7`, `idle` or by number like ionice, `2:7` */
+static int parse_ioprio(const char *text, SchedOptions *sched) {
+    const char *colon = strchr(text, ':');
+    size_t length = colon ? (size_t) (colon - text) : strlen(text);
+    int class = -1, level = 4;
+
+    for (int i = 1; i < 4; i++) {
+        if ((length == strlen(ioprio_classes[i]) && strncmp(text, ioprio_classes[i], length) == 0)
+            || (length == 1 && text[0] == '0' + i)) {
+            class = i;
+        }
+    }
+
+    if (class == -1) {
+        return 0;
+    }
+
+    if (colon) {
+        char *end;
+        level = strtol(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || level < 0 || level > 7) {
+            return 0;
+        }
+    }
+
+    /* the idle class has no levels */
+    sched->ioprio = class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+    return 1;
+}
+
+/**
+ * Read the options of a `sched` prefix.
+ *
+ * @param argc the number of words, argv[0] being `sched`
+ * @param sched filled in with the options
+ * @return how many words the prefix took, or `-1` after reporting an error
+ */
+int parse_sched_prefix(int argc, char **argv, SchedOptions *sched) {
+    int shift = 1;
+
+    for (; shift < argc && argv[shift][0] == '-'; shift++) {
+        const char *option = argv[shift];
+
+        if (strcmp(option, "--") == 0) {
+            shift++;
+            break;
+        }
+
+        if (strlen(option) != 2 || !strchr("cni", option[1])) {
+            fprintf(stderr, "sched: Unknown option: %s\n", option);
+            return -1;
+        }
+        if (++shift == argc) {
+            fprintf(stderr, "sched: %s needs a value\n", option);
+            return -1;
+        }
+
+        const char *value = argv[shift];
+        char *end;
+
+        switch (option[1]) {
+        case 'c':
+            if (!parse_cpu_list(value, sched)) {
+                fprintf(stderr, "sched: Bad cpu list: %s\n", value);
+                return -1;
+            }
+            break;
+        case 'n':
+            sched->nice = strtol(value, &end, 10);
+            if (end == value || *end != '\0') {
+                fprintf(stderr, "sched: Bad nice value: %s\n", value);
+                return -1;
+            }
+            sched->has_nice = 1;
+            break;
+        case 'i':
+            if (!parse_ioprio(value, sched)) {
+                fprintf(stderr, "sched: Bad I/O class: %s\n", value);
+                return -1;
+            }
+            break;
+        }
+    }
+
+    if (shift >= argc) {
+        fprintf(stderr, "sched: Usage sched [-c cpus] [-n nice] [-i class[:level]] command [args ...]\n");
+        return -1;
+    }
+
+    return shift;
+}
+
+/**
+ * In a forked child: move the process to the cpus, nice value and I/O
+ * class in `sched`.
+ *
+ * @return `1` on success, `0` after reporting what couldn't be applied
+ */
+int apply_sched_options(SchedOptions *sched) {
+#ifdef __linux__
+    if (sched->has_cpus) {
+        cpu_set_t *set = CPU_ALLOC(SCHED_CPUS_MAX);
+        size_t size = CPU_ALLOC_SIZE(SCHED_CPUS_MAX);
+
+        CPU_ZERO_S(size, set);
+        for (int cpu = 0; cpu < SCHED_CPUS_MAX; cpu++) {
+            if (sched->cpus[cpu / 64] & (uint64_t) 1 << (cpu % 64)) {
+                CPU_SET_S(cpu, size, set);
+            }
+        }
+
+        int failed = sched_setaffinity(0, size, set) == -1;
+        CPU_FREE(set);
+        if (failed) {
+            perror("sched: sched_setaffinity");
+            return 0;
+        }
+    }
+
+    if (sched->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched->ioprio) == -1) {
+        perror("sched: ioprio_set");
+        return 0;
+    }
+#else
+    if (sched->has_cpus || sched->ioprio != -1) {
+        fprintf(stderr, "sched: cpu sets and I/O classes are only supported on linux\n");
+        return 0;
+    }
+#endif
+
+    if (sched->has_nice && setpriority(PRIO_PROCESS, 0, sched->nice) == -1) {
+        perror("sched: setpriority");
+        return 0;
+    }
+
+    return 1;
+}
+
+#ifdef __linux__
+/* the first cpu in a sysfs cpu list, or `fallback` if it can't be read */
+static int first_cpu_in(const char *path, int fallback) {
+    FILE *file = fopen(path, "re");
+    int cpu;
+
+    if (file == NULL) {
+        return fallback;
+    }
+    if (fscanf(file, "%d", &cpu) != 1) {
+        cpu = fallback;
+    }
+
+    fclose(file);
+    return cpu;
+}
+
+/* a cpu that names the L3 `cpu` is behind, the same for every cpu sharing it */
+static int l3_of(int cpu) {
+    char path[128];
+
+    for (int index = 0; index < 8; index++) {
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        if (first_cpu_in(path, -1) == 3) {
+            snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+            return first_cpu_in(path, 0);
+        }
+    }
+
+    return 0;
+}
+
+static int core_of(int cpu) {
+    char path[128];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    return first_cpu_in(path, cpu);
+}
+#endif
+
+/* one cpu per core of the L3 with the most cores the shell may run on */
+static int spread_cpus[SCHED_CPUS_MAX];
+static size_t spread_count = 0;
+static pthread_once_t spread_once = PTHREAD_ONCE_INIT;
+
+static void read_topology() {
+#ifdef __linux__
+    static int l3[SCHED_CPUS_MAX], core[SCHED_CPUS_MAX], cores_in[SCHED_CPUS_MAX];
+    static char core_seen[SCHED_CPUS_MAX];
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == -1) {
+        return;
+    }
+
+    int best = -1;
+    for (int cpu = 0; cpu < SCHED_CPUS_MAX && cpu < CPU_SETSIZE; cpu++) {
+        l3[cpu] = core[cpu] = -1;
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        l3[cpu] = l3_of(cpu);
+        core[cpu] = core_of(cpu);
+        if (core[cpu] < 0 || core[cpu] >= SCHED_CPUS_MAX || l3[cpu] < 0 || l3[cpu] >= SCHED_CPUS_MAX) {
+            l3[cpu] = core[cpu] = -1;
+            continue;
+        }
+
+        if (!core_seen[core[cpu]]) {
+            core_seen[core[cpu]] = 1;
+            if (++cores_in[l3[cpu]] > (best == -1 ? 0 : cores_in[best])) {
+                best = l3[cpu];
+            }
+        }
+    }
+
+    memset(core_seen, 0, sizeof core_seen);
+    for (int cpu = 0; cpu < SCHED_CPUS_MAX && best != -1; cpu++) {
+        if (l3[cpu] == best && !core_seen[core[cpu]]) {
+            core_seen[core[cpu]] = 1;
+            spread_cpus[spread_count++] = cpu;
+        }
+    }
+#endif
+}
+
+/**
+ * The cpu for a stage of a pipeline under `set -o spread`. The topology is
+ * read from sysfs once per process.
+ *
+ * @param stage the position of the stage in its pipeline
+ * @return a cpu, or `-1` when there aren't two cores to spread over
+ */
+int spread_cpu(size_t stage) {
+    pthread_once(&spread_once, read_topology);
+
+    if (spread_count < 2) {
+        return -1;
+    }
+
+    return spread_cpus[stage % spread_count];
+}
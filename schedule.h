@@ -0,0 +1,11 @@
+#ifndef __QUASH_SCHEDULE_H__
+#define __QUASH_SCHEDULE_H__
+
+#include "quash.h"
+
+void init_sched_options(SchedOptions *sched);
+int parse_sched_prefix(int argc, char **argv, SchedOptions *sched);
+int apply_sched_options(SchedOptions *sched);
+int spread_cpu(size_t stage);
+
+#endif /* __QUASH_SCHEDULE_H__ */
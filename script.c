@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "quash.h"
+#include "arrays.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "jobs.h"
+#include "eval.h"
+#include "trace.h"
+#include "script.h"
+
+/*
+ Script loader for `qsh script.sh`. The file is read at once and split into
+ lines, and chunks of lines are tokenized and parsed on a pool of threads
+ while the shell evaluates the chunks before them in order.
+
+ Only lines whose tokens can't depend on what earlier lines do are parsed
+ ahead: a line with `$`, `~` or glob characters is tokenized when it is
+ reached, after the `export` or `cd` before it has run.
+*/
+
+typedef struct _ScriptLine {
+    char *text;                 /* into the file buffer, NUL terminated */
+    TokenDynamicArray tokens;
+    AST ast;
+    int parsed;                 /* `tokens` and `ast` were filled ahead of time */
+} ScriptLine;
+
+typedef struct _Script {
+    char *buffer;
+    ScriptLine *lines;
+    size_t line_count;
+
+    size_t chunk_count;
+    char *chunk_ready;
+    size_t next_chunk;          /* the next chunk a worker will parse */
+    size_t evaluated;           /* chunks evaluated so far */
+
+    pthread_mutex_t lock;
+    pthread_cond_t parsed;      /* signalled when a chunk is ready */
+    pthread_cond_t consumed;    /* signalled when a chunk has been evaluated */
+} Script;
+
+/* whether tokenizing `line` gives the same tokens at any point of the script */
+static int can_parse_ahead(const char *line) {
+    return strpbrk(line, "$~*?[") == NULL;
+}
+
+static void parse_chunk(Script *script, size_t chunk) {
+    size_t first = chunk * SCRIPT_CHUNK_LINES;
+    size_t last = first + SCRIPT_CHUNK_LINES;
+    if (last > script->line_count) {
+        last = script->line_count;
+    }
+
+    for (size_t n = first; n < last; n++) {
+        ScriptLine *line = &script->lines[n];
+
+        if (!can_parse_ahead(line->text)) {
+            continue;
+        }
+
+        create_token_array(&line->tokens);
+        if (!tokenize(&line->tokens, line->text)) {
+            /* tokenized again when reached so the error is reported in order */
+            free_token_array(&line->tokens);
+            continue;
+        }
+
+        parse_ast(&line->ast, &line->tokens);
+        line->parsed = 1;
+    }
+}
+
+static void* parse_worker(void *arg) {
+    Script *script = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&script->lock);
+
+        /* don't run too far ahead of the evaluator, parsed lines take memory */
+        while (script->next_chunk < script->chunk_count
+               && script->next_chunk >= script->evaluated + SCRIPT_LOOKAHEAD_CHUNKS) {
+            pthread_cond_wait(&script->consumed, &script->lock);
+        }
+
+        size_t chunk = script->next_chunk++;
+        pthread_mutex_unlock(&script->lock);
+
+        if (chunk >= script->chunk_count) {
+            return NULL;
+        }
+
+        TRACE_START(parse_start);
+        parse_chunk(script, chunk);
+        TRACE_END(parse_start, "parse_chunk", NULL);
+
+        pthread_mutex_lock(&script->lock);
+        script->chunk_ready[chunk] = 1;
+        pthread_cond_broadcast(&script->parsed);
+        pthread_mutex_unlock(&script->lock);
+    }
+}
+
+static char* read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    char *buffer = malloc(st.st_size + 1);
+    size_t length = 0;
+    ssize_t n;
+
+    while (length < (size_t) st.st_size && (n = read(fd, buffer + length, st.st_size - length)) > 0) {
+        length += n;
+    }
+
+    close(fd);
+    buffer[length] = '\0';
+    *size = length;
+    return buffer;
+}
+
+/* cut the buffer into NUL terminated lines */
+static void split_lines(Script *script, size_t size) {
+    size_t slots = 1024;
+    script->lines = malloc(slots * sizeof *script->lines);
+    script->line_count = 0;
+
+    char *start = script->buffer;
+    char *end = script->buffer + size;
+
+    while (start < end) {
+        char *newline = memchr(start, '\n', end - start);
+        if (newline) {
+            *newline = '\0';
+        }
+
+        if (script->line_count == slots) {
+            slots *= 2;
+            script->lines = realloc(script->lines, slots * sizeof *script->lines);
+        }
+
+        ScriptLine *line = &script->lines[script->line_count++];
+        memset(line, 0, sizeof *line);
+        line->text = start;
+
+        start = newline ? newline + 1 : end;
+    }
+}
+
+/* the index of the last line that isn't blank or a comment, or `line_count` */
+static size_t last_command_line(Script *script) {
+    for (size_t n = script->line_count; n > 0; n--) {
+        const char *text = script->lines[n - 1].text + strspn(script->lines[n - 1].text, " \t\r");
+        if (text[0] != '\0' && text[0] != '#') {
+            return n - 1;
+        }
+    }
+
+    return script->line_count;
+}
+
+static int thread_count(size_t chunks) {
+    /* the shell's own thread evaluates, the rest of the cpus parse */
+    long workers = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (workers < 0) {
+        workers = 0;
+    }
+    if (workers > SCRIPT_MAX_THREADS) {
+        workers = SCRIPT_MAX_THREADS;
+    }
+
+    return chunks < (size_t) workers ? (int) chunks : (int) workers;
+}
+
+/**
+ * Evaluate every line of a script file in order, with lines tokenized and
+ * parsed ahead of time on other threads.
+ *
+ * @param ctx the context to evaluate in
+ * @param path the script to run
+ * @return the exit status of the last foreground job, `1` if the file can't be read
+ */
+int run_script(QshContext *ctx, const char *path) {
+    Script script;
+    size_t size;
+    int tail_exec = ctx->flags & CTX_TAIL_EXEC;
+
+    memset(&script, 0, sizeof script);
+    if (!(script.buffer = read_file(path, &size))) {
+        return 1;
+    }
+
+    split_lines(&script, size);
+
+    /* only the last line that runs anything may replace the shell */
+    size_t last_line = last_command_line(&script);
+    ctx->flags &= ~CTX_TAIL_EXEC;
+    script.chunk_count = (script.line_count + SCRIPT_CHUNK_LINES - 1) / SCRIPT_CHUNK_LINES;
+    script.chunk_ready = calloc(script.chunk_count + 1, 1);
+    pthread_mutex_init(&script.lock, NULL);
+    pthread_cond_init(&script.parsed, NULL);
+    pthread_cond_init(&script.consumed, NULL);
+
+    pthread_t threads[SCRIPT_MAX_THREADS];
+    int threads_started = 0;
+    int wanted = thread_count(script.chunk_count);
+
+    /* a short script is parsed faster than a thread is started */
+    if (script.chunk_count > 1) {
+        /* the alarm for job deadlines must land on this thread, the one changing the job table */
+        sigset_t alarm_mask, old_mask;
+        sigemptyset(&alarm_mask);
+        sigaddset(&alarm_mask, SIGALRM);
+        pthread_sigmask(SIG_BLOCK, &alarm_mask, &old_mask);
+
+        for (; threads_started < wanted; threads_started++) {
+            if (pthread_create(&threads[threads_started], NULL, parse_worker, &script) != 0) {
+                break;
+            }
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    }
+
+    for (size_t chunk = 0; chunk < script.chunk_count; chunk++) {
+        if (threads_started > 0) {
+            pthread_mutex_lock(&script.lock);
+            while (!script.chunk_ready[chunk]) {
+                pthread_cond_wait(&script.parsed, &script.lock);
+            }
+            pthread_mutex_unlock(&script.lock);
+        } else {
+            parse_chunk(&script, chunk);
+        }
+
+        size_t first = chunk * SCRIPT_CHUNK_LINES;
+        size_t last = first + SCRIPT_CHUNK_LINES;
+        if (last > script.line_count) {
+            last = script.line_count;
+        }
+
+        for (size_t n = first; n < last; n++) {
+            ScriptLine *line = &script.lines[n];
+
+            if (n == last_line) {
+                ctx->flags |= tail_exec;
+            }
+
+            if (ctx->exit_requested) {
+                /* keep going only to free what was parsed */
+            } else if (line->parsed) {
+                eval_parsed(ctx, &line->ast, line->text);
+            } else if (eval_line(ctx, line->text) == -1) {
+                fprintf(stderr, "%s: line %zu: syntax error\n", path, n + 1);
+            }
+
+            if (line->parsed) {
+                free_parse_tree(&line->ast);
+                free_token_array(&line->tokens);
+            }
+        }
+
+        /* there is no SIGCHLD handler to pick up background jobs */
+        reap_jobs(&ctx->jobs);
+
+        pthread_mutex_lock(&script.lock);
+        script.evaluated = chunk + 1;
+        pthread_cond_broadcast(&script.consumed);
+        pthread_mutex_unlock(&script.lock);
+    }
+
+    for (int i = 0; i < threads_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&script.lock);
+    pthread_cond_destroy(&script.parsed);
+    pthread_cond_destroy(&script.consumed);
+    free(script.chunk_ready);
+    free(script.lines);
+    free(script.buffer);
+
+    return ctx->last_status;
+}
@@ -0,0 +1,16 @@
+#ifndef __QUASH_SCRIPT_H__
+#define __QUASH_SCRIPT_H__
+
+#include "quash.h"
+
+/* lines tokenized and parsed together by one worker */
+#define SCRIPT_CHUNK_LINES 256
+
+/* how many chunks the workers may parse ahead of the one being evaluated */
+#define SCRIPT_LOOKAHEAD_CHUNKS 64
+
+#define SCRIPT_MAX_THREADS 8
+
+int run_script(QshContext *ctx, const char *path);
+
+#endif /* __QUASH_SCRIPT_H__ */
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE /* struct ucred */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "quash.h"
+#include "eval.h"
+#include "server.h"
+
+/*
+ Command server, started with `qsh --server /path/sock`. The shell stays
+ resident and every client connection is served by a forked handler, so
+ clients are served concurrently. A client sends newline-terminated
+ requests:
+
+   cwd PATH         run the following commands in PATH
+   env NAME=VALUE   set NAME for the following commands
+   env NAME         unset NAME for the following commands
+   reset            forget the cwd and env settings of this connection
+   run LINE         evaluate LINE, replies `status N`
+
+ Up to three file descriptors may be passed with SCM_RIGHTS alongside a
+ request, they become stdin, stdout and stderr of the next `run`. Missing
+ ones are /dev/null. Every `run` is evaluated by `eval_line()` in a child
+ of its own so nothing it does leaks into the next command. Errors are
+ replied to as `error MESSAGE`.
+
+ A client can run anything as the server's user, so the socket is created
+ for its owner only whatever the umask, and a connection from another uid
+ (root, say) is hung up on before its first request.
+*/
+
+
+typedef struct _Connection {
+    QshContext *ctx;
+    int socket;
+    char *buffer;
+    size_t length;
+    size_t slots;
+    int fds[SERVER_MAX_FDS];
+    int fd_count;
+    char *cwd;
+    char **env;
+    size_t env_count;
+} Connection;
+
+static const char *socket_path;
+
+static void remove_socket() {
+    unlink(socket_path);
+    _exit(0);
+}
+
+static void reply(Connection *conn, const char *fmt, ...) {
+    char message[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(message, sizeof message, fmt, args);
+    va_end(args);
+
+    if (n > 0 && n < (int) sizeof message) {
+        write(conn->socket, message, n);
+    }
+}
+
+static void close_pending_fds(Connection *conn) {
+    for (int i = 0; i < conn->fd_count; i++) {
+        close(conn->fds[i]);
+    }
+
+    conn->fd_count = 0;
+}
+
+static void reset_connection(Connection *conn) {
+    for (size_t i = 0; i < conn->env_count; i++) {
+        free(conn->env[i]);
+    }
+
+    free(conn->env);
+    free(conn->cwd);
+    conn->env = NULL;
+    conn->env_count = 0;
+    conn->cwd = NULL;
+}
+
+/* read more of the stream, keeping any file descriptors sent with it */
+static ssize_t receive(Connection *conn) {
+    char control[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+
+    if (conn->slots - conn->length < 512) {
+        conn->slots *= 2;
+        conn->buffer = realloc(conn->buffer, conn->slots);
+    }
+
+    iov.iov_base = conn->buffer + conn->length;
+    iov.iov_len = conn->slots - conn->length - 1;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t n;
+#ifdef MSG_CMSG_CLOEXEC
+    int recv_flags = MSG_CMSG_CLOEXEC;
+#else
+    int recv_flags = 0;
+#endif
+
+    /* passed fds belong to the next `run`, not to what else the server starts */
+    while ((n = recvmsg(conn->socket, &msg, recv_flags)) == -1 && errno == EINTR) { }
+
+    if (n <= 0) {
+        return n;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    for (; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        int *fds = (int*) CMSG_DATA(cmsg);
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < count; i++) {
+            if (conn->fd_count < SERVER_MAX_FDS) {
+                conn->fds[conn->fd_count++] = fds[i];
+            } else {
+                close(fds[i]);
+            }
+        }
+    }
+
+    conn->length += n;
+    return n;
+}
+
+/* in the command's own child, never returns */
+static void run_isolated(Connection *conn, char *line) {
+    signal(SIGPIPE, SIG_DFL);
+
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(fd < conn->fd_count ? conn->fds[fd] : devnull, fd);
+    }
+
+    for (int i = 0; i < conn->fd_count; i++) {
+        if (conn->fds[i] > STDERR_FILENO) {
+            close(conn->fds[i]);
+        }
+    }
+
+    close(devnull);
+    close(conn->socket);
+
+    if (conn->cwd && chdir(conn->cwd) == -1) {
+        perror(conn->cwd);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < conn->env_count; i++) {
+        char *equals = strchr(conn->env[i], '=');
+
+        if (equals) {
+            *equals = '\0';
+            setenv(conn->env[i], equals + 1, 1);
+        } else {
+            unsetenv(conn->env[i]);
+        }
+    }
+
+    if (eval_line(conn->ctx, line) == -1) {
+        exit(2);
+    }
+
+    fflush(stdout);
+    exit(conn->ctx->last_status);
+}
+
+static void handle_request(Connection *conn, char *line) {
+    if (strncmp(line, "cwd ", 4) == 0) {
+        free(conn->cwd);
+        conn->cwd = strdup(line + 4);
+        reply(conn, "ok\n");
+    } else if (strncmp(line, "env ", 4) == 0) {
+        conn->env = realloc(conn->env, (conn->env_count + 1) * sizeof *conn->env);
+        conn->env[conn->env_count++] = strdup(line + 4);
+        reply(conn, "ok\n");
+    } else if (strcmp(line, "reset") == 0) {
+        reset_connection(conn);
+        close_pending_fds(conn);
+        reply(conn, "ok\n");
+    } else if (strncmp(line, "run ", 4) == 0) {
+        int status;
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            reply(conn, "error fork failed\n");
+            close_pending_fds(conn);
+            return;
+        } else if (pid == 0) {
+            run_isolated(conn, line + 4);
+        }
+
+        close_pending_fds(conn);
+
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) { }
+
+        if (WIFEXITED(status)) {
+            status = WEXITSTATUS(status);
+        } else if (WIFSIGNALED(status)) {
+            status = 128 + WTERMSIG(status);
+        }
+
+        reply(conn, "status %d\n", status);
+    } else {
+        reply(conn, "error unknown request %.200s\n", line);
+    }
+}
+
+/* whether the process on the other end of `socket` runs as this user */
+static int same_user(int socket) {
+#ifdef __APPLE__
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(socket, &uid, &gid) == -1) {
+        return 0;
+    }
+#else
+    struct ucred cred;
+    socklen_t length = sizeof cred;
+    uid_t uid;
+
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1) {
+        return 0;
+    }
+    uid = cred.uid;
+#endif
+
+    return uid == getuid();
+}
+
+/* serve one client until it hangs up, in a forked handler */
+static void serve_connection(QshContext *ctx, int socket) {
+    if (!same_user(socket)) {
+        close(socket);
+        exit(1);
+    }
+
+    Connection conn;
+    memset(&conn, 0, sizeof conn);
+    conn.ctx = ctx;
+    conn.socket = socket;
+    conn.slots = 4096;
+    conn.buffer = malloc(conn.slots);
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    while (receive(&conn) > 0) {
+        char *start = conn.buffer;
+        char *newline;
+
+        conn.buffer[conn.length] = '\0';
+        while ((newline = memchr(start, '\n', conn.length - (start - conn.buffer)))) {
+            *newline = '\0';
+            if (newline > start && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+
+            handle_request(&conn, start);
+            start = newline + 1;
+        }
+
+        /* keep a partial request for the next read */
+        conn.length -= start - conn.buffer;
+        memmove(conn.buffer, start, conn.length);
+    }
+
+    close_pending_fds(&conn);
+    reset_connection(&conn);
+    free(conn.buffer);
+    close(socket);
+    exit(0);
+}
+
+/**
+ * Listen on a Unix socket at `path` and evaluate the command lines clients
+ * send. Only returns if the socket cannot be set up.
+ *
+ * @param ctx the context commands are evaluated in, each in a copy of its own
+ * @param path where to create the socket, a socket left there is replaced
+ * @return `1` on error
+ */
+int run_server(QshContext *ctx, const char *path) {
+    struct sockaddr_un addr;
+    int listener;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "qsh: socket path too long: %s\n", path);
+        return 1;
+    }
+
+    if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* only the socket of an earlier server, never a file someone meant to keep */
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "qsh: %s: exists and is not a socket\n", path);
+            close(listener);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    /* connecting takes write permission on the socket, which the umask could hand out */
+    mode_t old_umask = umask(077);
+    int bound = bind(listener, (struct sockaddr*) &addr, sizeof addr);
+    umask(old_umask);
+
+    if (bound == -1 || listen(listener, 128) == -1) {
+        perror(path);
+        close(listener);
+        return 1;
+    }
+
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    socket_path = path;
+    signal(SIGINT, remove_socket);
+    signal(SIGTERM, remove_socket);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* handlers are never waited for */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+        } else if (pid == 0) {
+            close(listener);
+            serve_connection(ctx, client);
+        }
+
+        close(client);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef __QUASH_SERVER_H__
+#define __QUASH_SERVER_H__
+
+#include "quash.h"
+
+/* stdin, stdout and stderr of a command */
+#define SERVER_MAX_FDS 3
+
+int run_server(QshContext *ctx, const char *path);
+
+#endif /* __QUASH_SERVER_H__ */
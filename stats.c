@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "quash.h"
+#include "stats.h"
+#include "fds.h"
+#include "memstats.h"
+
+ShellStats shell_stats;
+
+static const struct {
+    const char *name;
+    size_t offset;
+} stat_fields[] = {
+    { "lines",           offsetof(ShellStats, lines) },
+    { "forks",           offsetof(ShellStats, forks) },
+    { "execs",           offsetof(ShellStats, execs) },
+    { "builtins",        offsetof(ShellStats, builtins) },
+    { "forked_builtins", offsetof(ShellStats, forked_builtins) },
+    { "hash_probes",     offsetof(ShellStats, hash_probes) },
+    { "tokens",          offsetof(ShellStats, tokens) },
+    { "ast_nodes",       offsetof(ShellStats, ast_nodes) },
+    { "bytes_allocated", offsetof(ShellStats, bytes_allocated) },
+    { "jobs_started",    offsetof(ShellStats, jobs_started) },
+    { "jobs_finished",   offsetof(ShellStats, jobs_finished) },
+    { "sigchld_wakeups", offsetof(ShellStats, sigchld_wakeups) },
+    { "function_calls",  offsetof(ShellStats, function_calls) },
+};
+
+#define STAT_FIELDS (sizeof stat_fields / sizeof *stat_fields)
+
+static uint64_t stat_value(size_t field) {
+    return *(uint64_t*) ((char*) &shell_stats + stat_fields[field].offset);
+}
+
+/**
+ * Print every counter, one `name value` pair per line, or as a single
+ * JSON object when `json` is set.
+ */
+void print_stats(FILE *out, int json) {
+    if (json) {
+        fprintf(out, "{");
+        for (size_t n = 0; n < STAT_FIELDS; n++) {
+            fprintf(out, "%s\"%s\":%" PRIu64, n ? "," : "", stat_fields[n].name, stat_value(n));
+        }
+        fprintf(out, "}\n");
+        return;
+    }
+
+    for (size_t n = 0; n < STAT_FIELDS; n++) {
+        fprintf(out, "%-16s %" PRIu64 "\n", stat_fields[n].name, stat_value(n));
+    }
+}
+
+int builtin_qshstat(int argc, char **argv) {
+    if (argc == 1) {
+        print_stats(stdout, 0);
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "-j") == 0) {
+        print_stats(stdout, 1);
+        return 0;
+    }
+
+    /* run in a forked child, which holds what the shell holds until it execs */
+    if (argc == 2 && strcmp(argv[1], "-f") == 0) {
+        print_open_fds(stdout);
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "-m") == 0) {
+        if (!mem_stats_enabled) {
+            fprintf(stderr, "qshstat: allocations are only accounted with qsh --mem-stats\n");
+            return -1;
+        }
+
+        print_mem_stats(stdout);
+        return 0;
+    }
+
+    fprintf(stderr, "qshstat: Usage qshstat [-j|-f|-m]\n");
+    return -1;
+}
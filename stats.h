@@ -0,0 +1,17 @@
+#ifndef __QUASH_STATS_H__
+#define __QUASH_STATS_H__
+
+#include <stdio.h>
+
+#include "quash.h"
+
+extern ShellStats shell_stats;
+
+/* relaxed atomics, the script loader tokenizes and parses on several threads */
+#define STAT_ADD(field, n) __atomic_fetch_add(&shell_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+void print_stats(FILE *out, int json);
+int builtin_qshstat(int argc, char **argv);
+
+#endif /* __QUASH_STATS_H__ */
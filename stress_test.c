@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "quash.h"
+#include "arrays.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "eval.h"
+#include "qsh.h"
+
+/*
+ lines far longer than anyone types, the kind that are generated. each one
+ would run the parser, evaluator or tree freeing out of stack if they
+ recursed per word or per operator
+*/
+
+#ifndef MANY
+#define MANY 1000000
+#endif
+#define PIPELINE_STAGES 200
+
+static QshContext context;
+static int failures = 0;
+
+/* `count` copies of `word`, separated by `sep`, after `head` */
+static char* repeat(const char *head, const char *word, const char *sep, size_t count, const char *tail) {
+    size_t word_len = strlen(word), sep_len = strlen(sep);
+    size_t len = strlen(head) + count * (word_len + sep_len) + strlen(tail) + 1;
+    char *line = malloc(len);
+    char *end = line;
+
+    end = stpcpy(end, head);
+    for (size_t i = 0; i < count; i++) {
+        memcpy(end, word, word_len);
+        end += word_len;
+        memcpy(end, sep, sep_len);
+        end += sep_len;
+    }
+    stpcpy(end, tail);
+
+    return line;
+}
+
+static void parse_words() {
+    char *line = repeat("echo", " w", "", MANY, "");
+    TokenDynamicArray tokens;
+
+    create_token_array(&tokens);
+    if (!tokenize(&tokens, line)) {
+        printf("words: tokenize failed\n");
+        failures++;
+    }
+
+    AST ast;
+    parse_ast(&ast, &tokens);
+    size_t words = ast.root == NODE_NONE ? 0 : ast.nodes[ast.root].argc;
+
+    if (words != MANY + 1) {
+        printf("words: parsed %zu words, expected %d\n", words, MANY + 1);
+        failures++;
+    }
+
+    free_parse_tree(&ast);
+    free_token_array(&tokens);
+    free(line);
+}
+
+/* the words after a redirect's target are still the command's, however many */
+static void parse_words_after_redirect() {
+    char *line = repeat("echo one > /dev/null", " w", "", MANY, "");
+    TokenDynamicArray tokens;
+
+    create_token_array(&tokens);
+    tokenize(&tokens, line);
+
+    AST ast;
+    parse_ast(&ast, &tokens);
+    node_t command = ast.root == NODE_NONE ? NODE_NONE : ast.nodes[ast.root].left;
+    size_t words = command == NODE_NONE || ast.nodes[command].token != T_WORD ? 0 : ast.nodes[command].argc;
+
+    if (words != MANY + 2) {
+        printf("words after redirect: parsed %zu words, expected %d\n", words, MANY + 2);
+        failures++;
+    }
+
+    free_parse_tree(&ast);
+    free_token_array(&tokens);
+    free(line);
+}
+
+static void parse_pipes() {
+    char *line = repeat("a", " | b", "", MANY, "");
+    TokenDynamicArray tokens;
+
+    create_token_array(&tokens);
+    tokenize(&tokens, line);
+
+    AST ast;
+    parse_ast(&ast, &tokens);
+    size_t pipes = 0;
+    for (node_t node = ast.root; node != NODE_NONE && ast.nodes[node].token == T_PIPE; node = ast.nodes[node].left) {
+        pipes++;
+    }
+
+    if (pipes != MANY) {
+        printf("pipes: parsed %zu pipes, expected %d\n", pipes, MANY);
+        failures++;
+    }
+
+    free_parse_tree(&ast);
+    free_token_array(&tokens);
+    free(line);
+}
+
+/* a command with millions of arguments, run as a builtin so nothing is exec'd */
+static void eval_words() {
+    char *line = repeat("export QSH_STRESS_WORDS=1", " w", "", MANY, "");
+
+    eval_line(&context, line);
+    if (context.last_status != -1) {
+        printf("eval words: export took %d arguments\n", MANY + 1);
+        failures++;
+    }
+
+    free(line);
+}
+
+static void eval_and_chain() {
+    char *line = repeat("export QSH_STRESS=1", " && export QSH_STRESS=1", "", MANY, " && export QSH_STRESS_AND=done");
+    const char *value;
+
+    eval_line(&context, line);
+    if (!(value = getenv("QSH_STRESS_AND")) || strcmp(value, "done") != 0) {
+        printf("eval &&: the end of the chain was not reached\n");
+        failures++;
+    }
+
+    free(line);
+}
+
+static void eval_or_chain() {
+    char *line = repeat("export", " || export", "", MANY, " || export QSH_STRESS_OR=done");
+    const char *value;
+
+    eval_line(&context, line);
+    if (!(value = getenv("QSH_STRESS_OR")) || strcmp(value, "done") != 0) {
+        printf("eval ||: the end of the chain was not reached\n");
+        failures++;
+    }
+
+    free(line);
+}
+
+static void eval_amp_chain() {
+    char *line = repeat("export QSH_STRESS=1", " & export QSH_STRESS=1", "", MANY, " & export QSH_STRESS_AMP=done");
+    const char *value;
+
+    /* `export` is an in-process builtin, so nothing is left in the background */
+    eval_line(&context, line);
+    if (!(value = getenv("QSH_STRESS_AMP")) || strcmp(value, "done") != 0) {
+        printf("eval &: the end of the chain was not reached\n");
+        failures++;
+    }
+
+    free(line);
+}
+
+static void eval_long_pipeline() {
+    char *line = repeat("echo stress", " | cat", "", PIPELINE_STAGES, "");
+    char data[64];
+    QshBuffer out = { .data = data, .size = sizeof data };
+    QshContext *ctx = qsh_create();
+
+    qsh_eval_capture(ctx, line, NULL, &out, NULL);
+    if (strcmp(out.data, "stress \n") != 0) {
+        printf("pipeline: got \"%s\" through %d stages\n", out.data, PIPELINE_STAGES);
+        failures++;
+    }
+
+    qsh_destroy(ctx);
+    free(line);
+}
+
+/* a pipeline's status is its last stage's, also when that one ran in the shell */
+static void eval_pipeline_status() {
+    static const struct {
+        const char *line;
+        int status;
+    } cases[] = {
+        { "false | pwd", 0 },
+        { "true | false", 1 },
+    };
+    char data[PATH_MAX + 2];
+    QshBuffer out = { .data = data, .size = sizeof data };
+    QshContext *ctx = qsh_create();
+
+    for (size_t i = 0; i < sizeof cases / sizeof *cases; i++) {
+        int status = -1;
+
+        qsh_eval_capture(ctx, cases[i].line, &status, &out, NULL);
+        if (status != cases[i].status) {
+            printf("pipeline status: `%s` gave %d, not %d\n", cases[i].line, status, cases[i].status);
+            failures++;
+        }
+    }
+
+    qsh_destroy(ctx);
+}
+
+int main() {
+    init_context(&context, 0);
+
+    parse_words();
+    parse_words_after_redirect();
+    parse_pipes();
+    eval_words();
+    eval_and_chain();
+    eval_or_chain();
+    eval_amp_chain();
+    eval_long_pipeline();
+    eval_pipeline_status();
+
+    free_context(&context);
+    return failures != 0;
+}
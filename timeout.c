@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+
+#include "quash.h"
+#include "timeout.h"
+
+/*
+ `timeout [-s SIG] [-k KILL_AFTER] DURATION cmd ...` puts a deadline on
+ the job the command is part of. The command is started like any other
+ and the shell enforces the deadline itself, while it waits for the job
+ (see `wait_job`) or with an alarm for one in the background (see
+ `check_job_timeouts`), so there is no extra process between them, and in
+ a pipeline the signal goes to every stage. The options may also come
+ after the duration.
+*/
+
+static const struct {
+    const char *name;
+    int number;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+    { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+};
+
+void init_timeout_options(TimeoutOptions *timeout) {
+    timeout->duration = 0;
+    timeout->kill_after = 0;
+    timeout->signal = SIGTERM;
+}
+
+/* a number of seconds, or of minutes, hours or days with an m, h or d after it */
+static int parse_duration(const char *text, double *seconds) {
+    char *end;
+    double value = strtod(text, &end);
+
+    if (end == text || value < 0) {
+        return 0;
+    }
+
+    switch (*end) {
+    case '\0':
+    case 's':
+        break;
+    case 'm':
+        value *= 60;
+        break;
+    case 'h':
+        value *= 60 * 60;
+        break;
+    case 'd':
+        value *= 24 * 60 * 60;
+        break;
+    default:
+        return 0;
+    }
+
+    if (*end != '\0' && end[1] != '\0') {
+        return 0;
+    }
+
+    *seconds = value;
+    return 1;
+}
+
+/* `TERM`, `SIGTERM` or `15` */
+static int parse_signal(const char *text) {
+    char *end;
+    long number = strtol(text, &end, 10);
+
+    if (end != text && *end == '\0') {
+        return number > 0 && number < NSIG ? (int) number : -1;
+    }
+
+    if (strncasecmp(text, "SIG", 3) == 0) {
+        text += 3;
+    }
+
+    for (size_t i = 0; i < sizeof signal_names / sizeof *signal_names; i++) {
+        if (strcasecmp(text, signal_names[i].name) == 0) {
+            return signal_names[i].number;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Read the options and duration of a `timeout` prefix.
+ *
+ * @param argc the number of words, argv[0] being `timeout`
+ * @param timeout filled in with the options
+ * @return how many words the prefix took, or `-1` after reporting an error
+ */
+int parse_timeout_prefix(int argc, char **argv, TimeoutOptions *timeout) {
+    int have_duration = 0;
+    int options = 1;
+    int shift = 1;
+
+    while (shift < argc) {
+        const char *word = argv[shift];
+
+        if (options && strcmp(word, "--") == 0) {
+            options = 0;
+            shift++;
+            continue;
+        }
+
+        if (options && word[0] == '-' && (word[1] == 's' || word[1] == 'k') && word[2] == '\0') {
+            if (++shift == argc) {
+                fprintf(stderr, "timeout: %s needs a value\n", word);
+                return -1;
+            }
+
+            if (word[1] == 's' && (timeout->signal = parse_signal(argv[shift])) == -1) {
+                fprintf(stderr, "timeout: Bad signal: %s\n", argv[shift]);
+                return -1;
+            } else if (word[1] == 'k' && !parse_duration(argv[shift], &timeout->kill_after)) {
+                fprintf(stderr, "timeout: Bad duration: %s\n", argv[shift]);
+                return -1;
+            }
+
+            shift++;
+            continue;
+        }
+
+        /* after the duration anything else is the command */
+        if (have_duration) {
+            break;
+        }
+
+        if (options && word[0] == '-') {
+            fprintf(stderr, "timeout: Unknown option: %s\n", word);
+            return -1;
+        }
+        if (!parse_duration(word, &timeout->duration)) {
+            fprintf(stderr, "timeout: Bad duration: %s\n", word);
+            return -1;
+        }
+
+        have_duration = 1;
+        shift++;
+    }
+
+    if (!have_duration || shift >= argc) {
+        fprintf(stderr, "timeout: Usage timeout [-s signal] [-k duration] duration command [args ...]\n");
+        return -1;
+    }
+
+    return shift;
+}
@@ -0,0 +1,9 @@
+#ifndef __QUASH_TIMEOUT_H__
+#define __QUASH_TIMEOUT_H__
+
+#include "quash.h"
+
+void init_timeout_options(TimeoutOptions *timeout);
+int parse_timeout_prefix(int argc, char **argv, TimeoutOptions *timeout);
+
+#endif /* __QUASH_TIMEOUT_H__ */
@@ -6,6 +6,8 @@
 
 #include "quash.h"
 #include "arrays.h"
+#include "tokenizer.h"
+#include "trace.h"
 
 
 Token make_token(TokenEnum type, TokenFlags flags) {
@@ -33,6 +35,9 @@ static int is_metachar(char c) {
     case '\'':
     case '\"':
     case '`':
+    case ';':
+    case '(':
+    case ')':
         return 1;
     default:
         return 0;
@@ -69,7 +74,37 @@ static size_t next_quote_char(char *string, char quotechar, size_t index) {
     return string[index] ? index : ULONG_MAX;
 }
 
-static char* expand_variables(char *string) {
+/* the `)` closing the `(` at `index`, past nested parentheses and quotes */
+static size_t closing_paren(char *string, size_t index) {
+    int depth = 0;
+
+    for (; string[index]; index++) {
+        if (string[index] == '\'' || string[index] == '\"' || string[index] == '`') {
+            index = next_quote_char(string, string[index], index);
+            if (index == ULONG_MAX) {
+                return ULONG_MAX;
+            }
+        } else if (string[index] == '(') {
+            depth++;
+        } else if (string[index] == ')' && --depth == 0) {
+            return index;
+        }
+    }
+
+    return ULONG_MAX;
+}
+
+/* `$1`, `$#`, `$@` and `$*` name parameters of a function call */
+static int special_parameter(char c) {
+    return c == '#' || c == '@' || c == '*';
+}
+
+static const char* lookup_environment(const char *name, void *data) {
+    (void) data;
+    return getenv(name);
+}
+
+static char* expand_variables_with(char *string, VariableLookup lookup, void *data) {
     if (!string) {
         return NULL;
     }
@@ -93,17 +128,25 @@ static char* expand_variables(char *string) {
         }
 
         if (start_of_variable(string[i])) {
-            size_t end = i;
+            size_t end = i + 1;
 
-            do {
+            if (special_parameter(string[end])) {
                 end++;
-            } while (is_var_char(string[end]));
+            } else if (is_number(string[end])) {
+                while (is_number(string[end])) {
+                    end++;
+                }
+            } else {
+                do {
+                    end++;
+                } while (is_var_char(string[end]));
+            }
 
             char end_char = string[end];
             string[end] = '\0';
 
             /* it's ok if var is NULL */
-            char *var = getenv(&string[i+1]);
+            const char *var = lookup(&string[i+1], data);
             size_t var_len = var ? strlen(var) : 0;
             string[end] = end_char;
 
@@ -124,11 +167,30 @@ static char* expand_variables(char *string) {
     if (j > 0) {
         result = realloc(result, j + 1);
         strncpy(result + j - (i - k), string + k, i - k + 1);
+    } else if (result) {
+        /* only unset variables */
+        result[0] = '\0';
     }
 
     return result;
 }
 
+static char* expand_variables(char *string) {
+    return expand_variables_with(string, lookup_environment, NULL);
+}
+
+/**
+ * Expand the variables of a word `tokenize_deferred` kept as it was written.
+ *
+ * @param text the word, modified while it is read
+ * @param lookup finds the value of a variable, NULL when it is unset
+ * @param data passed on to `lookup`
+ * @return the expanded word, malloc'd, or NULL if it expanded to nothing
+ */
+char* expand_deferred(char *text, VariableLookup lookup, void *data) {
+    return expand_variables_with(text, lookup, data);
+}
+
 
 /* ---------------------------- */
 /*        glob expansion        */
@@ -137,9 +199,10 @@ static char* expand_variables(char *string) {
 /**
  * @param strings an initialized string buffer to fill with the glob-expanded string
  * @param input the original input string
+ * @param defer leave globs to be expanded when the command runs
  * @returns `1` on success, `0` on failure
  */
-static int expand_globs(StringDynamicBuffer *strings, char *input) {
+static int expand_globs(StringDynamicBuffer *strings, char *input, int defer) {
     static int glob_flags = GLOB_NOSORT | GLOB_NOCHECK;
     glob_t globbuf;
     memset(&globbuf, 0, sizeof globbuf);
@@ -164,15 +227,27 @@ static int expand_globs(StringDynamicBuffer *strings, char *input) {
         if (is_word_char(input[i])) {
             int word_start = i;
 
-            /* increment `i` until it is no longer indexing a word char */
-            for (i += 1; input[i] && is_word_char(input[i]); i++) { }
+            /* increment `i` until it is no longer indexing a word char, `$#` is one word */
+            for (i += 1; input[i] && (is_word_char(input[i]) || (input[i] == '#' && input[i - 1] == '$')); i++) { }
+
+            if (defer) {
+                append_string(strings, input + word_start, i - word_start);
+                continue;
+            }
 
             char temp = input[i];
             input[i] = '\0';
             glob(input + word_start, glob_flags, NULL, &globbuf);
 
+            /* GLOB_NOCHECK hands back the pattern itself when nothing matched */
+            int matched = strpbrk(input + word_start, "*?[") != NULL
+                && !(globbuf.gl_pathc == 1 && strcmp(globbuf.gl_pathv[0], input + word_start) == 0);
+
             for (size_t j = 0; j < globbuf.gl_pathc; j++) {
                 append_string(strings, globbuf.gl_pathv[j], 0);
+                if (matched) {
+                    strings->flags[strings->strings_used - 1] = TF_GLOB_MATCH;
+                }
             }
 
             input[i] = temp;
@@ -180,6 +255,18 @@ static int expand_globs(StringDynamicBuffer *strings, char *input) {
             continue;
         }
 
+        /* a process substitution is tokenized when its command runs */
+        if ((input[i] == '<' || input[i] == '>') && input[i + 1] == '(') {
+            size_t paren_end = closing_paren(input, i + 1);
+            if (paren_end == ULONG_MAX) {
+                return 0;
+            }
+
+            append_string(strings, input + i, paren_end - i + 1);
+            i = paren_end + 1;
+            continue;
+        }
+
         if (input[i] == '$') {
             int var_start = i;
 
@@ -249,6 +336,15 @@ static void tokenize_metachar(char *input, TokenDynamicArray *tokens) {
                 append_token(tokens, make_token(T_GREATER, TF_OPERATOR)); i++;
             } 
             break;
+        case ';':
+            append_token(tokens, make_token(T_SEMI, TF_OPERATOR)); i++;
+            break;
+        case '(':
+            append_token(tokens, make_token(T_LPAREN, TF_OPERATOR)); i++;
+            break;
+        case ')':
+            append_token(tokens, make_token(T_RPAREN, TF_OPERATOR)); i++;
+            break;
         default:
             append_token(tokens, make_token(T_ERROR, 0));
             return;
@@ -256,10 +352,32 @@ static void tokenize_metachar(char *input, TokenDynamicArray *tokens) {
     }
 }
 
-static void tokenize_chunk(char *string, TokenDynamicArray *tokens) {
+/* a word whose variables and globs wait until its command runs */
+static Token deferred_word(char *string, TokenFlags flags) {
+    return (Token) { .text = strdup(string), .token = T_WORD, .flags = flags | TF_DEFERRED };
+}
+
+static void tokenize_chunk(char *string, TokenDynamicArray *tokens, int defer) {
     int expanded_tilde = 0;
     Token t;
 
+    if (defer && string[0] == '\"' && strchr(string, '$')) {
+        append_token(tokens, deferred_word(string + 1, TF_DOUBLE_QUOTE_STRING));
+        return;
+    }
+    if (defer && (string[0] == '$' || (strchr("\"'`~<>&|#", string[0]) == NULL && strpbrk(string, "$*?[")))) {
+        append_token(tokens, deferred_word(string, 0));
+        return;
+    }
+
+    if ((string[0] == '<' || string[0] == '>') && string[1] == '(') {
+        t.token = T_WORD;
+        t.flags = string[0] == '<' ? TF_INPUT_SUBST : TF_OUTPUT_SUBST;
+        t.text = strndup(string + 2, strlen(string) - 3);
+        append_token(tokens, t);
+        return;
+    }
+
     switch (string[0]) {
     case '\'':
         t.token = T_WORD;
@@ -289,6 +407,9 @@ static void tokenize_chunk(char *string, TokenDynamicArray *tokens) {
     case '<':
     case '&':
     case '|':
+    case ';':
+    case '(':
+    case ')':
         tokenize_metachar(string, tokens);
         return;
     case '~':
@@ -348,28 +469,108 @@ static void tokenize_chunk(char *string, TokenDynamicArray *tokens) {
     append_token(tokens, t);
 }
 
-int tokenize(TokenDynamicArray *tokens, char *input) {
+static TokenEnum previous_token(TokenDynamicArray *tokens, size_t index) {
+    return index == 0 ? T_NONE : tokens->tuples[index - 1].token;
+}
+
+/* whether the token at `index` starts a command, i.e. follows a list operator or opens a group */
+static int command_position(TokenDynamicArray *tokens, size_t index) {
+    switch (previous_token(tokens, index)) {
+    case T_NONE:
+    case T_AMP:
+    case T_AMP_AMP:
+    case T_PIPE_PIPE:
+    case T_SEMI:
+    case T_LPAREN:
+    case T_LBRACE:
+    case T_TIME:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ unquoted reserved words at the start of a command become keyword tokens.
+ a group can also be a stage of a pipeline, and a `}` closes a group after
+ a `;` or `&` or right after another group
+*/
+static void tokenize_keyword(TokenDynamicArray *tokens, size_t index) {
+    Token *t = &tokens->tuples[index];
+    TokenEnum previous = previous_token(tokens, index);
+
+    if (t->token != T_WORD || (t->flags & (TF_DOUBLE_QUOTE_STRING | TF_SINGLE_QUOTE_STRING | TF_DEFERRED))) {
+        return;
+    }
+
+    if (strcmp(t->text, "time") == 0 && command_position(tokens, index)) {
+        t->token = T_TIME;
+    } else if (strcmp(t->text, "{") == 0 && (command_position(tokens, index) || previous == T_PIPE)) {
+        t->token = T_LBRACE;
+    } else if (strcmp(t->text, "}") == 0
+               && (command_position(tokens, index) || previous == T_RBRACE || previous == T_RPAREN)) {
+        t->token = T_RBRACE;
+    }
+}
+
+static int tokenize_input(TokenDynamicArray *tokens, char *input, int defer) {
+    TRACE_START(tokenize_start);
     StringDynamicBuffer strings; 
     create_string_array(&strings);
 
-    if (!expand_globs(&strings, input)) {
+    TRACE_START(glob_start);
+    if (!expand_globs(&strings, input, defer)) {
         free_string_array(&strings);
         return 0;
     }
+    TRACE_END(glob_start, "expand_globs", NULL);
 
     for (size_t i = 0; i < strings.strings_used; i++) {
-        tokenize_chunk(strings.buffer + strings.strings[i], tokens);
+        size_t first = tokens->length;
+
+        if (strings.flags[i] & TF_GLOB_MATCH) {
+            /* a file name is a word as it is, even one starting with `$` or `#` */
+            append_token(tokens, (Token) {
+                .text = strdup(strings.buffer + strings.strings[i]),
+                .token = T_WORD,
+                .flags = TF_GLOB_MATCH,
+            });
+            continue;
+        }
+
+        tokenize_chunk(strings.buffer + strings.strings[i], tokens, defer);
+        if (tokens->length == first + 1) {
+            tokenize_keyword(tokens, first);
+        }
+
         if (tokens->length > 0 && tokens->tuples[tokens->length - 1].token == T_EOS) {
             free_string_array(&strings);
+            TRACE_END(tokenize_start, "tokenize", NULL);
             return 1;
         }
     }
 
     append_token(tokens, make_token(T_EOS, 0));
     free_string_array(&strings);
+    TRACE_END(tokenize_start, "tokenize", NULL);
     return 1;
 }
 
-int redirect(Token token) {
-    return (token.token >= T_GREATER) && (token.token <= T_GREATER_GREATER_AMP);
+int tokenize(TokenDynamicArray *tokens, char *input) {
+    return tokenize_input(tokens, input, 0);
+}
+
+/**
+ * Tokenize a body that is kept and run many times, like a function's:
+ * words with variables or globs are left as they are and flagged
+ * `TF_DEFERRED`, to be expanded each time their command runs.
+ *
+ * @return `1` on success, `0` on failure
+ */
+int tokenize_deferred(TokenDynamicArray *tokens, char *input) {
+    return tokenize_input(tokens, input, 1);
+}
+
+int redirect(TokenEnum token) {
+    return (token >= T_GREATER) && (token <= T_GREATER_GREATER_AMP);
 }
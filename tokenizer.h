@@ -4,7 +4,12 @@
 #include "arrays.h"
 #include "quash.h"
 
+/* the value of a variable when a deferred word is expanded, NULL if it is unset */
+typedef const char* (*VariableLookup)(const char *name, void *data);
+
 int tokenize(TokenDynamicArray *tokens, char *input);
-int redirect(Token token);
+int tokenize_deferred(TokenDynamicArray *tokens, char *input);
+char* expand_deferred(char *text, VariableLookup lookup, void *data);
+int redirect(TokenEnum token);
 
 #endif /* __QUASH_TOKENIZER_H__ */
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "quash.h"
+#include "trace.h"
+
+/*
+ Chrome trace-event output. Events are appended to the trace file as they
+ complete using the JSON array format, one write(2) per event, so forked
+ children can add their own events to the same file before they exec and a
+ trace cut short by a crash still loads in Perfetto or chrome://tracing.
+*/
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+
+/* forked children share the file but must not end the trace when they exit */
+static pid_t trace_owner = 0;
+
+double trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* copy `src` into `dst` as the body of a JSON string */
+static size_t escape_json(char *dst, size_t size, const char *src) {
+    size_t n = 0;
+
+    for (; src && *src && n + 7 < size; src++) {
+        unsigned char c = *src;
+
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(dst + n, size - n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+
+    dst[n] = '\0';
+    return n;
+}
+
+static void write_event(const char *name, const char *phase, double ts, double dur,
+                        pid_t pid, pid_t tid, pid_t id, const char *detail) {
+    char event[1024];
+    char escaped[512];
+    int n;
+
+    escape_json(escaped, sizeof escaped, detail);
+    n = snprintf(event, sizeof event,
+        "{\"name\":\"%s\",\"cat\":\"qsh\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+        name, phase, ts, pid, tid);
+
+    if (phase[0] == 'X') {
+        n += snprintf(event + n, sizeof event - n, ",\"dur\":%.3f", dur);
+    } else if (phase[0] == 'b' || phase[0] == 'e') {
+        n += snprintf(event + n, sizeof event - n, ",\"id\":%d", id);
+    } else if (phase[0] == 'i') {
+        n += snprintf(event + n, sizeof event - n, ",\"s\":\"t\"");
+    }
+
+    if (detail) {
+        n += snprintf(event + n, sizeof event - n, ",\"args\":{\"detail\":\"%s\"}", escaped);
+    }
+
+    n += snprintf(event + n, sizeof event - n, "},\n");
+
+    if (n > (int) sizeof event - 1) {
+        return;
+    }
+
+    write(trace_fd, event, n);
+}
+
+/**
+ * Start appending trace events to `path`, truncating it.
+ *
+ * @return `1` on success, `0` if the file could not be opened
+ */
+int trace_open(const char *path) {
+    trace_close();
+
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        perror(path);
+        return 0;
+    }
+
+    char header[128];
+    int n = snprintf(header, sizeof header,
+        "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"qsh\"}},\n", getpid());
+    write(trace_fd, header, n);
+
+    trace_owner = getpid();
+    trace_enabled = 1;
+    return 1;
+}
+
+void trace_close() {
+    if (trace_fd == -1 || getpid() != trace_owner) {
+        return;
+    }
+
+    char footer[128];
+    int n = snprintf(footer, sizeof footer,
+        "{\"name\":\"trace_end\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}\n]\n",
+        trace_now(), getpid(), getpid());
+    write(trace_fd, footer, n);
+
+    close(trace_fd);
+    trace_fd = -1;
+    trace_enabled = 0;
+}
+
+/* a span of the shell's own work, from `start` until now */
+void trace_span(const char *name, double start, const char *detail) {
+    double end = trace_now();
+    write_event(name, "X", start, end - start, getpid(), getpid(), 0, detail);
+}
+
+/*
+ called in a forked child just before exec. the span from the fork to the
+ exec is drawn on a track of the child's own so spawn latency is visible.
+*/
+void trace_spawn(double fork_start, const char *detail) {
+    double end = trace_now();
+    write_event("spawn", "X", fork_start, end - fork_start, getppid(), getpid(), 0, detail);
+}
+
+/* a child's lifetime is an async span opened at fork and closed at reap */
+void trace_child_begin(pid_t pid, double start, const char *detail) {
+    write_event("child", "b", start, 0, getpid(), getpid(), pid, detail);
+}
+
+void trace_child_end(pid_t pid) {
+    write_event("child", "e", trace_now(), 0, getpid(), getpid(), pid, NULL);
+}
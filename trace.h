@@ -0,0 +1,22 @@
+#ifndef __QUASH_TRACE_H__
+#define __QUASH_TRACE_H__
+
+#include "quash.h"
+
+extern int trace_enabled;
+
+/* when tracing is off these only test a flag, the clock is never read */
+#define TRACE_START(var) double var = trace_enabled ? trace_now() : 0
+#define TRACE_END(var, name, detail) do { \
+        if (trace_enabled && (var) != 0) trace_span((name), (var), (detail)); \
+    } while (0)
+
+double trace_now();
+int trace_open(const char *path);
+void trace_close();
+void trace_span(const char *name, double start, const char *detail);
+void trace_spawn(double fork_start, const char *detail);
+void trace_child_begin(pid_t pid, double start, const char *detail);
+void trace_child_end(pid_t pid);
+
+#endif /* __QUASH_TRACE_H__ */